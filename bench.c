@@ -0,0 +1,855 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * benchmark driver: runs workloads through the protocol engine (proto.h)
+ * inside the process, so that neither a network nor a DOS client is needed,
+ * and checks the optimised routines against their reference. Requests are
+ * built and answers are checked the way a client would, and every request
+ * is timed.
+ */
+
+#include <dirent.h>          /* opendir(), readdir() */
+#include <stdio.h>
+#include <stdlib.h>          /* atol() */
+#include <string.h>
+#include <sys/stat.h>        /* lstat() */
+#include <time.h>            /* clock_gettime(), localtime_r(), tzset() */
+
+#include "cksum.h"           /* bsdsum(), crc32c() */
+#include "fs.h"              /* filename2fcb(), filenames2fcb(), time2dos() */
+#include "lz.h"              /* lz_compress(), lz_decompress() */
+#include "proto.h"
+#include "stats.h"           /* stats_latency(), stats_report() */
+
+/* simulated clients (each one has its own answer cache entry) */
+#define BENCH_CLIENTS 4
+
+/* files each soak client cycles through */
+#define SOAK_FILES 32
+
+/* buckets of latency histograms, bucket n holds latencies below 2^n us */
+#define BENCH_BUCKETS 32
+
+/* files and directories the opcode mix picks its targets from */
+#define MIX_SAMPLES 4096
+
+static struct dfsctx ctx;
+
+static struct benchclient {
+  unsigned char mac[6];
+  unsigned char seq;
+} clients[BENCH_CLIENTS];
+
+/* requests that did not get the answer they should have */
+static unsigned long failures;
+
+/* latency of the last call(), in us */
+static unsigned long lastlat;
+
+/* log2 latency histogram */
+struct hist {
+  unsigned long calls, max;
+  unsigned long bucket[BENCH_BUCKETS];
+};
+
+/* results of timed calls, so that they are not optimised away */
+static unsigned long sink;
+
+static unsigned long long prngstate = 1;
+
+/* xorshift64 */
+static unsigned long prng(void) {
+  prngstate ^= prngstate << 13;
+  prngstate ^= prngstate >> 7;
+  prngstate ^= prngstate << 17;
+  return((unsigned long)(prngstate >> 16));
+}
+
+/* returns a monotonic timestamp, in microseconds */
+static unsigned long long usnow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* accounts for a latency of us microseconds in h */
+static void histadd(struct hist *h, unsigned long us) {
+  int b;
+  for (b = 0; (b < BENCH_BUCKETS - 1) && ((1ul << b) <= us); b++);
+  h->bucket[b]++;
+  h->calls++;
+  if (us > h->max) h->max = us;
+}
+
+/* returns the latency (us) below which lie pct percent of the calls in h,
+ * rounded up to a power of 2 (but not above the longest one) */
+static unsigned long histpct(const struct hist *h, int pct) {
+  unsigned long long seen = 0, want = (h->calls * (unsigned long long)pct + 99) / 100;
+  int b;
+  for (b = 0; b < BENCH_BUCKETS - 1; b++) {
+    seen += h->bucket[b];
+    if (seen >= want) break;
+  }
+  return(((1ul << b) < h->max) ? (1ul << b) : h->max);
+}
+
+/* sends query al with payload (len bytes) for drive C: on behalf of client
+ * c. sets *ax and *answ to the AX and payload of the answer, and returns
+ * the length of the payload, or -1 if no answer came back. */
+static int call(struct benchclient *c, int al, const void *payload, int len, unsigned short *ax, unsigned char **answ) {
+  unsigned char frame[FRAME_MAX];
+  unsigned char *res;
+  unsigned long long start;
+  int reslen;
+  if (60 + len > FRAME_MAX) return(-1);
+  memset(frame, 0, 60);
+  memcpy(frame, ctx.mymac, 6);
+  memcpy(frame + 6, c->mac, 6);
+  frame[12] = ETHERTYPE_DFS >> 8;
+  frame[13] = ETHERTYPE_DFS & 0xff;
+  frame[52] = (60 + len) & 0xff;
+  frame[53] = (60 + len) >> 8;
+  frame[56] = PROTOVER;
+  frame[57] = ++(c->seq);
+  frame[58] = 2; /* C: */
+  frame[59] = al;
+  if (len > 0) memcpy(frame + 60, payload, len);
+  start = usnow();
+  reslen = dfs_handleframe(&ctx, frame, 60 + len, &res);
+  lastlat = (unsigned long)(usnow() - start);
+  stats_latency(lastlat);
+  if (reslen < 60) return(-1);
+  *ax = res[58] | (res[59] << 8);
+  *answ = res + 60;
+  return(reslen - 60);
+}
+
+/* same as call(), for queries whose payload is a DOS path preceded by
+ * prefixlen bytes of prefix */
+static int callpath(struct benchclient *c, int al, const void *prefix, int prefixlen, const char *path, unsigned short *ax, unsigned char **answ) {
+  unsigned char payload[256];
+  int len = strlen(path);
+  if (prefixlen + len > (int)sizeof(payload)) return(-1);
+  if (prefixlen > 0) memcpy(payload, prefix, prefixlen);
+  memcpy(payload + prefixlen, path, len);
+  return(call(c, al, payload, prefixlen + len, ax, answ));
+}
+
+/* like callpath(), counts a failure unless AX is 0 */
+static int expect(struct benchclient *c, int al, const void *prefix, int prefixlen, const char *path, unsigned char **answ) {
+  unsigned short ax = 0;
+  int len = callpath(c, al, prefix, prefixlen, path, &ax, answ);
+  if ((len < 0) || (ax != 0)) {
+    fprintf(stderr, "%s '%s' failed (AX=%u)\n", dfs_opname(al), path, (len < 0) ? 0xffffu : ax);
+    failures++;
+    return(-1);
+  }
+  return(len);
+}
+
+/* lists directory dir (a DOS path ending with a backslash) through
+ * FindFirst/FindNext, returns the number of entries found */
+static int listdir(struct benchclient *c, const char *dir) {
+  char path[128];
+  unsigned char attr = 0x3f, next[16], *answ;
+  unsigned short ax;
+  int count = 0;
+  sprintf(path, "%s????????.???", dir);
+  if ((callpath(c, 0x1B, &attr, 1, path, &ax, &answ) < 24) || (ax != 0)) return(0);
+  do {
+    count++;
+    memcpy(next, answ + 20, 4); /* dir id and position */
+    next[4] = attr;
+    memcpy(next + 5, "???????????", 11);
+  } while ((call(c, 0x1C, next, 16, &ax, &answ) >= 24) && (ax == 0));
+  return(count);
+}
+
+/* one round of the soak workload of client n: write a file, read it back,
+ * list the directory, and every now and then delete files and make and
+ * remove a directory */
+static void soakround(int n, unsigned long round) {
+  struct benchclient *c = &(clients[n]);
+  static unsigned char data[1024];
+  unsigned char prefix[8], *answ;
+  unsigned short ax, fileid;
+  char dir[32], path[64];
+  int i, chunks = 1 + round % 4;
+  sprintf(dir, "\\SOAK%d\\", n);
+  sprintf(path, "%sF%lu.DAT", dir, round % SOAK_FILES);
+  memset(prefix, 0, 6);
+  /* create, write, close */
+  prefix[0] = 0x20; /* archive */
+  if (expect(c, 0x17, prefix, 6, path, &answ) < 22) return;
+  fileid = answ[20] | (answ[21] << 8);
+  for (i = 0; i < chunks; i++) {
+    unsigned char req[6 + sizeof(data)];
+    unsigned long offset = i * sizeof(data);
+    req[0] = offset & 0xff;
+    req[1] = (offset >> 8) & 0xff;
+    req[2] = (offset >> 16) & 0xff;
+    req[3] = offset >> 24;
+    req[4] = fileid & 0xff;
+    req[5] = fileid >> 8;
+    memset(data, 'a' + (int)(round % 26), sizeof(data));
+    memcpy(req + 6, data, sizeof(data));
+    if ((call(c, 0x09, req, sizeof(req), &ax, &answ) < 2) || (ax != 0)) failures++;
+  }
+  call(c, 0x06, NULL, 0, &ax, &answ);
+  /* open, read back, seek from end */
+  memset(prefix, 0, 6);
+  if (expect(c, 0x16, prefix, 6, path, &answ) < 22) return;
+  fileid = answ[20] | (answ[21] << 8);
+  for (i = 0; i < chunks; i++) {
+    unsigned char req[8];
+    unsigned long offset = i * sizeof(data);
+    req[0] = offset & 0xff;
+    req[1] = (offset >> 8) & 0xff;
+    req[2] = (offset >> 16) & 0xff;
+    req[3] = offset >> 24;
+    req[4] = fileid & 0xff;
+    req[5] = fileid >> 8;
+    req[6] = sizeof(data) & 0xff;
+    req[7] = sizeof(data) >> 8;
+    if ((call(c, 0x08, req, 8, &ax, &answ) != (int)sizeof(data)) || (ax != 0) || (memcmp(answ, data, sizeof(data)) != 0)) failures++;
+  }
+  memset(prefix, 0, 6);
+  prefix[4] = fileid & 0xff;
+  prefix[5] = fileid >> 8;
+  if ((call(c, 0x21, prefix, 6, &ax, &answ) != 4) || (ax != 0)) failures++;
+  call(c, 0x06, NULL, 0, &ax, &answ);
+  /* metadata */
+  expect(c, 0x0F, NULL, 0, path, &answ);
+  listdir(c, dir);
+  call(c, 0x0C, NULL, 0, &ax, &answ);
+  if ((round % 8) == 7) {
+    sprintf(path, "%sSUB", dir);
+    expect(c, 0x03, NULL, 0, path, &answ);
+    expect(c, 0x01, NULL, 0, path, &answ);
+  }
+  if ((round % SOAK_FILES) == SOAK_FILES - 1) {
+    sprintf(path, "%s????????.DAT", dir);
+    expect(c, 0x13, NULL, 0, path, &answ);
+  }
+}
+
+/* soak test: runs the workload for the given number of seconds, reporting
+ * statistics every interval seconds. Fails if a report shows memory or
+ * latency drifting, or if requests failed. */
+static int soak(long seconds, long interval) {
+  unsigned long long end, nextreport, now;
+  unsigned long round = 0;
+  unsigned short ax;
+  unsigned char *answ;
+  char dir[32];
+  int i, drift = 0;
+  for (i = 0; i < BENCH_CLIENTS; i++) {
+    sprintf(dir, "\\SOAK%d", i);
+    expect(&(clients[i]), 0x03, NULL, 0, dir, &answ);
+  }
+  now = usnow();
+  end = now + seconds * 1000000ull;
+  nextreport = now + interval * 1000000ull;
+  while (now < end) {
+    for (i = 0; i < BENCH_CLIENTS; i++) soakround(i, round);
+    round++;
+    now = usnow();
+    if (now >= nextreport) {
+      if (stats_report(stdout, &ctx) != 0) drift++;
+      nextreport += interval * 1000000ull;
+    }
+  }
+  for (i = 0; i < BENCH_CLIENTS; i++) {
+    sprintf(dir, "\\SOAK%d\\????????.DAT", i);
+    callpath(&(clients[i]), 0x13, NULL, 0, dir, &ax, &answ);
+    sprintf(dir, "\\SOAK%d", i);
+    expect(&(clients[i]), 0x01, NULL, 0, dir, &answ);
+  }
+  printf("soak: %lu rounds, %lu failed requests, %d drifting reports: %s\n", round, failures, drift, ((failures == 0) && (drift == 0)) ? "PASS" : "FAIL");
+  return(((failures == 0) && (drift == 0)) ? 0 : 1);
+}
+
+/* DOS paths of the files and directories sampled from the tree, and the
+ * sizes of the tree */
+static struct {
+  char files[MIX_SAMPLES][128];
+  char dirs[MIX_SAMPLES][128];
+  unsigned long filecount, dircount;
+} tree;
+
+/* per-opcode latencies of the opcode mix */
+static struct hist mixstats[256];
+
+/* keeps path as one of the samples of list, count being the number of
+ * paths offered to list so far (reservoir sampling) */
+static void sample(char list[][128], unsigned long count, const char *path) {
+  unsigned long slot = count;
+  if (count >= MIX_SAMPLES) slot = prng() % (count + 1);
+  if (slot < MIX_SAMPLES) strcpy(list[slot], path);
+}
+
+/* walks the host directory host, which is known to the client as dospath
+ * (ending with a backslash), sampling its files and subdirectories */
+static void walk(char *host, int hostlen, char *dospath, int doslen) {
+  DIR *dir;
+  struct dirent *de;
+  struct stat st;
+  char fcb[12];
+  int i, len;
+  sample(tree.dirs, tree.dircount++, dospath);
+  dir = opendir(host);
+  if (dir == NULL) return;
+  while ((de = readdir(dir)) != NULL) {
+    if (de->d_name[0] == '.') continue;
+    if (hostlen + strlen(de->d_name) + 2 > 4096) continue;
+    sprintf(host + hostlen, "/%s", de->d_name);
+    if (lstat(host, &st) != 0) continue;
+    /* the DOS name of the entry, as NAME.EXT */
+    filename2fcb(fcb, de->d_name);
+    len = doslen;
+    for (i = 0; (i < 8) && (fcb[i] != ' '); i++) dospath[len++] = fcb[i];
+    if (fcb[8] != ' ') {
+      dospath[len++] = '.';
+      for (i = 8; (i < 11) && (fcb[i] != ' '); i++) dospath[len++] = fcb[i];
+    }
+    dospath[len] = 0;
+    if (S_ISDIR(st.st_mode)) {
+      if (len + 14 >= 128) continue; /* no room for a \????????.??? */
+      dospath[len++] = '\\';
+      dospath[len] = 0;
+      walk(host, strlen(host), dospath, len);
+    } else if (S_ISREG(st.st_mode)) {
+      sample(tree.files, tree.filecount++, dospath);
+    }
+  }
+  closedir(dir);
+  host[hostlen] = 0;
+  dospath[doslen] = 0;
+}
+
+/* sends one query of the opcode mix, and accounts for its latency. returns
+ * the length of the answer's payload, or -1 if it failed. "no more files"
+ * (12h) ends directory scans, it is not counted as a failure. */
+static int mixcall(int al, const void *payload, int len, unsigned char **answ) {
+  unsigned short ax = 0;
+  int reslen = call(&(clients[0]), al, payload, len, &ax, answ);
+  if ((reslen < 0) || (ax != 0)) {
+    if ((reslen < 0) || (ax != 0x12)) failures++;
+    return(-1);
+  }
+  histadd(&(mixstats[al]), lastlat);
+  return(reslen);
+}
+
+/* same as mixcall(), for queries whose payload is a DOS path preceded by
+ * prefixlen bytes of prefix */
+static int mixcallpath(int al, const void *prefix, int prefixlen, const char *path, unsigned char **answ) {
+  unsigned char payload[256];
+  int len = strlen(path);
+  if (prefixlen > 0) memcpy(payload, prefix, prefixlen);
+  memcpy(payload + prefixlen, path, len);
+  return(mixcall(al, payload, prefixlen + len, answ));
+}
+
+/* opcode mix: sends requests picked at random among path resolutions,
+ * handle lookups and directory scans, to files and directories sampled from
+ * the tree in DIR, and reports latencies per opcode. Made to be run on trees
+ * of different sizes (see mktree), to chart how ethersrv scales. */
+static int mix(const char *root, long requests) {
+  static char host[4096 + 256];
+  char dospath[128], path[144];
+  unsigned char req[16], *answ;
+  unsigned long long start, elapsed;
+  long n;
+  int i, al;
+  strcpy(host, root);
+  strcpy(dospath, "\\");
+  start = usnow();
+  walk(host, strlen(host), dospath, 1);
+  elapsed = usnow() - start;
+  printf("mix: tree of %lu files in %lu directories, walked in %llu ms\n", tree.filecount, tree.dircount, elapsed / 1000);
+  if (tree.filecount == 0) {
+    fprintf(stderr, "ERROR: no files in '%s'\n", root);
+    return(1);
+  }
+  start = usnow();
+  for (n = 0; n < requests; n++) {
+    const char *file = tree.files[prng() % ((tree.filecount < MIX_SAMPLES) ? tree.filecount : MIX_SAMPLES)];
+    const char *dir = tree.dirs[prng() % ((tree.dircount < MIX_SAMPLES) ? tree.dircount : MIX_SAMPLES)];
+    int pick = prng() % 100;
+    memset(req, 0, sizeof(req));
+    if (pick < 35) { /* path resolution */
+      mixcallpath(0x0F, NULL, 0, file, &answ);
+    } else if (pick < 60) { /* handle lookups */
+      if (mixcallpath(0x16, req, 6, file, &answ) < 22) continue;
+      req[4] = answ[20];
+      req[5] = answ[21];
+      req[6] = 0; /* read 512 bytes at offset 0 */
+      req[7] = 2;
+      mixcall(0x08, req, 8, &answ);
+      mixcall(0x21, req, 6, &answ);
+      mixcall(0x06, NULL, 0, &answ);
+    } else if (pick < 80) { /* directory scan, up to 8 FindNext */
+      req[0] = 0x3f;
+      sprintf(path, "%s????????.???", dir);
+      if (mixcallpath(0x1B, req, 1, path, &answ) < 24) continue;
+      for (i = 0; i < 8; i++) {
+        memcpy(req, answ + 20, 4); /* dir id and position */
+        req[4] = 0x3f;
+        memcpy(req + 5, "???????????", 11);
+        if (mixcall(0x1C, req, 16, &answ) < 24) break;
+      }
+    } else { /* lookup of an exact name */
+      req[0] = 0x3f;
+      mixcallpath(0x1B, req, 1, file, &answ);
+    }
+  }
+  elapsed = usnow() - start;
+  printf("%-10s %10s %8s %8s %8s\n", "opcode", "calls", "p50 us", "p99 us", "max us");
+  for (al = 0; al < 256; al++) {
+    if (mixstats[al].calls == 0) continue;
+    printf("%-10s %10lu %8lu %8lu %8lu\n", dfs_opname(al), mixstats[al].calls, histpct(&(mixstats[al]), 50), histpct(&(mixstats[al]), 99), mixstats[al].max);
+  }
+  printf("mix: %ld requests in %llu ms (%llu/s), %lu failed requests\n", requests, elapsed / 1000, (elapsed > 0) ? requests * 1000000ull / elapsed : 0, failures);
+  return((failures == 0) ? 0 : 1);
+}
+
+/* ids of files and directories learned from the answers to fuzzed frames */
+#define FUZZ_IDS 64
+
+static unsigned char fuzzids[FUZZ_IDS][4];
+
+/* appends to buf a random DOS path, made of components likely to mean
+ * something to ethersrv and of random bytes. No '.' is ever put next to
+ * another one, so that no path may climb out of the drive's root. returns
+ * the length of the path. */
+static int fuzzpath(unsigned char *buf, int max) {
+  static const char *parts[] = {"FUZZ", "A", "B.TXT", "SUB", "LONGNAME.EXT",
+    ".", "*.*", "????????.???", "A*", "?", "NUL", ":", "C:"};
+  int len = 0, n, i, count = prng() % 5;
+  while ((count-- > 0) && (len < max - 16)) {
+    if (prng() % 4 != 0) buf[len++] = '\\';
+    if (prng() % 4 != 0) {
+      const char *part = parts[prng() % 13];
+      n = strlen(part);
+      memcpy(buf + len, part, n);
+      len += n;
+    } else {
+      n = 1 + prng() % 12;
+      for (i = 0; i < n; i++) {
+        buf[len] = prng();
+        if (buf[len] == '.') buf[len] = '_';
+        len++;
+      }
+    }
+  }
+  return(len);
+}
+
+/* sends one random frame, built with a random opcode (mostly one ethersrv
+ * knows), random flags and a payload in the shape the opcode expects, with
+ * bytes and lengths off here and there. returns non-zero if it was answered. */
+static int fuzzone(void) {
+  static const unsigned char ops[] = {0x00, 0x01, 0x03, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0E, 0x0F, 0x11, 0x13, 0x16, 0x17, 0x1B,
+    0x1C, 0x21, 0x2E};
+  unsigned char frame[FRAME_MAX], *p = frame + 60, *res;
+  struct benchclient *c = &(clients[prng() % BENCH_CLIENTS]);
+  unsigned char *id = fuzzids[prng() % FUZZ_IDS];
+  int i, n, len = 0, max = FRAME_MAX - 60, al, reslen;
+  al = (prng() % 16 != 0) ? ops[prng() % sizeof(ops)] : (int)(prng() & 0xff);
+  switch (al) {
+    case 0x08: /* READFIL: offset, file id, length */
+    case 0x09: /* WRITEFIL: offset, file id, data */
+    case 0x21: /* SKFMEND: offset, file id */
+      for (i = 0; i < 4; i++) p[i] = (i < 2) ? prng() : 0;
+      memcpy(p + 4, id, 2);
+      len = 6;
+      if (al == 0x08) {
+        n = prng() % 4096;
+        p[6] = n & 0xff;
+        p[7] = n >> 8;
+        len = 8;
+      } else if (al == 0x09) {
+        n = prng() % (max - 6);
+        for (i = 0; i < n; i++) p[6 + i] = prng();
+        len += n;
+      }
+      break;
+    case 0x1C: /* FINDNEXT: dir id and position, attributes, FCB mask */
+      memcpy(p, id, 4);
+      p[4] = prng();
+      for (i = 0; i < 11; i++) p[5 + i] = (prng() % 2 != 0) ? '?' : 'A' + prng() % 26;
+      len = 16;
+      break;
+    case 0x11: /* RENAME: length of the first path, both paths */
+      n = fuzzpath(p + 1, 120);
+      p[0] = (prng() % 8 != 0) ? n : (unsigned char)prng();
+      len = 1 + n;
+      len += fuzzpath(p + len, 120);
+      break;
+    case 0x0E: /* SETATTR: attributes, path */
+    case 0x1B: /* FINDFIRST: attributes, path */
+      p[0] = prng();
+      len = 1 + fuzzpath(p + 1, 200);
+      break;
+    case 0x16: /* OPEN, CREATE, SPOPNFIL: 3 words, path */
+    case 0x17:
+    case 0x2E:
+      for (i = 0; i < 6; i++) p[i] = (prng() % 2 != 0) ? prng() : 0;
+      len = 6 + fuzzpath(p + 6, 200);
+      break;
+    default: /* paths, or anything */
+      if (prng() % 2 != 0) {
+        len = fuzzpath(p, 200);
+      } else {
+        len = prng() % 64;
+        for (i = 0; i < len; i++) {
+          p[i] = prng();
+          if (p[i] == '.') p[i] = '_';
+        }
+      }
+      break;
+  }
+  /* now and then, cut the payload short */
+  if ((len > 0) && (prng() % 16 == 0)) len = prng() % len;
+  memset(frame, 0, 60);
+  memcpy(frame, ctx.mymac, 6);
+  memcpy(frame + 6, c->mac, 6);
+  frame[12] = ETHERTYPE_DFS >> 8;
+  frame[13] = ETHERTYPE_DFS & 0xff;
+  n = 60 + len;
+  if (prng() % 16 == 0) n = prng() % FRAME_MAX; /* length field off */
+  frame[52] = n & 0xff;
+  frame[53] = n >> 8;
+  frame[56] = PROTOVER | ((prng() % 32 == 0) ? 0x80 : 0); /* bad checksums */
+  frame[57] = (prng() % 8 != 0) ? ++(c->seq) : c->seq; /* retransmissions */
+  frame[58] = ((prng() % 8 != 0) ? 2 : prng() % 32) | ((prng() % 4 == 0) ? (prng() % 8) << 5 : 0);
+  frame[59] = al;
+  reslen = dfs_handleframe(&ctx, frame, 60 + len, &res);
+  if (reslen < 60) return(0);
+  /* learn the ids of files and directories */
+  if ((res[58] == 0) && (res[59] == 0) && (reslen >= 84) && ((al == 0x16) || (al == 0x17) || (al == 0x2E) || (al == 0x1B) || (al == 0x1C))) {
+    memcpy(fuzzids[prng() % FUZZ_IDS], res + 80, 4);
+  }
+  return(1);
+}
+
+/* fuzzes the protocol engine with random frames. Fails if sane requests
+ * are not answered properly afterwards (the engine crashing ends the run
+ * anyway). */
+static int fuzz(long frames) {
+  unsigned short ax;
+  unsigned char *answ;
+  long n, answered = 0;
+  int i;
+  for (i = 0; i < FUZZ_IDS; i++) {
+    fuzzids[i][0] = prng();
+    fuzzids[i][1] = prng() % 4;
+  }
+  for (n = 0; n < frames; n++) answered += fuzzone();
+  if (call(&(clients[0]), 0x0C, NULL, 0, &ax, &answ) < 0) failures++;
+  expect(&(clients[1]), 0x03, NULL, 0, "\\FUZZCHK", &answ);
+  expect(&(clients[2]), 0x01, NULL, 0, "\\FUZZCHK", &answ);
+  printf("fuzz: %ld frames, %ld answered, %lu failed requests: %s\n", frames, answered, failures, (failures == 0) ? "PASS" : "FAIL");
+  return((failures == 0) ? 0 : 1);
+}
+
+/* reference CRC32C, one bit at a time */
+static unsigned long crc32cref(const unsigned char *ptr, unsigned long l) {
+  unsigned long crc = 0xffffffffu;
+  int i;
+  for (; l > 0; l--) {
+    crc ^= *ptr++;
+    for (i = 0; i < 8; i++) crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+  }
+  return(~crc & 0xffffffffu);
+}
+
+/* checks that both paths of crc32c() match a bitwise CRC32C on buffers of
+ * random lengths and alignments, then times bsdsum() and crc32c16() over
+ * full frames. returns the number of mismatches. */
+static int checkcrc(void) {
+  static unsigned char buf[FRAME_MAX + 8];
+  unsigned long long start, tbsd, tsw, thw = 0;
+  unsigned long ref;
+  int i, len, off, hw, mismatches = 0;
+  crc32c_init();
+  for (i = 0; i < (int)sizeof(buf); i++) buf[i] = prng();
+  if (crc32cref((const unsigned char *)"123456789", 9) != 0xE3069283u) mismatches++;
+  for (i = 0; i < 20000; i++) {
+    len = prng() % FRAME_MAX;
+    off = prng() % 8;
+    ref = crc32cref(buf + off, len);
+    for (hw = 0; hw < 2; hw++) {
+      if ((crc32c_usehw(hw) != hw) || (crc32c(0, buf + off, len) == ref)) continue;
+      if (mismatches++ < 10) fprintf(stderr, "crc: %d bytes at +%d give %08lx instead of %08lx (%s)\n", len, off, crc32c(0, buf + off, len), ref, (hw != 0) ? "hw" : "table");
+    }
+  }
+  /* timings, on 1500-byte frames */
+  start = usnow();
+  for (i = 0; i < 100000; i++) sink += bsdsum(buf + (i & 7), 1500);
+  tbsd = usnow() - start;
+  crc32c_usehw(0);
+  start = usnow();
+  for (i = 0; i < 100000; i++) sink += crc32c16(buf + (i & 7), 1500);
+  tsw = usnow() - start;
+  if (crc32c_usehw(1) != 0) {
+    start = usnow();
+    for (i = 0; i < 100000; i++) sink += crc32c16(buf + (i & 7), 1500);
+    thw = usnow() - start;
+  }
+  printf("crc: bsdsum %.0f MB/s, crc32c table %.0f MB/s, crc32c hw ", 150000000.0 / tbsd, 150000000.0 / tsw);
+  if (thw != 0) {
+    printf("%.0f MB/s", 150000000.0 / thw);
+  } else {
+    printf("n/a");
+  }
+  printf(", %d mismatches\n", mismatches);
+  return(mismatches);
+}
+
+/* rate of the slow link the compressed reads are measured against, in
+ * bits per second (10 Mbit coax) */
+#define CHECK_LINKRATE 10000000.0
+
+/* fills buf with len bytes of data of the given kind: 0 is text, 1 is an
+ * executable-like mix of code, tables and zeroes, 2 is zeroes and 3 is
+ * random data */
+static void lzdata(unsigned char *buf, int len, int kind) {
+  static const char *words[] = {"the ", "file ", "DOS ", "of ", "server ",
+    "a ", "network ", "drive ", "and ", "is ", "\r\n", "to ", "EtherDFS "};
+  int i, n;
+  for (i = 0; i < len; i += n) {
+    if (kind == 0) {
+      const char *w = words[prng() % 13];
+      n = strlen(w);
+      if (n > len - i) n = len - i;
+      memcpy(buf + i, w, n);
+    } else {
+      n = 1 + prng() % 32;
+      if (n > len - i) n = len - i;
+      if ((kind == 2) || ((kind == 1) && (prng() % 3 == 0))) {
+        memset(buf + i, 0, n);
+      } else {
+        int j;
+        for (j = 0; j < n; j++) buf[i + j] = prng() & ((kind == 1) ? 0x3f : 0xff);
+      }
+    }
+  }
+}
+
+/* checks that compressed reads decompress to the data read, for several
+ * kinds of data, and reports the effective throughput of compressed reads
+ * of full frames on a slow link, against plain reads. returns the number
+ * of mismatches. */
+static int checklz(void) {
+  static const char *kinds[] = {"text", "binary", "zeroes", "random"};
+  unsigned char raw[FRAME_MAX], comp[FRAME_MAX], back[FRAME_MAX];
+  unsigned long long start, tcomp;
+  double wireraw, wirelz;
+  int kind, i, complen, len = FRAME_MAX - 62, mismatches = 0;
+  for (kind = 0; kind < 4; kind++) {
+    tcomp = 0;
+    wireraw = 0;
+    wirelz = 0;
+    for (i = 0; i < 2000; i++) {
+      lzdata(raw, len, kind);
+      start = usnow();
+      complen = lz_compress(comp, len - 1, raw, len);
+      tcomp += usnow() - start;
+      if (complen >= 0) {
+        if ((lz_decompress(back, len, comp, complen) != len) || (memcmp(back, raw, len) != 0)) {
+          if (mismatches++ < 10) fprintf(stderr, "lz: %s block %d does not decompress to itself\n", kinds[kind], i);
+        }
+      } else {
+        complen = len; /* sent as-is */
+      }
+      /* both ways on the wire: 68-byte query and answer, plus 24 bytes of
+       * preamble, FCS and inter-frame gap each */
+      wireraw += 68 + 24 + 60 + len + 24;
+      wirelz += 68 + 24 + 62 + complen + 24;
+    }
+    /* ms for 2000 reads on the link, server compression time included */
+    wireraw = wireraw * 8 * 1000 / CHECK_LINKRATE;
+    wirelz = wirelz * 8 * 1000 / CHECK_LINKRATE + tcomp / 1000.0;
+    printf("lz: %-6s compresses at %.0f MB/s, reads at %.0f Mbit/s go at %.0f KB/s instead of %.0f KB/s\n", kinds[kind], 2000.0 * len / ((tcomp > 0) ? tcomp : 1), CHECK_LINKRATE / 1000000, 2000.0 * len / wirelz, 2000.0 * len / wireraw);
+  }
+  return(mismatches);
+}
+
+/* reference conversion of a time_t into DOS timestamp bits, see time2dos() */
+static unsigned long time2dosref(time_t t) {
+  struct tm ltime;
+  unsigned long res;
+  localtime_r(&t, &ltime);
+  res = (unsigned long)(ltime.tm_year - 80) << 25;
+  res |= (unsigned long)(ltime.tm_mon + 1) << 21;
+  res |= (unsigned long)ltime.tm_mday << 16;
+  res |= (unsigned long)ltime.tm_hour << 11;
+  res |= (unsigned long)ltime.tm_min << 5;
+  res |= (unsigned long)ltime.tm_sec >> 1;
+  return(res);
+}
+
+/* checks that time2dos() gives the same timestamps as localtime_r() on
+ * random times from 1981 to 2037 and on every few seconds of days with a
+ * DST change, then times both. returns the number of mismatches. */
+static int checktime(void) {
+  /* 2024-03-29 and 2024-10-25 00:00 UTC, DST changes are in the 4 days that
+   * follow in Europe and the US */
+  static const time_t dstdays[] = {1711670400l, 1729814400l};
+  static time_t times[4096];
+  unsigned long long start, tfast, tref;
+  unsigned long sum = 0;
+  time_t t;
+  int i, round, mismatches = 0;
+  for (i = 0; i < 1000000; i++) {
+    t = 347155200l + (time_t)(prng() % 1800000000ul);
+    if (time2dos(t) == time2dosref(t)) continue;
+    if (mismatches++ < 10) fprintf(stderr, "time: %ld gives %08lx instead of %08lx\n", (long)t, time2dos(t), time2dosref(t));
+  }
+  for (i = 0; i < 2; i++) {
+    for (t = dstdays[i]; t < dstdays[i] + 4 * 86400; t += 7) {
+      if (time2dos(t) == time2dosref(t)) continue;
+      if (mismatches++ < 10) fprintf(stderr, "time: %ld gives %08lx instead of %08lx\n", (long)t, time2dos(t), time2dosref(t));
+    }
+  }
+  /* timings, on modification times spread over 10 years as in a share */
+  for (i = 0; i < 4096; i++) times[i] = 1450000000l + (time_t)(prng() % 315000000ul);
+  start = usnow();
+  for (round = 0; round < 250; round++) {
+    for (i = 0; i < 4096; i++) sum += time2dos(times[i]);
+  }
+  tfast = usnow() - start;
+  start = usnow();
+  for (round = 0; round < 250; round++) {
+    for (i = 0; i < 4096; i++) sum -= time2dosref(times[i]);
+  }
+  tref = usnow() - start;
+  printf("time: time2dos %.1f ns/call, localtime_r %.1f ns/call, %d mismatches%s\n", tfast * 1000.0 / (250.0 * 4096), tref * 1000.0 / (250.0 * 4096), mismatches, (sum != 0) ? " (sums differ)" : "");
+  return(mismatches);
+}
+
+/* stride of the names given to filenames2fcb() by checkfcb() */
+#define CHECK_NAMESTRIDE 32
+
+/* names converted per filenames2fcb() call by checkfcb() */
+#define CHECK_NAMES 256
+
+/* checks that filenames2fcb() gives the same FCB names as filename2fcb(),
+ * on edge cases and random names, then times both. returns the number of
+ * mismatches. */
+static int checkfcb(void) {
+  static const char *edges[] = {"", ".", "..", "...", "a", "A.B", "file.txt",
+    "FILE.TXT", "longfilename.text", "abcdefgh.ijk", "abcdefghi.jkl",
+    "abcdefgh", "abcdefghijklmno", "abcdefghijklmnop", "abcdefghijklmnopq",
+    "abcdefghijklm.o", "a.b.c", "a..b", ".hidden", "..x", "trail.",
+    "x.tar.gz", "with space.txt", " lead", "tail .c", "z{|}~@`[.az",
+    "\x80\xe9t\xe9.\xff", "\xe9\xe8.txt", "a.bcdefghijklmno"};
+  static char names[CHECK_NAMES * CHECK_NAMESTRIDE];
+  static const char charset[] = "abcxyzABCXYZ09_-~!.. .\x7f\x80\xe9\xff";
+  char batch[CHECK_NAMES * 11], ref[11];
+  unsigned long long start, tbatch, tref;
+  int i, j, len, round, mismatches = 0;
+  for (round = 0; round < 1000; round++) {
+    memset(names, 0, sizeof(names));
+    for (i = 0; i < CHECK_NAMES; i++) {
+      char *name = names + i * CHECK_NAMESTRIDE;
+      if ((round == 0) && (i < (int)(sizeof(edges) / sizeof(edges[0])))) {
+        strcpy(name, edges[i]);
+        continue;
+      }
+      len = prng() % 21;
+      for (j = 0; j < len; j++) name[j] = charset[prng() % (sizeof(charset) - 1)];
+    }
+    filenames2fcb(batch, names, CHECK_NAMESTRIDE, CHECK_NAMES);
+    for (i = 0; i < CHECK_NAMES; i++) {
+      filename2fcb(ref, names + i * CHECK_NAMESTRIDE);
+      if (memcmp(ref, batch + i * 11, 11) == 0) continue;
+      if (mismatches++ < 10) fprintf(stderr, "fcb: '%s' gives '%.11s' instead of '%.11s'\n", names + i * CHECK_NAMESTRIDE, batch + i * 11, ref);
+    }
+  }
+  /* timings, on 8.3 names as most directories hold */
+  for (i = 0; i < CHECK_NAMES; i++) sprintf(names + i * CHECK_NAMESTRIDE, "file%04d.txt", i);
+  start = usnow();
+  for (round = 0; round < 4000; round++) filenames2fcb(batch, names, CHECK_NAMESTRIDE, CHECK_NAMES);
+  tbatch = usnow() - start;
+  start = usnow();
+  for (round = 0; round < 4000; round++) {
+    for (i = 0; i < CHECK_NAMES; i++) filename2fcb(batch + i * 11, names + i * CHECK_NAMESTRIDE);
+  }
+  tref = usnow() - start;
+  printf("fcb: filenames2fcb %.1f ns/name, filename2fcb %.1f ns/name, %d mismatches\n", tbatch * 1000.0 / (4000.0 * CHECK_NAMES), tref * 1000.0 / (4000.0 * CHECK_NAMES), mismatches);
+  return(mismatches);
+}
+
+/* checks the optimised routines against their reference, printing how
+ * long both take. Fails if any result differs. Times are checked in the TZ
+ * of the environment, or in Central European time if TZ is unset, so that
+ * DST changes are covered. */
+static int check(void) {
+  int mismatches = 0;
+  if (getenv("TZ") == NULL) setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+  tzset();
+  mismatches += checkcrc();
+  mismatches += checklz();
+  mismatches += checktime();
+  mismatches += checkfcb();
+  printf("check: %s\n", (mismatches == 0) ? "PASS" : "FAIL");
+  return((mismatches == 0) ? 0 : 1);
+}
+
+static void help(void) {
+  printf("usage: bench soak DIR [seconds [interval]]\n"
+         "       bench mix DIR [requests]\n"
+         "       bench fuzz DIR [frames]\n"
+         "       bench check\n"
+         "\n"
+         "soak   runs a mixed workload of several clients against DIR (a scratch\n"
+         "       directory) for some seconds (default 3600), reporting statistics\n"
+         "       every interval seconds (default 60). Fails if memory grows or\n"
+         "       latency drifts, or if a request does not get the answer it should.\n");
+  printf("mix    sends a number of requests (default 100000) picked among path\n"
+         "       resolutions, handle lookups and directory scans to files and\n"
+         "       directories of the tree in DIR (see mktree), and reports per-opcode\n"
+         "       latencies (p50 and p99 are rounded up to a power of 2).\n");
+  printf("fuzz   sends random frames (default 100000) to the protocol engine,\n"
+         "       serving DIR (a scratch directory, it gets written over).\n"
+         "check  checks that optimised routines give the same results as their\n"
+         "       reference, and times both.\n");
+}
+
+int main(int argc, char **argv) {
+  static const unsigned char mymac[6] = {0x02, 0, 0, 0, 0, 0xfe};
+  int i, res;
+  if ((argc == 2) && (strcmp(argv[1], "check") == 0)) return(check());
+  if ((argc < 3) || ((strcmp(argv[1], "soak") != 0) && (strcmp(argv[1], "mix") != 0) && (strcmp(argv[1], "fuzz") != 0))) {
+    help();
+    return(1);
+  }
+  if (dfs_init(&ctx, mymac) != 0) {
+    fprintf(stderr, "ERROR: out of memory\n");
+    return(1);
+  }
+  if (dfs_adddrive(&ctx, 2, argv[2]) != 0) {
+    fprintf(stderr, "ERROR: failed to resolve path '%s'\n", argv[2]);
+    return(1);
+  }
+  for (i = 0; i < BENCH_CLIENTS; i++) {
+    clients[i].mac[0] = 0x02;
+    clients[i].mac[5] = i + 1;
+  }
+  if (strcmp(argv[1], "mix") == 0) {
+    res = mix(argv[2], (argc > 3) ? atol(argv[3]) : 100000);
+  } else if (strcmp(argv[1], "fuzz") == 0) {
+    res = fuzz((argc > 3) ? atol(argv[3]) : 100000);
+  } else {
+    res = soak((argc > 3) ? atol(argv[3]) : 3600, (argc > 4) ? atol(argv[4]) : 60);
+  }
+  dfs_free(&ctx);
+  return(res);
+}
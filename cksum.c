@@ -0,0 +1,106 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2017 Mateusz Viste
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#include <stdint.h>
+#include <string.h>  /* memcpy() */
+
+#include "cksum.h" /* include self for control */
+
+/* computes the BSD checksum of l bytes starting at ptr */
+unsigned short bsdsum(const unsigned char *ptr, unsigned short l) {
+  unsigned short res = 0;
+  for (; l > 0; l--) {
+    res = (res << 15) | (res >> 1);
+    res += *ptr;
+    ptr++;
+  }
+  return(res);
+}
+
+/* slicing-by-8 tables for the reflected CRC32C polynomial */
+static uint32_t crctab[8][256];
+
+/* set to non-zero if the CPU provides the SSE4.2 crc32 instruction, and
+ * crchw is set if it is to be used */
+static int crchwcpu, crchw;
+
+void crc32c_init(void) {
+  uint32_t i, j, crc;
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (j = 0; j < 8; j++) crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+    crctab[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    crc = crctab[0][i];
+    for (j = 1; j < 8; j++) {
+      crc = crctab[0][crc & 0xff] ^ (crc >> 8);
+      crctab[j][i] = crc;
+    }
+  }
+#if defined(__x86_64__) && defined(__GNUC__)
+  __builtin_cpu_init();
+  crchwcpu = __builtin_cpu_supports("sse4.2");
+#endif
+  crchw = crchwcpu;
+}
+
+int crc32c_usehw(int enable) {
+  crchw = (enable != 0) ? crchwcpu : 0;
+  return(crchw);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* hardware CRC32C, 8 bytes per instruction */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *ptr, unsigned long l) {
+  uint64_t crc64 = crc;
+  uint64_t qword;
+  for (; l >= 8; l -= 8) {
+    memcpy(&qword, ptr, 8);
+    crc64 = __builtin_ia32_crc32di(crc64, qword);
+    ptr += 8;
+  }
+  crc = (uint32_t)crc64;
+  for (; l > 0; l--) {
+    crc = __builtin_ia32_crc32qi(crc, *ptr);
+    ptr++;
+  }
+  return(crc);
+}
+#endif
+
+/* table-driven CRC32C, 8 bytes per iteration */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *ptr, unsigned long l) {
+  for (; l >= 8; l -= 8) {
+    crc ^= (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+    crc = crctab[7][crc & 0xff] ^ crctab[6][(crc >> 8) & 0xff] ^
+          crctab[5][(crc >> 16) & 0xff] ^ crctab[4][crc >> 24] ^
+          crctab[3][ptr[4]] ^ crctab[2][ptr[5]] ^
+          crctab[1][ptr[6]] ^ crctab[0][ptr[7]];
+    ptr += 8;
+  }
+  for (; l > 0; l--) {
+    crc = crctab[0][(crc ^ *ptr) & 0xff] ^ (crc >> 8);
+    ptr++;
+  }
+  return(crc);
+}
+
+unsigned long crc32c(unsigned long crc, const unsigned char *ptr, unsigned long l) {
+  uint32_t res = ~(uint32_t)crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (crchw) return(~crc32c_hw(res, ptr, l));
+#endif
+  return(~crc32c_sw(res, ptr, l));
+}
+
+unsigned short crc32c16(const unsigned char *ptr, unsigned short l) {
+  unsigned long crc = crc32c(0, ptr, l);
+  return((crc ^ (crc >> 16)) & 0xffff);
+}
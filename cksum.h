@@ -0,0 +1,32 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2017 Mateusz Viste
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#ifndef CKSUM_H_SENTINEL
+#define CKSUM_H_SENTINEL
+
+/* computes the BSD checksum of l bytes starting at ptr */
+unsigned short bsdsum(const unsigned char *ptr, unsigned short l);
+
+/* prepares the CRC32C lookup tables and detects hardware support, must be
+ * called once before crc32c() is used */
+void crc32c_init(void);
+
+/* makes crc32c() use the hardware path if enable is non-zero and the CPU
+ * supports it (the default after crc32c_init()), or the table path
+ * otherwise. returns non-zero if the hardware path is in use. */
+int crc32c_usehw(int enable);
+
+/* computes the CRC32C (Castagnoli) of l bytes starting at ptr, continuing
+ * from crc (use 0 for a new computation) */
+unsigned long crc32c(unsigned long crc, const unsigned char *ptr, unsigned long l);
+
+/* CRC32C of l bytes starting at ptr, folded to 16 bits so it fits in the
+ * EtherDFS checksum field */
+unsigned short crc32c16(const unsigned char *ptr, unsigned short l);
+
+#endif
@@ -52,6 +52,7 @@
 #include <string.h>          /* mempcy() */
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/time.h>        /* gettimeofday() */
 #include <stdint.h>          /* uint16_t, uint32_t */
 #include <stdlib.h>          /* realpath() */
 #include <time.h>            /* time() */
@@ -59,66 +60,34 @@
 
 #include "debug.h"
 #include "fs.h"
+#include "impair.h"
 #include "lock.h"
+#include "log.h"
+#include "prof.h"
+#include "proto.h"
+#include "rt.h"
+#include "sched.h"
+#include "stats.h"
+#include "watch.h"
+#include "worker.h"
 
 /* program version */
 #define PVER "20250324"
 
-#define ETHERTYPE_DFS 0xEDF5
-
-/* protocol version (single byte, must be in sync with etherdfs) */
-#define PROTOVER 2
-
-
-/* answer cache - last answers sent to clients - used if said client didn't
- * receive my answer, and re-sends his requests so I don't process this
- * request again (which might be dangerous in case of write requests, like
- * write to file, delete file, rename file, etc. For every client that ever
- * sent me a query, there is exactly one entry in the cache. */
-#define ANSWCACHESZ 16
-static struct struct_answcache {
-  unsigned char frame[1520]; /* entire frame that was sent (first 6 bytes is the client's mac) */
-  time_t timestamp; /* time of answer (so if cache full I can drop oldest) */
-  unsigned short len;  /* frame's length */
-} answcache[ANSWCACHESZ];
-
 #define BUFF_LEN 2048
 
-/* all the calls I support are in the range AL=0..2Eh - the list below serves
- * as a convenience to compare AL (subfunction) values */
-enum AL_SUBFUNCTIONS {
-  AL_INSTALLCHK = 0x00,
-  AL_RMDIR      = 0x01,
-  AL_MKDIR      = 0x03,
-  AL_CHDIR      = 0x05,
-  AL_CLSFIL     = 0x06,
-  AL_CMMTFIL    = 0x07,
-  AL_READFIL    = 0x08,
-  AL_WRITEFIL   = 0x09,
-  AL_LOCKFIL    = 0x0A,
-  AL_UNLOCKFIL  = 0x0B,
-  AL_DISKSPACE  = 0x0C,
-  AL_SETATTR    = 0x0E,
-  AL_GETATTR    = 0x0F,
-  AL_RENAME     = 0x11,
-  AL_DELETE     = 0x13,
-  AL_OPEN       = 0x16,
-  AL_CREATE     = 0x17,
-  AL_FINDFIRST  = 0x1B,
-  AL_FINDNEXT   = 0x1C,
-  AL_SKFMEND    = 0x21,
-  AL_UNKNOWN_2D = 0x2D,
-  AL_SPOPNFIL   = 0x2E,
-  AL_UNKNOWN    = 0xFF
-};
-
-
-/* an array with flags indicating whether given drive is FAT-based or not */
-static unsigned char drivesfat[26]; /* 0 if not, non-zero otherwise */
+/* how many reads drain() does at most before the queue gets served */
+#define DRAINMAX 256
 
 /* the flag is set when ethersrv is expected to terminate */
 static sig_atomic_t volatile terminationflag = 0;
 
+/* the flag is set when a statistics report is requested (SIGUSR1) */
+static sig_atomic_t volatile reportflag = 0;
+
+/* the flag is set when the profiler shall start or stop (SIGUSR2) */
+static sig_atomic_t volatile profflag = 0;
+
 static void sigcatcher(int sig) {
   switch (sig) {
     case SIGTERM:
@@ -126,636 +95,37 @@ static void sigcatcher(int sig) {
     case SIGINT:
       terminationflag = 1;
       break;
+    case SIGUSR1:
+      reportflag = 1;
+      break;
+    case SIGUSR2:
+      profflag = 1;
+      break;
     default:
       break;
   }
 }
 
-/* returns a printable version of a FCB block (ie. with added null terminator), this is used only by debug routines */
-#if DEBUG > 0
-static char *pfcb(char *s) {
-  static char r[12] = "FILENAMEEXT";
-  memcpy(r, s, 11);
-  return(r);
-}
-#endif
-
-/* turns a character c into its low-case variant */
-static char lochar(char c) {
-  if ((c >= 'A') && (c <= 'Z')) c += ('a' - 'A');
-  return(c);
-}
-
-/* turns a string into all-lower-case characters, up to n chars max */
-static void lostring(char *s, int n) {
-  while ((n-- != 0) && (*s != 0)) {
-    *s = lochar(*s);
-    s++;
-  }
-}
-
-/* finds the cache entry related to given client */
-static struct struct_answcache *findcacheentry(unsigned char *clientmac) {
-  int i, oldest = 0;
-  /* iterate through cache entries until matching mac is found */
-  for (i = 0; i < ANSWCACHESZ; i++) {
-    if (memcmp(answcache[i].frame, clientmac, 6) == 0) {
-      return(&(answcache[i])); /* found! */
-    }
-    /* is this the oldest entry? remember it. */
-    if (answcache[i].timestamp < answcache[oldest].timestamp) oldest = i;
-  }
-  /* if nothing found, over-write the oldest entry */
-  return(&(answcache[oldest]));
-}
-
-
-/* checks whether dir is belonging to the root directory. returns 0 if so, 1
- * otherwise */
-static int isroot(char *root, char *dir) {
-  /* fast-forward to the 'virtual directory' part */
-  while ((*root != 0) && (*dir != 0)) {
-    root++;
-    dir++;
-  }
-  /* skip any leading / */
-  while (*dir == '/') dir++;
-  /* is there any subsequent '/' ? if so, then it's not root */
-  while (*dir != 0) {
-    if (*dir == '/') return(0);
-    dir++;
-  }
-  /* otherwise it's root */
-  return(1);
-}
-
-
-/* explode a full X:\DIR\FILE????.??? search path into directory and mask */
-static void explodepath(char *dir, char *file, char *source, int sourcelen) {
-  int i, lastbackslash;
-  /* if drive present, skip it */
-  if (source[1] == ':') {
-    source += 2;
-    sourcelen -= 2;
-  }
-  /* find last slash or backslash and copy source into dir up to this last backslash */
-  lastbackslash = 0;
-  for (i = 0; i < sourcelen; i++) {
-    if ((source[i] == '\\') || (source[i] == '/')) lastbackslash = i;
+/* asks the kernel to poll the network device for a while when sock is read
+ * and nothing is there, instead of waiting for an interrupt (Linux only) */
+static void busypoll(int sock) {
+#if defined(SO_BUSY_POLL)
+  int usecs = 50, one = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) != 0) {
+    DBG("ERROR: setsockopt(SO_BUSY_POLL): %s\n", strerror(errno));
   }
-  memcpy(dir, source, lastbackslash + 1);
-  dir[lastbackslash + 1] = 0;
-  /* copy file/mask into file */
-  memcpy(file, source+lastbackslash+1, sourcelen - (lastbackslash + 1));
-  file[sourcelen - (lastbackslash + 1)] = 0;
-}
-
-
-/* replaces all rep chars in string s by repby */
-static void charreplace(char *s, char rep, char repby) {
-  while (*s != 0) {
-    if (*s == rep) *s = repby;
-    s++;
+  #if defined(SO_PREFER_BUSY_POLL)
+  if (setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) != 0) {
+    DBG("ERROR: setsockopt(SO_PREFER_BUSY_POLL): %s\n", strerror(errno));
   }
-}
-
-/* copies everything after last slash into dst */
-static void copy_after_last_slash(char *dst, const char *src) {
-    const char *last_slash = strrchr(src, '/');
-
-    if (last_slash)
-        strcpy(dst, last_slash + 1);
-}
-
-
-
-static int process(struct struct_answcache *answer, unsigned char *reqbuff, int reqbufflen, unsigned char *mymac, char **rootarray) {
-  int query, reqdrv, reqflags;
-  int reslen = 0;
-  unsigned short *ax;     /* pointer to store the value of AX after the query */
-  unsigned char *answ;    /* convenience pointer to answer->frame */
-  unsigned short *wreqbuff; /* same as query, but word-based (16 bits) */
-  unsigned short *wansw;  /* same as answer->frame, but word-based (16 bits) */
-  char *root;
-  answ = answer->frame;
-  /* must be at least 60 bytes long */
-  if (reqbufflen < 60) return(-1);
-  /* does it match the cache entry (same seq and same mac and len > 0)? if so, just re-send it again */
-  if ((answ[57] == reqbuff[57]) && (memcmp(answ, reqbuff + 6, 6) == 0) && (answer->len > 0)) {
-  #if SIMLOSS > 0
-    fprintf(stderr, "Cache HIT (seq %u)\n", answ[57]);
+  #else
+  (void)one;
   #endif
-    return(answer->len);
-  }
-
-  /* copy all headers as-is */
-  memcpy(answ, reqbuff, 60);
-
-  /* switch src and dst addresses so the reply header is ready */
-  memcpy(answ, answ + 6, 6);  /* copy source mac into dst field */
-  memcpy(answ + 6, mymac, 6); /* copy my mac into source field */
-  /* remember the pointer to the AX result, and fetch reqdrv and AL query */
-  ax = (uint16_t *)answ + 29;
-  reqdrv = reqbuff[58] & 31; /* 5 lowest -> drive */
-  reqflags = reqbuff[58] >> 5; /* 3 highest bits -> flags */
-  reqflags = reqflags; /* just so the compiler won't complain (I don't use flags yet) */
-  query = reqbuff[59];
-  /* skip eth headers now, as well as padding, seq, reqdrv and AL */
-  reqbuff += 60;
-  answ += 60;
-  reqbufflen -= 60;
-  reslen = 0;
-  /* set up wansw and wreqbuff */
-  wansw = (uint16_t *)answ;
-  wreqbuff = (uint16_t *)reqbuff;
-
-  /* is the drive valid? (C: - Z:) */
-  if ((reqdrv < 2) || (reqdrv > 25)) { /* 0=A, 1=B, 2=C, etc */
-    fprintf(stderr, "invalid drive value: 0x%02Xh\n", reqdrv);
-    return(-3);
-  }
-  /* do I know this drive? */
-  root = rootarray[reqdrv];
-  if (root == NULL) {
-    fprintf(stderr, "unknown drive: %c: (%02Xh)\n", 'A' + reqdrv, reqdrv);
-    return(-3);
-  }
-  /* assume success (hence AX == 0 most of the time) */
-  *ax = 0;
-  /* let's look at the exact query */
-  DBG("Got query: %02Xh [%02X %02X %02X %02X]\n", query, reqbuff[0], reqbuff[1], reqbuff[2], reqbuff[3]);
-  if (query == AL_DISKSPACE) {
-    unsigned long long diskspace, freespace;
-    DBG("DISKSPACE for drive '%c:'\n", 'A' + reqdrv);
-    diskspace = diskinfo(root, &freespace);
-    /* limit results to slightly under 2 GiB (otherwise MS-DOS is confused) */
-    if (diskspace >= 2lu*1024*1024*1024) diskspace = 2lu*1024*1024*1024 - 1;
-    if (freespace >= 2lu*1024*1024*1024) freespace = 2lu*1024*1024*1024 - 1;
-    DBG("TOTAL: %llu KiB ; FREE: %llu KiB\n", diskspace >> 10, freespace >> 10);
-    *ax = 1; /* AX: media id (8 bits) | sectors per cluster (8 bits) -- MSDOS tolerates only 1 here! */
-    wansw[1] = htole16(32768);  /* CX: bytes per sector */
-    diskspace >>= 15; /* space to number of 32K clusters */
-    freespace >>= 15; /* space to number of 32K clusters */
-    wansw[0] = htole16(diskspace); /* BX: total clusters */
-    wansw[2] = htole16(freespace); /* DX: available clusters */
-    reslen += 6;
-  } else if ((query == AL_READFIL) && (reqbufflen == 8)) {  /* AL=08h */
-    uint16_t len, fileid;
-    uint32_t offset;
-    long readlen;
-    offset = le32toh(((uint32_t *)reqbuff)[0]);
-    fileid = le16toh(wreqbuff[2]);
-    len = le16toh(wreqbuff[3]);
-    DBG("Asking for %u bytes of the file #%u, starting offset %u\n", len, fileid, offset);
-    readlen = readfile(answ, fileid, offset, len);
-    if (readlen < 0) {
-      fprintf(stderr, "ERROR: invalid handle\n");
-      *ax = 5; /* "access denied" */
-    } else {
-      reslen += readlen;
-    }
-  } else if ((query == AL_WRITEFIL) && (reqbufflen >= 6)) {  /* AL=09h */
-    uint16_t fileid;
-    uint32_t offset;
-    long writelen;
-    offset = le32toh(((uint32_t *)reqbuff)[0]);
-    fileid = le16toh(wreqbuff[2]);
-    DBG("Writing %u bytes into file #%u, starting offset %u\n", reqbufflen - 6, fileid, offset);
-    writelen = writefile(reqbuff + 6, fileid, offset, reqbufflen - 6);
-    if (writelen < 0) {
-      fprintf(stderr, "ERROR: Access denied");
-      *ax = 5; /* "access denied" */
-    } else {
-      wansw[0] = htole16(writelen);
-      reslen += 2;
-    }
-  } else if ((query == AL_LOCKFIL) || (query == AL_UNLOCKFIL)) { /* 0x0A / 0x0B */
-    /* I do nothing, except lying that lock/unlock succeeded */
-  } else if (query == AL_FINDFIRST) { /* 0x1B */
-    struct fileprops fprops;
-    char directory[DIR_MAX];
-    char host_directory[DIR_MAX];
-    unsigned short dirss;
-    char filemask[16], filemaskfcb[12];
-    int offset;
-    unsigned fattr;
-    unsigned short fpos = 0;
-    int flags;
-    fattr = reqbuff[0];
-    offset = sprintf(directory, "%s/", root);
-    /* */
-    /* explode the full "\DIR\FILE????.???" search path into directory and mask */
-    explodepath(directory + offset, filemask, (char *)reqbuff + 1, reqbufflen - 1);
-    lostring(directory + offset, -1);
-    lostring(filemask, -1);
-    charreplace(directory, '\\', '/');
-    /* */
-    filename2fcb(filemaskfcb, filemask);
-    DBG("FindFirst in '%s'\nfilemask: '%s' (FCB '%s')\nattribs: 0x%2X\n", directory, filemask, pfcb(filemaskfcb), fattr);
-    flags = 0;
-    if (isroot(root, directory) != 0) flags |= FFILE_ISROOT;
-    if (drivesfat[reqdrv] != 0) flags |= FFILE_ISFAT;
-
-    /* try to get the host name for this string */
-    if (shorttolong(host_directory, directory, root) != 0) {
-      fprintf(stderr, "FINDFIRST Error (%s): Cannot obtain host path for directory.", directory);
-      /* let the rest of the code path deal with error handling, whatever... */
-    }
-
-    dirss = getitemss(host_directory);
-    if ((dirss == 0xffffu) || (findfile(&fprops, dirss, filemaskfcb, fattr, &fpos, flags) != 0)) {
-      DBG("No matching file found\n");
-      *ax = 0x12; /* 0x12 is "no more files" -- one would assume 0x02 "file not found" would be better, but that's not what MS-DOS 5.x does, some applications rely on a failing FFirst to return 0x12 (for example LapLink 5) */
-    } else { /* found a file */
-      DBG("found file: FCB '%s' (attr %02Xh)\n", pfcb(fprops.fcbname), fprops.fattr);
-      answ[0] = fprops.fattr; /* fattr (1=RO 2=HID 4=SYS 8=VOL 16=DIR 32=ARCH 64=DEVICE) */
-      memcpy(answ + 1, fprops.fcbname, 11);
-      answ[12] = fprops.ftime & 0xff;
-      answ[13] = (fprops.ftime >> 8) & 0xff;
-      answ[14] = (fprops.ftime >> 16) & 0xff;
-      answ[15] = (fprops.ftime >> 24) & 0xff;
-      answ[16] = fprops.fsize & 0xff;         /* fsize */
-      answ[17] = (fprops.fsize >> 8) & 0xff;  /* fsize */
-      answ[18] = (fprops.fsize >> 16) & 0xff; /* fsize */
-      answ[19] = (fprops.fsize >> 24) & 0xff; /* fsize */
-      wansw[10] = htole16(dirss); /* dir id */
-      wansw[11] = htole16(fpos); /* file position in dir */
-      reslen = 24;
-    }
-  } else if (query == AL_FINDNEXT) { /* 0x1C */
-    unsigned short fpos;
-    struct fileprops fprops;
-    char *fcbmask;
-    unsigned char fattr;
-    unsigned short dirss;
-    int flags;
-    dirss = le16toh(wreqbuff[0]);
-    fpos = le16toh(wreqbuff[1]);
-    fattr = reqbuff[4];
-    fcbmask = (char *)reqbuff + 5;
-    /* */
-    DBG("FindNext looks for nth file %u in dir #%u\nfcbmask: '%s'\nattribs: 0x%2X\n", fpos, dirss, pfcb(fcbmask), fattr);
-    flags = 0;
-    if (isroot(root, sstoitem(dirss)) != 0) flags |= FFILE_ISROOT;
-    if (drivesfat[reqdrv] != 0) flags |= FFILE_ISFAT;
-    if (findfile(&fprops, dirss, fcbmask, fattr, &fpos, flags)) {
-      DBG("No more matching files found\n");
-      *ax = 0x12; /* "no more files" */
-    } else { /* found a file */
-      DBG("found file: FCB '%s' (attr %02Xh)\n", pfcb(fprops.fcbname), fprops.fattr);
-      answ[0] = fprops.fattr; /* fattr (1=RO 2=HID 4=SYS 8=VOL 16=DIR 32=ARCH 64=DEVICE) */
-      memcpy(answ + 1, fprops.fcbname, 11);
-      answ[12] = fprops.ftime & 0xff;
-      answ[13] = (fprops.ftime >> 8) & 0xff;
-      answ[14] = (fprops.ftime >> 16) & 0xff;
-      answ[15] = (fprops.ftime >> 24) & 0xff;
-      answ[16] = fprops.fsize & 0xff;         /* fsize */
-      answ[17] = (fprops.fsize >> 8) & 0xff;  /* fsize */
-      answ[18] = (fprops.fsize >> 16) & 0xff; /* fsize */
-      answ[19] = (fprops.fsize >> 24) & 0xff; /* fsize */
-      wansw[10] = htole16(dirss); /* dir id */
-      wansw[11] = htole16(fpos);  /* file position in dir */
-      reslen = 24;
-    }
-  } else if ((query == AL_MKDIR) || (query == AL_RMDIR)) { /* MKDIR or RMDIR */
-    char directory[DIR_MAX];
-    char host_directory[DIR_MAX];
-    int offset;
-    offset = sprintf(directory, "%s/", root);
-    /* explode the full "\DIR\FILE????.???" search path into directory and mask */
-    memcpy(directory + offset, (char *)reqbuff, reqbufflen);
-    directory[offset + reqbufflen] = 0;
-    lostring(directory + offset, -1);
-    charreplace(directory, '\\', '/');
-
-    /* try to get the host name for this string */
-    /* HACK: so we expect this to fail because, but shorttolong *does* append the last section of the requested path as is, so we just try with that */
-    if (shorttolong(host_directory, directory, root) == 0) {
-      fprintf(stderr, "MKDIR Error (%s): A file exists that matches this name pattern.\n", directory);
-    }
-
-    if (query == AL_MKDIR) {
-      DBG("MKDIR '%s'\n", host_directory);
-      if (makedir(host_directory) != 0) {
-        *ax = 29;
-        fprintf(stderr, "MKDIR Error: %s\n", strerror(errno));
-      }
-    } else {
-      DBG("RMDIR '%s'\n", host_directory);
-      if (remdir(host_directory) != 0) {
-        *ax = 29;
-        fprintf(stderr, "RMDIR Error: %s\n", strerror(errno));
-      }
-    }
-  } else if (query == AL_CHDIR) { /* check if dir exist, return ax=0 if so, ax=3 otherwise */
-    char directory[DIR_MAX];
-    char host_directory[DIR_MAX];
-    int offset;
-    offset = sprintf(directory, "%s/", root);
-    memcpy(directory + offset, (char *)reqbuff, reqbufflen);
-    directory[offset + reqbufflen] = 0;
-    lostring(directory + offset, -1);
-    charreplace(directory, '\\', '/');
-    DBG("CHDIR '%s'\n", directory);
-
-    /* try to get the host name for this string */
-    if (shorttolong(host_directory, directory, root) != 0) {
-      fprintf(stderr, "CHDIR Error (%s): Cannot obtain host path for directory.\n", directory);
-      *ax = 3;
-    } else if (changedir(host_directory) != 0) {
-      fprintf(stderr, "CHDIR Error (%s): %s\n", host_directory, strerror(errno));
-      *ax = 3;
-    }
-  } else if (query == AL_CLSFIL) { /* AL_CLSFIL (0x06) */
-    /* I do nothing, since I do not keep any open files around anyway.
-     * just say 'ok' by sending back AX=0 */
-    DBG("CLOSE FILE\n");
-    *ax = 0;
-  } else if ((query == AL_SETATTR) && (reqbufflen > 1)) { /* AL_SETATTR (0x0E) */
-    char fullpathname[DIR_MAX];
-    char host_fullpathname[DIR_MAX];
-    int offset;
-    unsigned char fattr;
-    fattr = reqbuff[0];
-    /* get full file path */
-    offset = sprintf(fullpathname, "%s/", root);
-    memcpy(fullpathname + offset, (char *)reqbuff + 1, reqbufflen - 1);
-    fullpathname[offset + reqbufflen - 1] = 0;
-    lostring(fullpathname + offset, -1);
-    charreplace(fullpathname, '\\', '/');
-
-    DBG("SETATTR [file: '%s', attr: 0x%02X]\n", fullpathname, fattr);
-
-    /* try to get the host name for this string */
-    if (shorttolong(host_fullpathname, fullpathname, root) != 0) {
-      fprintf(stderr, "SETATTR Error (%s): Cannot obtain host path for directory.\n", fullpathname);
-      *ax = 2;
-    } else if (drivesfat[reqdrv] != 0) {
-      /* set attr, but only if drive is FAT */
-      if (setitemattr(host_fullpathname, fattr) != 0) *ax = 2;
-    }
-  } else if ((query == AL_GETATTR) && (reqbufflen > 0)) { /* AL_GETATTR (0x0F) */
-    char fullpathname[DIR_MAX];
-    char host_fullpathname[DIR_MAX];
-    int offset;
-    struct fileprops fprops;
-    /* get full file path */
-    offset = sprintf(fullpathname, "%s/", root);
-    memcpy(fullpathname + offset, (char *)reqbuff, reqbufflen);
-    fullpathname[offset + reqbufflen] = 0;
-    lostring(fullpathname + offset, -1);
-    charreplace(fullpathname, '\\', '/');
-
-    DBG("GETATTR on file: '%s' (fatflag=%d)\n", fullpathname, drivesfat[reqdrv]);
-
-    /* try to get the host name for this string */
-    if (shorttolong(host_fullpathname, fullpathname, root) != 0) {
-      fprintf(stderr, "GETATTR Error (%s): Cannot obtain host path for directory.\n", fullpathname);
-      *ax = 2;
-    } else if (getitemattr(host_fullpathname, &fprops, drivesfat[reqdrv]) == 0xFF) {
-      DBG("no file found\n");
-      *ax = 2;
-    } else {
-      DBG("found it (%lu bytes, attr 0x%02X)\n", fprops.fsize, fprops.fattr);
-      answ[reslen++] = fprops.ftime & 0xff;
-      answ[reslen++] = (fprops.ftime >> 8) & 0xff;
-      answ[reslen++] = (fprops.ftime >> 16) & 0xff;
-      answ[reslen++] = (fprops.ftime >> 24) & 0xff;
-      answ[reslen++] = fprops.fsize & 0xff;
-      answ[reslen++] = (fprops.fsize >> 8) & 0xff;
-      answ[reslen++] = (fprops.fsize >> 16) & 0xff;
-      answ[reslen++] = (fprops.fsize >> 24) & 0xff;
-      answ[reslen++] = fprops.fattr;
-    }
-  } else if ((query == AL_RENAME) && (reqbufflen > 2)) { /* AL_RENAME (0x11) */
-    /* query is LSSS...DDD... */
-    char fn1[1024], fn2[1024];
-    char host_fn1[1024];
-    int fn1len, fn2len, offset;
-    offset = sprintf(fn1, "%s/", root);
-    sprintf(fn2, "%s/", root);
-    fn1len = reqbuff[0];
-    fn2len = reqbufflen - (1 + fn1len);
-    if (reqbufflen > fn1len) {
-      memcpy(fn1 + offset, reqbuff + 1, fn1len);
-      fn1[fn1len + offset] = 0;
-      lostring(fn1 + offset, -1);
-      charreplace(fn1, '\\', '/');
-      memcpy(fn2 + offset, reqbuff + 1 + fn1len, fn2len);
-      fn2[fn2len + offset] = 0;
-      lostring(fn2 + offset, -1);
-      charreplace(fn2, '\\', '/');
-
-      DBG("RENAME src='%s' dst='%s'\n", fn1, fn2);
-
-      /* try to get the host name for this string */
-      if (shorttolong(host_fn1, fn1, root) != 0) {
-        fprintf(stderr, "RENAME Error (%s): Cannot obtain host path for directory.\n", fn1);
-      } else {
-        if (getitemattr(fn2, NULL, 0) != 0xff) {
-          /* if fn2 destination exists, abort with errcode=5 (as does MS-DOS 5) */
-            DBG("ERROR: '%s' exists already\n", fn2);
-            *ax = 5;
-          } else {
-            DBG("'%s' doesn't exist -> proceed with renaming\n", fn2);
-            if (renfile(host_fn1, fn2) != 0) *ax = 5;
-          }
-      }
-    } else {
-      *ax = 2;
-    }
-  } else if (query == AL_DELETE) {
-    char fullpathname[DIR_MAX];
-    char host_fullpathname[DIR_MAX];
-    int offset;
-    /* compute full path/file first */
-    offset = sprintf(fullpathname, "%s/", root);
-    memcpy(fullpathname + offset, reqbuff, reqbufflen);
-    fullpathname[reqbufflen + offset] = 0;
-    lostring(fullpathname + offset, -1);
-    charreplace(fullpathname, '\\', '/');
-    DBG("DELETE '%s'\n", fullpathname);
-
-    
-    /* try to get the host name for this string */
-    if (shorttolong(host_fullpathname, fullpathname, root) != 0) {
-      fprintf(stderr, "DELETE Error (%s): Cannot obtain host path for directory.\n", fullpathname);
-      *ax = 2;
-    } else if (getitemattr(host_fullpathname, NULL, drivesfat[reqdrv]) & 1) { /* is it read-only? */    
-      *ax = 5; /* "access denied" */
-    } else if (delfiles(host_fullpathname) < 0) {
-      *ax = 2;
-    }
-  } else if ((query == AL_OPEN) || (query == AL_CREATE) || (query == AL_SPOPNFIL)) { /* OPEN is only about "does this file exist", and CREATE "please create or truncate this file", while SPOPNFIL is a combination of both with extra flags */
-    struct fileprops fprops;
-    char directory[DIR_MAX];
-    char host_directory[DIR_MAX];
-    char fname[DIR_MAX];
-    char fnamefcb[12];
-    char fullpathname[DIR_MAX];
-    char host_fullpathname[DIR_MAX*2+1];
-    int offset;
-    int fileres;
-    unsigned short stackattr, actioncode, spopen_openmode, spopres = 0;
-    unsigned char resopenmode;
-    /* fetch args */
-    stackattr = le16toh(wreqbuff[0]);
-    actioncode = le16toh(wreqbuff[1]);
-    spopen_openmode = le16toh(wreqbuff[2]);
-    /* compute full path/file */
-    offset = sprintf(fullpathname, "%s/", root);
-    memcpy(fullpathname + offset, reqbuff + 6, reqbufflen - 6);
-    fullpathname[reqbufflen + offset - 6] = 0;
-    lostring(fullpathname + offset, -1);
-    charreplace(fullpathname, '\\', '/');
-    /* compute directory and 'search mask' */
-    offset = sprintf(directory, "%s/", root);
-    explodepath(directory + offset, fname, (char *)reqbuff+6, reqbufflen-6);
-
-    lostring(directory + offset, -1);
-    charreplace(directory, '\\', '/');
-
-    /* does the directory exist? */
-    if ((shorttolong(host_directory, directory, root) != 0) || (changedir(host_directory) != 0)) {
-      DBG("open/create/spop failed because directory does not exist\n");
-      *ax = 3; /* "path not found" */
-    } else {
-      /* Directory exists, attempt to get host version of the full path name, hoping it exists. */
-      if (shorttolong(host_fullpathname, fullpathname, root) == 0) {
-        /* if it does, copy its filename to host_fname.*/
-        DBG("Exists, pre:  fname '%s' host_fullpathname '%s'\n", fname, host_fullpathname);
-        copy_after_last_slash(fname, host_fullpathname);
-        DBG("Exists, post: fname '%s' host_fullpathname '%s'\n", fname, host_fullpathname);
-      } else {
-        /* if it doesn't exist, make file name lowercase and then craft the host full path name */
-        sprintf(host_fullpathname, "%s/%s", host_directory, fname);
-      }
-
-      /* compute a FCB-style version of the filename */
-      filename2fcb(fnamefcb, fname);
-      /* */
-      DBG("stack word: %04X\n", stackattr);
-      DBG("looking for file '%s' (FCB '%s') in '%s'\n", fname, pfcb(fnamefcb), directory);
-      /* open or create file, depending on exact subfunction */
-      if (query == AL_CREATE) {
-        DBG("CREATEFIL / stackattr (attribs)=%04Xh / fn='%s'\n", stackattr, fullpathname);
-        fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, drivesfat[reqdrv]);
-        resopenmode = 2; /* read/write */
-      } else if (query == AL_SPOPNFIL) {
-        /* actioncode contains instructions about how to behave...
-         *   high nibble = action if file does NOT exist:
-         *     0000 fail
-         *     0001 create
-         *   low nibble = action if file DOES exist
-         *     0000 fail
-         *     0001 open
-         *     0010 replace/open */
-        int attr;
-        DBG("SPOPNFIL / stackattr=%04Xh / action=%04Xh / openmode=%04Xh / fn='%s'\n", stackattr, actioncode, spopen_openmode, fullpathname);
-        /* see if file exists (and is a file) */
-        attr = getitemattr(host_fullpathname, &fprops, drivesfat[reqdrv]);
-        resopenmode = spopen_openmode & 0x7f; /* that's what PHANTOM.C does */
-        if (attr == 0xff) { /* file not found - look at high nibble of action code */
-          DBG("file doesn't exist -> ");
-          if ((actioncode & 0xf0) == 16) { /* create */
-            DBG("create file host_fullpathname='%s' fname='%s'\n", host_fullpathname, fname);
-            fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, drivesfat[reqdrv]);
-            if (fileres == 0) spopres = 2; /* spopres == 2 means 'file created' */
-          } else { /* fail */
-            DBG("fail\n");
-            fileres = 1;
-          }
-        } else if ((attr & (FAT_VOL | FAT_DIR)) != 0) { /* item is a DIR or a VOL */
-          DBG("fail: item '%s' is either a DIR or a VOL\n", fullpathname);
-          fileres = 1;
-        } else { /* file found (not a VOL, not a dir) - look at low nibble of action code */
-          DBG("file exists already (attr %02Xh) -> ", attr);
-          if ((actioncode & 0x0f) == 1) { /* open */
-            DBG("open file\n");
-            fileres = 0;
-            spopres = 1; /* spopres == 1 means 'file opened' */
-          } else if ((actioncode & 0x0f) == 2) { /* truncate */
-            DBG("truncate file host_fullpathname='%s' fname='%s'\n", host_fullpathname, fname);
-            fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, drivesfat[reqdrv]);
-            if (fileres == 0) spopres = 3; /* spopres == 3 means 'file truncated' */
-          } else { /* fail */
-            DBG("fail\n");
-            fileres = 1;
-          }
-        }
-      } else { /* simple 'OPEN' */
-        int attr;
-        DBG("OPENFIL / stackattr (open modes)=%04Xh / fn='%s'\n", stackattr, fullpathname);
-        resopenmode = stackattr & 0xff;
-        attr = getitemattr(host_fullpathname, &fprops, drivesfat[reqdrv]);
-        /* check that item exists, and is neither a volume nor a directory */
-        if ((attr != 0xff) && ((attr & (FAT_VOL | FAT_DIR)) == 0)) {
-          fileres = 0;
-        } else {
-          fileres = 1;
-        }
-      }
-      if (fileres != 0) {
-        DBG("open/create/spop failed with fileres = %d\n", fileres);
-        *ax = 2;
-      } else { /* success (found a file, created it or truncated it) */
-        unsigned short fileid;
-        fileid = getitemss(host_fullpathname);
-        DBG("found file: '%s' FCB '%s' (id %04X)\n", host_fullpathname, pfcb(fprops.fcbname), fileid);
-        DBG("     fsize: %lu\n", fprops.fsize);
-        DBG("     fattr: %02Xh\n", fprops.fattr);
-        DBG("     ftime: %04lX\n", fprops.ftime);
-        if (fileid == 0xffffu) {
-          fprintf(stderr, "ERROR: failed to get a proper fileid!\n");
-          return(-1);
-        }
-        answ[reslen++] = fprops.fattr; /* fattr (1=RO 2=HID 4=SYS 8=VOL 16=DIR 32=ARCH 64=DEVICE) */
-        memcpy(answ + reslen, fprops.fcbname, 11);
-        reslen += 11;
-        answ[reslen++] = fprops.ftime & 0xff; /* time: YYYYYYYM MMMDDDDD hhhhhmmm mmmsssss */
-        answ[reslen++] = (fprops.ftime >> 8) & 0xff;
-        answ[reslen++] = (fprops.ftime >> 16) & 0xff;
-        answ[reslen++] = (fprops.ftime >> 24) & 0xff;
-        answ[reslen++] = fprops.fsize & 0xff;         /* fsize */
-        answ[reslen++] = (fprops.fsize >> 8) & 0xff;  /* fsize */
-        answ[reslen++] = (fprops.fsize >> 16) & 0xff; /* fsize */
-        answ[reslen++] = (fprops.fsize >> 24) & 0xff; /* fsize */
-        answ[reslen++] = fileid & 0xff;
-        answ[reslen++] = fileid >> 8;
-        /* CX result (only relevant for SPOPNFIL) */
-        answ[reslen++] = spopres & 0xff;
-        answ[reslen++] = spopres >> 8;
-        answ[reslen++] = resopenmode;
-      }
-    }
-  } else if ((query == AL_SKFMEND) && (reqbufflen == 6)) { /* SKFMEND (0x21) */
-    /* translate a 'seek from end' offset into an 'seek from start' offset */
-    int32_t offs = le32toh(((uint32_t *)reqbuff)[0]);
-    long fsize;
-    unsigned short fss = le16toh(((unsigned short *)reqbuff)[2]);
-    DBG("SKFMEND on file #%u at offset %d\n", fss, offs);
-    /* if arg is positive, zero it out */
-    if (offs > 0) offs = 0;
-    /* */
-    fsize = getfopsize(fss);
-    if (fsize < 0) {
-      DBG("ERROR: file not found or other error\n");
-      *ax = 2;
-    } else { /* compute new offset and send it back */
-      DBG("file #%u is %lu bytes long\n", fss, fsize);
-      offs += fsize;
-      if (offs < 0) offs = 0;
-      DBG("new offset: %d\n", offs);
-      ((uint32_t *)answ)[0] = htole32(offs);
-      reslen = 4;
-    }
-  } else { /* unknown query - ignore */
-    return(-1);
-  }
-  return(reslen + 60);
+#else
+  (void)sock;
+#endif
 }
 
-
 static int raw_sock(const char *const interface, void *const hwaddr) {
   struct ifreq iface;
   int socketfd, fl;
@@ -786,6 +156,7 @@ static int raw_sock(const char *const interface, void *const hwaddr) {
   struct sockaddr_ll addr;
   int result;
   int ifindex;
+  int stamp = 1;
 #endif
 
   if ((interface == NULL) || (*interface == 0)) {
@@ -869,6 +240,11 @@ static int raw_sock(const char *const interface, void *const hwaddr) {
 
     if (bind(socketfd, (struct sockaddr *)&addr, sizeof addr)) break;
 
+    /* ask for reception timestamps, so I know how long frames waited */
+    if (setsockopt(socketfd, SOL_SOCKET, SO_TIMESTAMP, &stamp, sizeof(stamp)) != 0) {
+      DBG("ERROR: setsockopt(SO_TIMESTAMP): %s\n", strerror(errno));
+    }
+
     errno = 0;
 #endif
     /* unblock socket, better safe than sorry */ 
@@ -894,46 +270,6 @@ static int raw_sock(const char *const interface, void *const hwaddr) {
 }
 
 
-/* used for debug output of frames on screen */
-#if DEBUG > 0
-static void dumpframe(unsigned char *frame, int len) {
-  int i, b;
-  int lines;
-  const int LINEWIDTH=16;
-  lines = (len + LINEWIDTH - 1) / LINEWIDTH; /* compute the number of lines */
-  /* display line by line */
-  for (i = 0; i < lines; i++) {
-    /* read the line and output hex data */
-    for (b = 0; b < LINEWIDTH; b++) {
-      int offset = (i * LINEWIDTH) + b;
-      if (b == LINEWIDTH / 2) printf(" ");
-      if (offset < len) {
-        printf(" %02X", frame[offset]);
-      } else {
-        printf("   ");
-      }
-    }
-    printf(" | "); /* delimiter between hex and ascii */
-    /* now output ascii data */
-    for (b = 0; b < LINEWIDTH; b++) {
-      int offset = (i * LINEWIDTH) + b;
-      if (b == LINEWIDTH / 2) printf(" ");
-      if (offset >= len) {
-        printf(" ");
-        continue;
-      }
-      if ((frame[offset] >= ' ') && (frame[offset] <= '~')) {
-        printf("%c", frame[offset]);
-      } else {
-        printf(".");
-      }
-    }
-    /* newline and loop */
-    printf("\n");
-  }
-}
-#endif
-
 /* compare two chunks of data, returns 0 if data is the same, non-zero otherwise */
 static int cmpdata(unsigned char *d1, unsigned char *d2, int len) {
   while (len-- > 0) {
@@ -944,17 +280,180 @@ static int cmpdata(unsigned char *d1, unsigned char *d2, int len) {
   return(0);
 }
 
-/* compute the BSD checksum of l bytes starting at ptr */
-static unsigned short bsdsum(unsigned char *ptr, unsigned short l) {
-  unsigned short res = 0;
-  for (; l > 0; l--) {
-    res = (res << 15) | (res >> 1);
-    res += *ptr;
-    ptr++;
+/* sends len bytes of frame out through sock */
+static void sendframe(int sock, unsigned char *frame, int len) {
+  int i;
+#if defined(__FreeBSD__) || defined(__APPLE__)
+  i = write(sock, frame, len);
+  if (i < 0) {
+    log_msg(LOG_ERR, "ERROR: write() returned %d (%s)\n", i, strerror(errno));
+  } else if (i != len) {
+    log_msg(LOG_ERR, "ERROR: write() sent less than expected (%d != %d)\n", i, len);
+  }
+#else
+  i = send(sock, frame, len, 0);
+  if (i < 0) {
+    log_msg(LOG_ERR, "ERROR: send() returned %d (%s)\n", i, strerror(errno));
+  } else if (i != len) {
+    log_msg(LOG_ERR, "ERROR: send() sent less than expected (%d != %d)\n", i, len);
   }
+#endif
+}
+
+/* sends a frame to a client, through the impairment simulator if enabled */
+static void xmit(int sock, unsigned char *frame, int len) {
+  int n = (impair_active() != 0) ? impair_frame(IMPAIR_OUT, frame, len) : 1;
+  for (; n > 0; n--) sendframe(sock, frame, len);
+}
+
+/* runs a frame received from a client through the protocol engine, sends
+ * the answer back and tells watching clients about whatever changed */
+static void handleframe(int sock, struct dfsctx *ctx, unsigned char *buff, int len) {
+  unsigned char notif[DFS_NOTIFYMAX];
+  unsigned char *answer;
+  unsigned long long starttime = stats_now();
+  prof_stage(PROF_HANDLE, buff[59]);
+  len = dfs_handleframe(ctx, buff, len, &answer);
+  prof_stage(PROF_TRANSMIT, 0);
+  if (len > 0) {
+    xmit(sock, answer, len);
+    stats_latency(stats_now() - starttime);
+  }
+  while ((len = dfs_notification(ctx, notif)) > 0) xmit(sock, notif, len);
+}
+
+/* returns how long ago (us) the kernel received a frame stamped with sec
+ * and usec, 0 if unknown */
+static unsigned long frameage(long sec, long usec) {
+  struct timeval now;
+  long long res;
+  if (sec == 0) return(0);
+  gettimeofday(&now, NULL);
+  res = (now.tv_sec - sec) * 1000000ll + (now.tv_usec - usec);
+  if (res < 0) return(0);
   return(res);
 }
 
+/* queues a request frame received age us ago for the scheduler. Frames that
+ * do not fit are dropped, the client will send them again. */
+static void enqueue(struct dfsctx *ctx, unsigned char *frame, int len, unsigned long age) {
+  int iosize = dfs_iosize(frame, len);
+  sched_push(frame, len, (iosize >= DFS_BULKMIN) ? SCHED_BULK : SCHED_INTERACTIVE, iosize, dfs_location(ctx, frame, len), age);
+}
+
+/* accepts a frame read from the network age us ago: skips anything that is
+ * not for me and queues the rest, through the impairment simulator if
+ * enabled */
+static void receive(struct dfsctx *ctx, unsigned char *frame, int len, unsigned long age) {
+  int n;
+  /* runts, and frames longer than any EtherDFS frame (jumbo MTU, lo...) */
+  if ((len < 60) || (len > FRAME_MAX)) return;
+  /* validate this is for me (or broadcast) */
+  if ((cmpdata(ctx->mymac, frame, 6) != 0) && (cmpdata((unsigned char *)"\xff\xff\xff\xff\xff\xff", frame, 6) != 0)) return;
+  n = (impair_active() != 0) ? impair_frame(IMPAIR_IN, frame, len) : 1;
+  for (; n > 0; n--) enqueue(ctx, frame, len, age);
+}
+
+/* reads the frames waiting on sock into the scheduler queue, so the
+ * scheduler gets to see every pending request before picking one. Frames
+ * the queue has no room for are dropped rather than left in the socket,
+ * where they would hold up the requests behind them. At most DRAINMAX
+ * reads are done, so that a flood does not keep the main loop from
+ * serving. buff is a receive buffer of bufflen bytes. */
+static void drain(int sock, struct dfsctx *ctx, unsigned char *buff, int bufflen) {
+  int len, n;
+#if defined(__FreeBSD__) || defined(__APPLE__)
+  struct bpf_hdr *bf_hdr;
+  int off;
+  prof_stage(PROF_RECEIVE, 0);
+  /* a single read() returns all packets captured so far */
+  for (n = 0; (n < DRAINMAX) && ((len = read(sock, buff, bufflen)) >= (int) sizeof (struct bpf_hdr)); n++) {
+    for (off = 0; off + (int) sizeof (struct bpf_hdr) <= len; off += BPF_WORDALIGN(bf_hdr->bh_hdrlen + bf_hdr->bh_caplen)) {
+      bf_hdr = (struct bpf_hdr *) (buff + off);
+      receive(ctx, buff + off + bf_hdr->bh_hdrlen, bf_hdr->bh_caplen, frameage(bf_hdr->bh_tstamp.tv_sec, bf_hdr->bh_tstamp.tv_usec));
+    }
+  }
+#else
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  struct timeval tv;
+  union { /* aligned room for the timestamp control message */
+    struct cmsghdr align;
+    unsigned char buf[CMSG_SPACE(sizeof(struct timeval))];
+  } ctrl;
+  unsigned long age;
+  prof_stage(PROF_RECEIVE, 0);
+  for (n = 0; n < DRAINMAX; n++) {
+    iov.iov_base = buff;
+    iov.iov_len = bufflen;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    len = recvmsg(sock, &msg, MSG_DONTWAIT);
+    if (len < 0) break;
+    age = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SO_TIMESTAMP)) continue;
+      memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+      age = frameage(tv.tv_sec, tv.tv_usec);
+    }
+    receive(ctx, buff, len, age);
+  }
+#endif
+}
+
+/* hands queued requests to the workers of their drives in the order chosen
+ * by the scheduler, picking up new arrivals after each of them */
+static void serve(int sock, struct dfsctx *ctx, unsigned char *buff, int bufflen) {
+  static unsigned char frame[FRAME_MAX];
+  int len, drv;
+  prof_stage(PROF_SCHEDULE, 0);
+  while ((len = sched_pop(frame, worker_busy())) > 0) {
+    drv = frame[58] & 31;
+    if (worker_submit(frame, len) == 0) {
+      stats_drivedepth(drv, sched_drivedepth(drv) + 1);
+    } else { /* no worker (busy-poll mode, or no such drive) */
+      handleframe(sock, ctx, frame, len);
+    }
+    drain(sock, ctx, buff, bufflen);
+    prof_stage(PROF_SCHEDULE, 0);
+  }
+}
+
+/* sends the answers of workers that are done, and tells watching clients
+ * about whatever changed */
+static void complete(int sock, struct dfsctx *ctx) {
+  static unsigned char frame[FRAME_MAX];
+  unsigned char notif[DFS_NOTIFYMAX];
+  unsigned long us;
+  int len, drv;
+  prof_stage(PROF_TRANSMIT, 0);
+  while (worker_collect(frame, &len, &drv, &us) != 0) {
+    if (len > 0) {
+      xmit(sock, frame, len);
+      stats_latency(us);
+    }
+    stats_drivetime(drv, us);
+  }
+  while ((len = dfs_notification(ctx, notif)) > 0) xmit(sock, notif, len);
+}
+
+/* delivers frames held back by the impairment simulator, once they are due */
+static void releaseheld(int sock, struct dfsctx *ctx) {
+  static unsigned char frame[FRAME_MAX];
+  int dir, len;
+  while ((len = impair_pop(&dir, frame)) > 0) {
+    if (dir == IMPAIR_IN) {
+      enqueue(ctx, frame, len, 0);
+    } else {
+      sendframe(sock, frame, len);
+    }
+  }
+}
+
 static void help(void) {
   printf("EtherDFS Server (ethersrv) version " PVER "\n"
          "(C) 2017, 2018 Mateusz Viste, 2020 Michael Ortmann, 2023-2025 E. Voirin (oerg866)\n"
@@ -962,9 +461,20 @@ static void help(void) {
          "\n"
          "usage: ethersrv [options] interface rootpath1 [rootpath2] ... [rootpathN]\n"
          "\n"
-         "Options:\n"
+  );
+  printf("Options:\n"
+         "  -b cpu    Busy-poll the network on CPU cpu, for the lowest latency\n"
+         "  -c cpus   Pin the main loop, then drive workers, to CPUs (0,2,3...)\n"
          "  -f        Keep in foreground (do not daemonize)\n"
          "  -h        Display this information\n"
+         "  -i rule   Simulate an impaired network (for tests only, see README)\n"
+  );
+  printf("  -m        Lock all memory, so requests never wait for page faults\n"
+         "  -q rule   Set the share and caps of a client or group (see README)\n"
+         "  -r pol    Run under real-time scheduling: fifo:prio or rr:prio\n"
+         "  -s secs   Print statistics to stderr every secs seconds\n"
+         "\n"
+         "SIGUSR1 prints statistics, SIGUSR2 starts or stops the profiler.\n"
   );
 }
 
@@ -987,39 +497,63 @@ static int daemonize(void) {
   return(0);
 }
 
-/* generates a formatted MAC address printout and returns a static buffer */
-static char *printmac(unsigned char *b) {
-  static char macbuf[18];
-  sprintf(macbuf, "%02X:%02X:%02X:%02X:%02X:%02X", b[0], b[1], b[2], b[3], b[4], b[5]);
-  return(macbuf);
-}
-
 
 int main(int argc, char **argv) {
-  int sock, len, i, r;
+  static struct dfsctx srvctx;
+  int sock, len, i, r, n, bufflen;
   unsigned char *buff;
-  unsigned char cksumflag;
-  unsigned short edf5framelen;
   unsigned char mymac[6];
-  char *intname, *root[26];
-  struct struct_answcache *cacheptr;
+  char *intname, *paths[26];
   int opt;
   int daemon = 1; /* daemonize self by default */
-#if defined(__FreeBSD__) || defined(__APPLE__)
-  int bpf_len;
-  unsigned char *bpf_buf;
-  struct bpf_hdr *bf_hdr;
-#endif
+  unsigned long reportinterval = 0; /* seconds, 0 = no periodic reports */
+  int busycpu = -1; /* CPU to busy-poll on, -1 = sleep in select() */
+  int lockmem = 0;
+  unsigned long long nextreport;
   #define lockfile "/var/run/ethersrv.lock"
+  #define proffile "/var/run/ethersrv.folded"
 
-  while ((opt = getopt(argc, argv, "fh")) != -1) {
+  while ((opt = getopt(argc, argv, "b:c:fhi:mq:r:s:")) != -1) {
     switch (opt) {
+      case 'b': /* -b cpu: busy-poll */
+        busycpu = atoi(optarg);
+        break;
+      case 'c': /* -c cpus: CPU pinning */
+        if (rt_setcpus(optarg) != 0) {
+          fprintf(stderr, "ERROR: invalid CPU list '%s'\n", optarg);
+          return(1);
+        }
+        break;
       case 'f': /* -f: no daemon */
         daemon = 0;
         break;
       case 'h': /* -h: help */
         help();
         return(0);
+      case 'i': /* -i rule: impairment simulation */
+        if (impair_addrule(optarg) != 0) {
+          fprintf(stderr, "ERROR: invalid impairment rule '%s'\n", optarg);
+          return(1);
+        }
+        break;
+      case 'm': /* -m: lock memory */
+        lockmem = 1;
+        break;
+      case 'q': /* -q rule: client share and caps */
+        if (sched_addrule(optarg) != 0) {
+          fprintf(stderr, "ERROR: invalid client rule '%s'\n", optarg);
+          return(1);
+        }
+        break;
+      case 'r': /* -r policy: real-time scheduling */
+        if (rt_setpolicy(optarg) != 0) {
+          fprintf(stderr, "ERROR: invalid scheduling policy '%s'\n", optarg);
+          return(1);
+        }
+        break;
+      case 's': /* -s secs: periodic statistics */
+        reportinterval = strtoul(optarg, NULL, 10);
+        break;
       case '?': /* error */
         help();
         return(1);
@@ -1031,22 +565,8 @@ int main(int argc, char **argv) {
     return(1);
   }
   intname = argv[optind++];
-  /* load all "virtual drive" paths */
-  for (i = 0; i < 26; i++) root[i] = NULL;
-  for (i = 0; i < (argc - optind); i++) {
-    char tmppath[PATH_MAX];
-    if (realpath(argv[i + optind], tmppath) == NULL) {
-      fprintf(stderr, "ERROR: failed to resolve path '%s'\n", argv[i + optind]);
-      return(1);
-    }
-    root[i + 2] = strdup(tmppath);
-    if (isfat(root[i + 2]) == 0) {
-      drivesfat[i + 2] = 1;
-    } else {
-      drivesfat[i + 2] = 0;
-      fprintf(stderr, "WARNING: the path '%s' doesn't seem to be stored on a FAT filesystem! DOS attributes won't be supported.\n\n", root[i + 2]);
-    }
-  }
+  for (i = 0; i < (argc - optind); i++) paths[i] = argv[i + optind];
+  n = argc - optind;
 
   sock = raw_sock(intname, mymac);
   if (sock == -1) {
@@ -1057,10 +577,27 @@ int main(int argc, char **argv) {
     return(1);
   }
 
+  /* load all "virtual drive" paths */
+  if (dfs_init(&srvctx, mymac) != 0) {
+    fprintf(stderr, "ERROR: out of memory\n");
+    return(1);
+  }
+  for (i = 0; i < n; i++) {
+    if (dfs_adddrive(&srvctx, i + 2, paths[i]) != 0) {
+      fprintf(stderr, "ERROR: failed to resolve path '%s'\n", paths[i]);
+      return(1);
+    }
+    if (srvctx.drivesfat[i + 2] == 0) {
+      fprintf(stderr, "WARNING: the path '%s' doesn't seem to be stored on a FAT filesystem! DOS attributes won't be supported.\n\n", srvctx.root[i + 2]);
+    }
+  }
+
   /* setup signals catcher */
   signal(SIGTERM, sigcatcher);
   signal(SIGQUIT, sigcatcher);
   signal(SIGINT, sigcatcher);
+  signal(SIGUSR1, sigcatcher);
+  signal(SIGUSR2, sigcatcher);
 
   /* acquire the lock file (fail if already exists - likely ethersrv runs already) */
   if (lockme(lockfile) != 0) {
@@ -1069,8 +606,8 @@ int main(int argc, char **argv) {
   }
   printf("Listening on '%s' [%s]\n", intname, printmac(mymac));
   for (i = 2; i < 26; i++) {
-    if (root[i] == NULL) break;
-    printf("Drive %c: mapped to %s\n", 'A' + i, root[i]);
+    if (srvctx.root[i] == NULL) break;
+    printf("Drive %c: mapped to %s\n", 'A' + i, srvctx.root[i]);
   }
 
   if (daemon != 0) {
@@ -1079,169 +616,157 @@ int main(int argc, char **argv) {
       return(1);
     }
   }
-#if defined(__FreeBSD__) || defined(__APPLE__)
-  if (ioctl(sock, BIOCGBLEN, &bpf_len) < 0) {
-    DBG("ERROR1: could not get the required buffer length for reads on bpf files: %s\n", strerror(errno));
+
+  /* runtime messages go through the logger from now on, so a burst of them
+   * never stalls the main loop (started before any real-time setup, it is
+   * not worth a CPU nor a high priority) */
+  if (log_start(daemon) != 0) {
+    fprintf(stderr, "Error: failed to start the logger!\n");
     return(1);
   }
-  if ((bpf_buf = malloc(bpf_len)) == NULL) {
-    DBG("ERROR: malloc(): %s\n", strerror(errno));
+
+  /* sample the main loop when profiling (its thread id changes when
+   * daemonizing) */
+  prof_thread("main");
+
+  /* memory locks are not inherited through fork(), hence done after
+   * daemonizing, but before workers are started so their stacks get locked */
+  if ((lockmem != 0) && (rt_lockmem() != 0)) {
+    fprintf(stderr, "Error: failed to lock memory (%s)\n", strerror(errno));
+    return(1);
+  }
+  if (rt_apply(0) != 0) {
+    fprintf(stderr, "Error: failed to set the CPU or priority of the main loop (%s)\n", strerror(errno));
+    return(1);
+  }
+  if (busycpu >= 0) {
+    /* busy-poll mode: spin on a CPU of its own instead of sleeping. Requests
+     * are served right away by this loop, as waking up drive workers would
+     * bring back the latency this mode is about. */
+    if (rt_pincpu(busycpu) != 0) {
+      fprintf(stderr, "Error: failed to pin to CPU %d (%s)\n", busycpu, strerror(errno));
+      return(1);
+    }
+    busypoll(sock);
+  } else if (worker_start(&srvctx) != 0) {
+    /* start the drive workers (after daemonizing, threads do not survive fork) */
+    fprintf(stderr, "Error: failed to start drive workers!\n");
+    return(1);
+  }
+#if defined(__FreeBSD__) || defined(__APPLE__)
+  if (ioctl(sock, BIOCGBLEN, &bufflen) < 0) {
+    DBG("ERROR1: could not get the required buffer length for reads on bpf files: %s\n", strerror(errno));
     return(1);
   }
 #else
-  if ((buff = malloc(BUFF_LEN)) == NULL) {
+  bufflen = BUFF_LEN;
+#endif
+  if ((buff = malloc(bufflen)) == NULL) {
     DBG("ERROR: malloc(): %s\n", strerror(errno));
     return(1);
   }
-#endif
 
   /* main loop */
-  while (1) {
-#if DEBUG > 0
-    struct timeval stimeout = {10, 0}; /* set timeout to 10s */
-#endif
+  nextreport = stats_now() + reportinterval * 1000000ull;
+  while (terminationflag == 0) {
+    struct timeval stimeout, *ptimeout = NULL;
+    long wait = -1, due; /* ms */
     /* prepare the set of descriptors to be monitored later through select() */
     fd_set fdset;
+    int maxfd = sock;
+    prof_stage(PROF_POLL, 0);
+#if DEBUG > 0
+    wait = 10000; /* set timeout to 10s */
+#endif
+    /* wake up in time for frames held by the impairment simulator */
+    due = impair_nextdue();
+    if ((due >= 0) && ((wait < 0) || (due < wait))) wait = due;
+    /* ...for requests held back by a client cap */
+    due = sched_nextdue(worker_busy());
+    if ((due >= 0) && ((wait < 0) || (due < wait))) wait = due;
+    /* ...and for the next statistics report */
+    if (reportinterval != 0) {
+      unsigned long long now = stats_now();
+      due = (nextreport > now) ? (long)((nextreport - now) / 1000) : 0;
+      if ((wait < 0) || (due < wait)) wait = due;
+    }
+    /* in busy-poll mode, just look and come back */
+    if (busycpu >= 0) wait = 0;
+    if (wait >= 0) {
+      stimeout.tv_sec = wait / 1000;
+      stimeout.tv_usec = (wait % 1000) * 1000;
+      ptimeout = &stimeout;
+    }
     FD_ZERO(&fdset);
     FD_SET(sock, &fdset);
+    if (watch_fd(srvctx.watches) >= 0) {
+      FD_SET(watch_fd(srvctx.watches), &fdset);
+      if (watch_fd(srvctx.watches) > maxfd) maxfd = watch_fd(srvctx.watches);
+    }
+    if (worker_fd() >= 0) {
+      FD_SET(worker_fd(), &fdset);
+      if (worker_fd() > maxfd) maxfd = worker_fd();
+    }
     /* wait for something to happen on my socket */
-#if DEBUG > 0
-    r = select(sock + 1, &fdset, NULL, NULL, &stimeout);
-#else
-    r = select(sock + 1, &fdset, NULL, NULL, NULL);
-#endif
-    if (!r)
-      continue; /* timeout / heartbeat */
+    r = select(maxfd + 1, &fdset, NULL, NULL, ptimeout);
     if (r < 0) {
       if (terminationflag)
         break;
-      DBG("ERROR: select(): %s\n", strerror(errno));
-      continue;
-    }
-#if defined(__FreeBSD__) || defined(__APPLE__)
-    if ((len = read(sock, bpf_buf, bpf_len)) < (int) sizeof (struct bpf_hdr)) {
-      DBG("ERROR: read(): %s\n", strerror(errno));
-      continue;
-    }
-    bf_hdr = (struct bpf_hdr *) bpf_buf;
-    buff = bpf_buf + bf_hdr->bh_hdrlen;
-#else
-    len = recv(sock, buff, BUFF_LEN, MSG_DONTWAIT);
-#endif
-    if (len < 60) continue; /* restart if less than 60 bytes or negative */
-    /* validate this is for me (or broadcast) */
-    if ((cmpdata(mymac, buff, 6) != 0) && (cmpdata((unsigned char *)"\xff\xff\xff\xff\xff\xff", buff, 6) != 0)) continue; /* skip anything that is not for me */
-    /* is this ETHERTYPE_DFS? */
-    if (((unsigned short *)buff)[6] != htons(ETHERTYPE_DFS)) {
-      fprintf(stderr, "Error: Received non-ETHERTYPE_DFS frame\n");
-      continue;
-    }
-    /* validate protocol version matches what I expect */
-    if ((buff[56] & 127) != PROTOVER) {
-      fprintf(stderr, "Error: unsupported protocol version from %s\n", buff + 6);
-      continue;
-    }
-    cksumflag = buff[56] >> 7;
-    /* trim of padding, if any, or reject frame if it came truncated */
-    edf5framelen = le16toh(((unsigned short *)buff)[26]);
-    if (edf5framelen == 0) {
-      /* nothing to do, edf5framelen is not provided */
-    } else if (edf5framelen > len) { /* frame seems truncated */
-      fprintf(stderr, "Error: received a truncated frame from %s\n", printmac(buff + 6));
-      continue;
-    } else if (edf5framelen < 60) { /* obvious error */
-      fprintf(stderr, "Error: received a malformed frame from %s\n", printmac(buff + 6));
-      continue;
-    } else { /* edf5framelen seems sane, use it instead of the Ethernet length */
-      #if DEBUG > 0
-        if (len != edf5framelen) {
-          DBG("Note: Received frame with padding from %s (edf5len = %u, ethernet len = %u)\n", printmac(buff + 6), edf5framelen, len);
-        }
-      #endif
-      len = edf5framelen;
-    }
-    /* */
-  #if DEBUG > 0
-    DBG("Received frame of %d bytes (cksum = %s)\n", len, (cksumflag != 0)?"ENABLED":"DISABLED");
-    dumpframe(buff, len);
-  #endif
-   #if SIMLOSS > 0
-    /* simulated frame LOSS (input) */
-    if ((rand() & 31) == 0) {
-      fprintf(stderr, "INPUT LOSS!\n");
-      continue;
-    }
-   #endif
-    /* validate the CKSUM, if any */
-    if (cksumflag != 0) {
-      unsigned short cksum_remote, cksum_mine;
-      cksum_mine = bsdsum(buff + 56, len - 56);
-      cksum_remote = le16toh(((unsigned short *)buff)[27]);
-      if (cksum_mine != cksum_remote) {
-        fprintf(stderr, "CHECKSUM MISMATCH! Computed: 0x%02Xh Received: 0x%02Xh\n", cksum_mine, cksum_remote);
+      if (errno != EINTR) {
+        DBG("ERROR: select(): %s\n", strerror(errno));
         continue;
       }
-    }
-    /* */
-    cacheptr = findcacheentry(buff + 6);
-    /* process frame */
-    len = process(cacheptr, buff, len, mymac, root);
-    /* update cache entry */
-    if (len >= 0) {
-      cacheptr->len = len;
-      cacheptr->timestamp = time(NULL);
-    } else {
-      cacheptr->len = 0;
-    }
-    /* */
-   #if SIMLOSS > 0
-    /* simulated frame LOSS (output) */
-    if ((rand() & 31) == 0) {
-      fprintf(stderr, "OUTPUT LOSS!\n");
-      continue;
-    }
-   #endif
-    DBG("---------------------------------\n");
-    if (len > 0) {
-      /* fill in frame's length */
-      cacheptr->frame[52] = len & 0xff;
-      cacheptr->frame[53] = (len >> 8) & 0xff;
-      /* fill in checksum into the answer */
-      if (cksumflag != 0) {
-        unsigned short newcksum = bsdsum(cacheptr->frame + 56, len - 56);
-        cacheptr->frame[54] = newcksum & 0xff;
-        cacheptr->frame[55] = (newcksum >> 8) & 0xff;
-        cacheptr->frame[56] |= 128; /* make sure to set the CKS bit */
+      r = 0; /* interrupted by a signal, perhaps a report request */
+    }
+    /* deliver frames held by the impairment simulator that are due now */
+    releaseheld(sock, &srvctx);
+    /* time for a statistics report? */
+    if ((reportflag != 0) || ((reportinterval != 0) && (stats_now() >= nextreport))) {
+      prof_stage(PROF_REPORT, 0);
+      stats_report(stderr, &srvctx);
+      dfs_printopstats(&srvctx, stderr);
+      sched_printstats(stderr);
+      reportflag = 0;
+      if (reportinterval != 0) nextreport = stats_now() + reportinterval * 1000000ull;
+    }
+    /* start or stop the profiler? */
+    if (profflag != 0) {
+      long samples;
+      profflag = 0;
+      if (prof_active() == 0) {
+        if (prof_start() == 0) {
+          log_msg(LOG_INFO, "profiler started (%s)\n", prof_method());
+        } else {
+          log_msg(LOG_ERR, "ERROR: failed to start the profiler\n");
+        }
+      } else if ((samples = prof_stop(proffile)) >= 0) {
+        log_msg(LOG_INFO, "profile written to '%s' (%ld samples)\n", proffile, samples);
       } else {
-        cacheptr->frame[54] = 0;
-        cacheptr->frame[55] = 0;
-        cacheptr->frame[56] &= 127; /* make sure to reset the CKS bit */
-      }
-  #if DEBUG > 0
-      DBG("Sending back an answer of %d bytes\n", len);
-      dumpframe(cacheptr->frame, len);
-  #endif
-#if defined(__FreeBSD__) || defined(__APPLE__)
-      i = write(sock, cacheptr->frame, len);
-      if (i < 0) {
-        fprintf(stderr, "ERROR: write() returned %d (%s)\n", i, strerror(errno));
-      } else if (i != len) {
-        fprintf(stderr, "ERROR: write() sent less than expected (%d != %d)\n", i, len);
+        log_msg(LOG_ERR, "ERROR: failed to write the profile to '%s'\n", proffile);
       }
-#else
-      i = send(sock, cacheptr->frame, len, 0);
-      if (i < 0) {
-        fprintf(stderr, "ERROR: send() returned %d (%s)\n", i, strerror(errno));
-      } else if (i != len) {
-        fprintf(stderr, "ERROR: send() sent less than expected (%d != %d)\n", i, len);
+    }
+    if (r > 0) {
+      /* host file system changed under watched directories? */
+      if ((watch_fd(srvctx.watches) >= 0) && FD_ISSET(watch_fd(srvctx.watches), &fdset)) {
+        unsigned char notif[DFS_NOTIFYMAX];
+        prof_stage(PROF_NOTIFY, 0);
+        watch_readevents(srvctx.watches);
+        while ((len = dfs_notification(&srvctx, notif)) > 0) xmit(sock, notif, len);
       }
-#endif
-    } else {
-      fprintf(stderr, "Query ignored (result: %d)\n", len);
+      /* answers ready? */
+      if ((worker_fd() >= 0) && FD_ISSET(worker_fd(), &fdset)) complete(sock, &srvctx);
+      /* fetch all pending requests */
+      if (FD_ISSET(sock, &fdset)) drain(sock, &srvctx, buff, bufflen);
     }
-    DBG("---------------------------------\n");
+    /* ...and serve them, interactive ones first */
+    serve(sock, &srvctx, buff, bufflen);
+  }
+  if (impair_active() != 0) {
+    impair_printstats(stderr);
+    fprintf(stderr, "answers re-sent from cache: %lu\n", srvctx.answcachehits);
   }
   /* remove the lock file and quit */
+  log_stop();
   unlockme(lockfile);
   return(0);
 }
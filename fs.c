@@ -5,10 +5,10 @@
  * Copyright (C) 2023-2025 E. Voirin (oerg866)
  */
 
-#include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/statvfs.h> /* statvfs() for diskfree calls */
 #include <sys/stat.h>    /* stat() */
@@ -22,13 +22,19 @@
 #if defined(__FreeBSD__) || defined(__APPLE__)
   #include <sys/mount.h> /* statfs() */
 #else
+  #include <linux/fiemap.h> /* struct fiemap */
+  #include <linux/fs.h>  /* FS_IOC_FIEMAP */
   #include <linux/msdos_fs.h>
   #include <sys/vfs.h>   /* struct statfs */
 #endif
 #include <sys/ioctl.h>
 #include <string.h>
+#if defined(__SSE2__)
+  #include <emmintrin.h>   /* SSE2 intrinsics */
+#endif
 
 #include "debug.h"
+#include "log.h"
 #include "fs.h" /* include self for control */
 
 /* macOS doesn't have all the FreeBSD file flags, define missing ones */
@@ -44,20 +50,63 @@
   #endif
 #endif
 
-/* database containing file/dir identifiers and their names - this is used
- * whenever ethersrv needs to provide etherdfs with a 16bit identifier that
- * etherdfs will subsequently use to refer to this file or dir (typically used
- * during FindFirst+FindNext steps and Open/Create+Write/Read.
- * the struct may also contain an entire directory listing computed by FFirst
- * (and used then by FNext) */
-static struct sfsdb {
+/* an item of the file database: a file or dir whose 16bit identifier was
+ * given to etherdfs, that will subsequently use it to refer to this file or
+ * dir (typically during FindFirst+FindNext steps and Open/Create+Write/Read).
+ * It may also hold an entire directory listing computed by FFirst (and used
+ * then by FNext) */
+struct sfsdb {
   char *name;
   time_t lastused;
   struct sdirlist { /* pointer to dir listing, if dir and if generated by FFirst */
     struct fileprops fprops;
+    char *name; /* host name of the entry (stored right after the node) */
+    int deleted; /* entry deleted since the listing was made (positions of
+                    the other entries must not change during a search) */
     struct sdirlist *next;
   } *dirlist;
-} fsdb[65536];
+  time_t listtime; /* when dirlist was generated */
+  struct sdirlist *cursor; /* last dirlist node returned by findfile() */
+  unsigned short cursorpos; /* position of cursor in dirlist (1-based) */
+  unsigned short hashnext; /* next item in the same hash chain, or 0xffff */
+  struct fsloc *loc; /* where the file data lies on disk, if read already */
+  int users; /* threads using the item right now (see holditem()) */
+};
+
+/* disk location of a file: its inode, and the extents (as reported by
+ * FIEMAP) around the last place it was read from. Extents are empty where
+ * FIEMAP is not available. */
+#define FSLOC_EXTENTS 8
+struct fsloc {
+  unsigned long long ino;
+  unsigned long long from, to; /* range of file offsets this tells about */
+  int count;   /* extents known, -1 = outdated by a write */
+  struct {
+    unsigned long long logical;  /* offset in the file */
+    unsigned long long physical; /* offset on the disk */
+    unsigned long long length;
+  } ext[FSLOC_EXTENTS];
+};
+
+/* size of the hash index of item names */
+#define FSDBHASHSZ 16384
+
+/* the file database of a server context */
+struct fsdb {
+  struct sfsdb item[65536];
+  /* hash index of item names, so items are found without scanning the
+   * whole database. Each bucket is the head of a chain linked through
+   * hashnext. */
+  unsigned short hash[FSDBHASHSZ];
+  time_t lastpurge;        /* the last time stale items were purged */
+  unsigned short nextfree; /* where the search for a free slot starts */
+  /* drives are served by separate threads. The table itself (slots, hash
+   * chains, purges) and the listings seen by fsdb_stats() are shared: this
+   * lock protects them. It is never held during a disk access. An item is
+   * only used by the thread of its drive, which holds it meanwhile (see
+   * holditem()) so no other thread recycles it. */
+  pthread_mutex_t lock;
+};
 
 /* frees a sdirlist linked list */
 static void freedirlist(struct sdirlist *d) {
@@ -68,52 +117,267 @@ static void freedirlist(struct sdirlist *d) {
   }
 }
 
-/* returns the "start sector" of a filesystem item (file or directory).
- * it registers the item into the file cache and returns its id or 0xffff on
- * error */
-unsigned short getitemss(char *f) {
-  unsigned short i, firstfree = 0xffffu, oldest = 0;
+/* FNV-1a hash of string f, reduced to a fsdb hash bucket */
+static unsigned short fsdbhashof(const char *f) {
+  unsigned long h = 2166136261ul;
+  for (; *f != 0; f++) {
+    h ^= (unsigned char)*f;
+    h = (h * 16777619ul) & 0xfffffffful;
+  }
+  return(h & (FSDBHASHSZ - 1));
+}
+
+/* removes entry i from db (and from its hash chain) */
+static void fsdbfree(struct fsdb *db, unsigned short i) {
+  unsigned short *link;
+  if (db->item[i].name != NULL) {
+    for (link = &(db->hash[fsdbhashof(db->item[i].name)]); *link != 0xffffu; link = &(db->item[*link].hashnext)) {
+      if (*link == i) {
+        *link = db->item[i].hashnext;
+        break;
+      }
+    }
+  }
+  free(db->item[i].name);
+  free(db->item[i].loc);
+  freedirlist(db->item[i].dirlist);
+  memset(&(db->item[i]), 0, sizeof(struct sfsdb));
+  db->item[i].hashnext = 0xffffu;
+}
+
+struct fsdb *fsdb_new(void) {
+  struct fsdb *db;
+  unsigned long i;
+  db = calloc(1, sizeof(struct fsdb));
+  if (db == NULL) return(NULL);
+  for (i = 0; i < FSDBHASHSZ; i++) db->hash[i] = 0xffffu;
+  for (i = 0; i < 65536; i++) db->item[i].hashnext = 0xffffu;
+  pthread_mutex_init(&(db->lock), NULL);
+  return(db);
+}
+
+void fsdb_free(struct fsdb *db) {
+  unsigned long i;
+  if (db == NULL) return;
+  for (i = 0; i < 65536; i++) {
+    free(db->item[i].name);
+    free(db->item[i].loc);
+    freedirlist(db->item[i].dirlist);
+  }
+  pthread_mutex_destroy(&(db->lock));
+  free(db);
+}
+
+/* returns the id of item f in db if it is known already, 0xffff otherwise */
+static unsigned short fsdbfind(struct fsdb *db, const char *f) {
+  unsigned short i;
+  for (i = db->hash[fsdbhashof(f)]; i != 0xffffu; i = db->item[i].hashnext) {
+    if (strcmp(db->item[i].name, f) == 0) return(i);
+  }
+  return(0xffffu);
+}
+
+/* same as fsdbfind(), but for a directory, that may be known with a trailing
+ * slash (root directories are) */
+static unsigned short fsdbfinddir(struct fsdb *db, const char *d) {
+  char tmp[HOSTPATH_MAX + 1];
+  unsigned short res = fsdbfind(db, d);
+  if ((res == 0xffffu) && (strlen(d) < HOSTPATH_MAX)) {
+    sprintf(tmp, "%s/", d);
+    res = fsdbfind(db, tmp);
+  }
+  return(res);
+}
+
+/* getitemss() body, called with db->lock held */
+static unsigned short getitemss_locked(struct fsdb *db, char *f) {
+  unsigned short i, firstfree = 0xffffu, oldest = 0, h;
   time_t now = time(NULL);
   /* see if not already in cache */
-  for (i = 0; i < 0xffffu; i++) {
-    /* is it what I am looking after? */
-    if ((fsdb[i].name != NULL) && (strcmp(fsdb[i].name, f) == 0)) {
-      fsdb[i].lastused = now;
-      return(i);
-    }
-    /* if the entry is not what I was looking for, check its last usage and remove if older than one hour */
-    if ((now - fsdb[i].lastused) > 3600) {
-      free(fsdb[i].name);
-      freedirlist(fsdb[i].dirlist);
-      memset(&(fsdb[i]), 0, sizeof(struct sfsdb));
+  i = fsdbfind(db, f);
+  if (i != 0xffffu) {
+    db->item[i].lastused = now;
+    return(i);
+  }
+  h = fsdbhashof(f);
+  /* once a minute, remove entries that have not been used for one hour */
+  if (now - db->lastpurge >= 60) {
+    for (i = 0; i < 0xffffu; i++) {
+      if ((db->item[i].name != NULL) && (db->item[i].users == 0) && ((now - db->item[i].lastused) > 3600)) fsdbfree(db, i);
     }
-    /* if slot free, remember it, perhaps we'll use it */
-    if ((firstfree == 0xffffu) && (fsdb[i].name == NULL)) {
-      firstfree = i;
-    } else if (fsdb[oldest].lastused > fsdb[i].lastused) { /* otherwise see if it's the oldest entry (I might remove it later if no choice) */
-      oldest = i;
+    db->lastpurge = now;
+  }
+  /* look for a free slot, starting where the last one was found */
+  for (i = 0; i < 0xffffu; i++) {
+    unsigned short slot = (db->nextfree + i) % 0xffffu;
+    if (db->item[slot].name == NULL) {
+      firstfree = slot;
+      break;
     }
   }
   /* not found - if no free slot available, pick the oldest one and replace it */
   if (firstfree == 0xffffu) {
+    for (i = 0; i < 0xffffu; i++) {
+      if (db->item[i].users != 0) continue;
+      if ((db->item[oldest].users != 0) || (db->item[oldest].lastused > db->item[i].lastused)) oldest = i;
+    }
+    if (db->item[oldest].users != 0) return(0xffffu); /* all of them in use */
     firstfree = oldest;
-    free(fsdb[oldest].name);
-    freedirlist(fsdb[oldest].dirlist);
-    memset(&(fsdb[oldest]), 0, sizeof(struct sfsdb));
+    fsdbfree(db, oldest);
   }
+  db->nextfree = (firstfree + 1) % 0xffffu;
   /* register it */
-  fsdb[firstfree].name = strdup(f);
+  db->item[firstfree].name = strdup(f);
 
-  if (fsdb[firstfree].name == NULL) {
-    fprintf(stderr, "ERROR: OUT OF MEM!\n");
+  if (db->item[firstfree].name == NULL) {
+    log_msg(LOG_ERR, "ERROR: OUT OF MEM!\n");
     return(0xffffu);
   }
-  fsdb[firstfree].lastused = now;
+  db->item[firstfree].lastused = now;
+  db->item[firstfree].hashnext = db->hash[h];
+  db->hash[h] = firstfree;
   return(firstfree);
 }
 
-char *sstoitem(unsigned short ss) {
-  return(fsdb[ss].name);
+/* returns the "start sector" of a filesystem item (file or directory).
+ * it registers the item into the file cache and returns its id or 0xffff on
+ * error */
+unsigned short getitemss(struct fsdb *db, char *f) {
+  unsigned short res;
+  pthread_mutex_lock(&(db->lock));
+  res = getitemss_locked(db, f);
+  pthread_mutex_unlock(&(db->lock));
+  return(res);
+}
+
+int holditem(struct fsdb *db, unsigned short ss, const char *root) {
+  size_t rootlen = strlen(root);
+  int res = -1;
+  char c;
+  pthread_mutex_lock(&(db->lock));
+  if ((ss != 0xffffu) && (db->item[ss].name != NULL) && (strncmp(db->item[ss].name, root, rootlen) == 0)) {
+    c = db->item[ss].name[rootlen];
+    if ((c == 0) || (c == '/') || ((rootlen > 0) && (root[rootlen - 1] == '/'))) {
+      db->item[ss].users++;
+      res = 0;
+    }
+  }
+  pthread_mutex_unlock(&(db->lock));
+  return(res);
+}
+
+void releaseitem(struct fsdb *db, unsigned short ss) {
+  pthread_mutex_lock(&(db->lock));
+  if (db->item[ss].users > 0) db->item[ss].users--;
+  pthread_mutex_unlock(&(db->lock));
+}
+
+/* copies the name of item ss into dst (HOSTPATH_MAX bytes), returns 0 on
+ * success or -1 if the item is unknown */
+static int fsdbname(struct fsdb *db, char *dst, unsigned short ss) {
+  int res = -1;
+  pthread_mutex_lock(&(db->lock));
+  if ((db->item[ss].name != NULL) && (strlen(db->item[ss].name) < HOSTPATH_MAX)) {
+    strcpy(dst, db->item[ss].name);
+    res = 0;
+  }
+  pthread_mutex_unlock(&(db->lock));
+  return(res);
+}
+
+/* returns 1 if loc tells where byte offset lies on disk, 0 otherwise */
+static int loccovers(const struct fsloc *loc, unsigned long offset) {
+  if ((loc == NULL) || (loc->count < 0)) return(0);
+  return((offset >= loc->from) && (offset < loc->to));
+}
+
+/* learns where the data of item ss, open as fd, lies on disk around offset,
+ * unless this is known already. Called by the thread serving the item. */
+static void learnlocation(struct fsdb *db, unsigned short ss, int fd, unsigned long offset) {
+  struct fsloc loc;
+  struct stat st;
+  int known;
+#ifdef FS_IOC_FIEMAP
+  unsigned long long buf[(sizeof(struct fiemap) + FSLOC_EXTENTS * sizeof(struct fiemap_extent)) / 8 + 1];
+  struct fiemap *fm = (struct fiemap *)buf;
+  unsigned int i;
+#endif
+  pthread_mutex_lock(&(db->lock));
+  known = loccovers(db->item[ss].loc, offset);
+  pthread_mutex_unlock(&(db->lock));
+  if (known != 0) return;
+  if (fstat(fd, &st) != 0) return;
+  memset(&loc, 0, sizeof(loc));
+  loc.ino = st.st_ino;
+  loc.to = ~0ull; /* the inode is all there is to know, unless... */
+#ifdef FS_IOC_FIEMAP
+  memset(buf, 0, sizeof(buf));
+  fm->fm_start = offset;
+  fm->fm_length = FIEMAP_MAX_OFFSET - offset;
+  fm->fm_extent_count = FSLOC_EXTENTS;
+  if (ioctl(fd, FS_IOC_FIEMAP, fm) == 0) {
+    for (i = 0; i < fm->fm_mapped_extents; i++) {
+      /* not allocated yet (delayed allocation), or not on a plain disk */
+      if (fm->fm_extents[i].fe_flags & FIEMAP_EXTENT_UNKNOWN) continue;
+      loc.ext[loc.count].logical = fm->fm_extents[i].fe_logical;
+      loc.ext[loc.count].physical = fm->fm_extents[i].fe_physical;
+      loc.ext[loc.count].length = fm->fm_extents[i].fe_length;
+      loc.count++;
+    }
+    /* more extents may follow the ones I got */
+    loc.from = offset;
+    if (fm->fm_mapped_extents == FSLOC_EXTENTS) {
+      loc.to = fm->fm_extents[FSLOC_EXTENTS - 1].fe_logical + fm->fm_extents[FSLOC_EXTENTS - 1].fe_length;
+    }
+  }
+#endif
+  pthread_mutex_lock(&(db->lock));
+  if ((db->item[ss].name != NULL) && (db->item[ss].loc == NULL)) db->item[ss].loc = malloc(sizeof(struct fsloc));
+  if ((db->item[ss].name != NULL) && (db->item[ss].loc != NULL)) memcpy(db->item[ss].loc, &loc, sizeof(loc));
+  pthread_mutex_unlock(&(db->lock));
+}
+
+unsigned long long fs_location(struct fsdb *db, unsigned short fss, unsigned long offset) {
+  unsigned long long res = 0;
+  const struct fsloc *loc;
+  int i, best = -1;
+  pthread_mutex_lock(&(db->lock));
+  loc = db->item[fss].loc;
+  if (loc != NULL) {
+    /* the extent that holds offset, or else the closest one before it: files
+     * tend to be contiguous beyond what I know */
+    for (i = 0; i < loc->count; i++) {
+      if (loc->ext[i].logical > offset) continue;
+      if ((best < 0) || (loc->ext[i].logical > loc->ext[best].logical)) best = i;
+    }
+    if (best >= 0) {
+      res = loc->ext[best].physical + (offset - loc->ext[best].logical);
+    } else {
+      res = (loc->ino << 32) | offset;
+    }
+  }
+  pthread_mutex_unlock(&(db->lock));
+  return(res);
+}
+
+/* reports how many items the file database holds, and how many directory
+ * entries are cached in their listings */
+void fsdb_stats(struct fsdb *db, unsigned long *items, unsigned long *dirents) {
+  unsigned long i;
+  struct sdirlist *d;
+  *items = 0;
+  *dirents = 0;
+  pthread_mutex_lock(&(db->lock));
+  for (i = 0; i < 65536; i++) {
+    if (db->item[i].name == NULL) continue;
+    (*items)++;
+    for (d = db->item[i].dirlist; d != NULL; d = d->next) (*dirents)++;
+  }
+  pthread_mutex_unlock(&(db->lock));
+}
+
+char *sstoitem(struct fsdb *db, unsigned short ss) {
+  return(db->item[ss].name);
 }
 
 /* turns a character c into its upper-case variant */
@@ -151,6 +415,7 @@ void filename2fcb(char *d, char *s) {
     while ((s[j]) == ' ') {
       j++;
     }
+    if (s[j] == 0) break; /* trailing spaces */
     d[i] = upchar(s[j]);
     j++;
   }
@@ -169,6 +434,62 @@ void filename2fcb(char *d, char *s) {
   }
 }
 
+/* same as filename2fcb(), but s must be readable for 16 bytes. Names of up
+ * to 15 characters that neither start with a dot nor contain spaces (that
+ * is, nearly all of them) are uppercased and split on their dot with SSE2,
+ * anything else goes through filename2fcb() */
+static void filename2fcb16(char *d, const char *s) {
+#if defined(__SSE2__)
+  __m128i v, lower;
+  unsigned int nul, before, dots, stop;
+  int dot, len;
+  char up[16];
+  v = _mm_loadu_si128((const __m128i *)s);
+  nul = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+  if ((nul != 0) && (s[0] != '.')) {
+    before = (nul & (0u - nul)) - 1; /* bytes before the terminator */
+    if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' '))) & before) == 0) {
+      dots = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('.'))) & before;
+      /* uppercase a..z (bytes above 127 are negative, thus left alone) */
+      lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+      _mm_storeu_si128((__m128i *)up, _mm_sub_epi8(v, _mm_and_si128(lower, _mm_set1_epi8(0x20))));
+      memset(d, ' ', 11);
+      len = __builtin_ctz(nul);
+      if (dots == 0) {
+        memcpy(d, up, (len > 8) ? 8 : len);
+        return;
+      }
+      dot = __builtin_ctz(dots);
+      memcpy(d, up, (dot > 8) ? 8 : dot);
+      /* extension runs up to the next dot or the end, 3 chars max */
+      stop = (dots | nul) & ~((2u << dot) - 1);
+      len = __builtin_ctz(stop) - (dot + 1);
+      memcpy(d + 8, up + dot + 1, (len > 3) ? 3 : len);
+      return;
+    }
+  }
+#endif
+  filename2fcb(d, (char *)s);
+}
+
+/* translates count filenames, stored every stride bytes in names, into
+ * consecutive 11-byte FCB blocks in d */
+void filenames2fcb(char *d, const char *names, int stride, int count) {
+  int i;
+  for (i = 0; i < count; i++) filename2fcb16(d + i * 11, names + i * stride);
+}
+
+/* time2dos() remembers the local midnight and the DOS date of the days it
+ * converted, so most timestamps are turned into DOS format without calling
+ * localtime_r(). Days during which the UTC offset changes are not cached.
+ * Each thread has its own cache, which holds 4096 days (11 years) so that
+ * the timestamps of a whole share usually fit. */
+#define DOSDAYCACHESZ 4096
+static __thread struct {
+  time_t start;          /* local midnight of the day */
+  unsigned long dosdate; /* DOS date bits of the day, 0 if slot is unused */
+} dosdaycache[DOSDAYCACHESZ];
+
 /* converts a time_t into a DWORD with DOS (FAT-style) timestamp bits
                24                16                 8                 0
 +-+-+-+-+-+-+-+-+ +-+-+-+-+-+-+-+-+ +-+-+-+-+-+-+-+-+ +-+-+-+-+-+-+-+-+
@@ -176,21 +497,45 @@ void filename2fcb(char *d, char *s) {
 +-+-+-+-+-+-+-+-+ +-+-+-+-+-+-+-+-+ +-+-+-+-+-+-+-+-+ +-+-+-+-+-+-+-+-+
  \___________/\________/\_________/ \________/\____________/\_________/
     year        month       day        hour       minute      seconds */
-static unsigned long time2dos(time_t t) {
+unsigned long time2dos(time_t t) {
   unsigned long res;
-  struct tm *ltime;
-  ltime = localtime(&t);
-  res = ltime->tm_year - 80; /* tm_year is years from 1900, while FAT needs years from 1980 */
+  struct tm ltime, ledge;
+  time_t start;
+  long secs;
+  int slot = (unsigned long)(t / 86400) % DOSDAYCACHESZ;
+  /* is the day already known? then only the time of day is to be computed */
+  start = dosdaycache[slot].start;
+  if ((dosdaycache[slot].dosdate != 0) && (t >= start) && (t - start < 86400)) {
+    secs = t - start;
+    res = dosdaycache[slot].dosdate;
+    res |= (unsigned long)(secs / 3600) << 11;
+    res |= (unsigned long)((secs / 60) % 60) << 5;
+    res |= (unsigned long)(secs % 60) >> 1;
+    return(res);
+  }
+  localtime_r(&t, &ltime);
+  res = ltime.tm_year - 80; /* tm_year is years from 1900, while FAT needs years from 1980 */
   res <<= 4;
-  res |= ltime->tm_mon + 1; /* tm_mon is in range 0..11 while FAT expects 1..12 */
+  res |= ltime.tm_mon + 1; /* tm_mon is in range 0..11 while FAT expects 1..12 */
   res <<= 5;
-  res |= ltime->tm_mday;
+  res |= ltime.tm_mday;
   res <<= 5;
-  res |= ltime->tm_hour;
+  res |= ltime.tm_hour;
   res <<= 6;
-  res |= ltime->tm_min;
+  res |= ltime.tm_min;
   res <<= 5;
-  res |= (ltime->tm_sec >> 1); /* DOS stores seconds divided by two */
+  res |= (ltime.tm_sec >> 1); /* DOS stores seconds divided by two */
+  /* remember the day, unless the UTC offset changes during it (DST): its
+   * first and last seconds must then be 00:00:00 and 23:59:59 */
+  if (ltime.tm_year < 80) return(res);
+  start = t - (ltime.tm_hour * 3600 + ltime.tm_min * 60 + ltime.tm_sec);
+  localtime_r(&start, &ledge);
+  if ((ledge.tm_mday != ltime.tm_mday) || (ledge.tm_hour != 0) || (ledge.tm_min != 0) || (ledge.tm_sec != 0)) return(res);
+  start += 86399;
+  localtime_r(&start, &ledge);
+  if ((ledge.tm_mday != ltime.tm_mday) || (ledge.tm_hour != 23) || (ledge.tm_min != 59) || (ledge.tm_sec != 59)) return(res);
+  dosdaycache[slot].start = start - 86399;
+  dosdaycache[slot].dosdate = res & 0xFFFF0000lu;
   return(res);
 }
 
@@ -206,10 +551,9 @@ static int matchfile2mask(char *msk, char *fil) {
 }
 
 
-/* provides DOS-like attributes for item i, as well as size, filling fprops
- * accordingly. returns item's attributes or 0xff on error.
- * DOS attr flags: 1=RO 2=HID 4=SYS 8=VOL 16=DIR 32=ARCH 64=DEVICE */
-unsigned char getitemattr(char *i, struct fileprops *fprops, unsigned char fatflag) {
+/* does the job of getitemattr(), fcb being the FCB name of item i if it is
+ * already known, or NULL */
+static unsigned char statitem(char *i, struct fileprops *fprops, unsigned char fatflag, const char *fcb) {
   uint32_t attr;
 #if !defined(__FreeBSD__) && !defined(__APPLE__)
   int fd;
@@ -227,7 +571,11 @@ unsigned char getitemattr(char *i, struct fileprops *fprops, unsigned char fatfl
     /* zero out struct and set timestamp & fcbname */
     memset(fprops, 0, sizeof(struct fileprops));
     fprops->ftime = time2dos(statbuf.st_mtime);
-    filename2fcb(fprops->fcbname, fname);
+    if (fcb != NULL) {
+      memcpy(fprops->fcbname, fcb, 11);
+    } else {
+      filename2fcb(fprops->fcbname, fname);
+    }
   }
   /* is this is a directory? */
   if (S_ISDIR(statbuf.st_mode)) {
@@ -255,7 +603,7 @@ unsigned char getitemattr(char *i, struct fileprops *fprops, unsigned char fatfl
   fd = open(i, O_RDONLY);
   if (fd == -1) return(0xff);
   if (ioctl(fd, FAT_IOCTL_GET_ATTRIBUTES, &attr) < 0) {
-    fprintf(stderr, "Failed to fetch attributes of '%s'\n", i);
+    log_msg(LOG_ERR, "Failed to fetch attributes of '%s'\n", i);
     close(fd);
     return(0);
   } else {
@@ -266,6 +614,13 @@ unsigned char getitemattr(char *i, struct fileprops *fprops, unsigned char fatfl
   }
 }
 
+/* provides DOS-like attributes for item i, as well as size, filling fprops
+ * accordingly. returns item's attributes or 0xff on error.
+ * DOS attr flags: 1=RO 2=HID 4=SYS 8=VOL 16=DIR 32=ARCH 64=DEVICE */
+unsigned char getitemattr(char *i, struct fileprops *fprops, unsigned char fatflag) {
+  return(statitem(i, fprops, fatflag, NULL));
+}
+
 /* set attributes fattr on file i. returns 0 on success, non-zero otherwise. */
 int setitemattr(char *i, unsigned char fattr) {
   int res;
@@ -291,67 +646,114 @@ int setitemattr(char *i, unsigned char fattr) {
   return(0);
 }
 
-/* generates a directory listing for *root and returns the number of file
- * system entries, or a negative value on error */
-static long gendirlist(struct sfsdb *root, unsigned char fatflag) {
+/* a chunk of directory entries read by readdirbatch(), with their FCB names */
+#define DIRBATCH 64
+struct dirbatch {
+  int count;
+  unsigned char type[DIRBATCH];  /* d_type of each entry */
+  char fcb[DIRBATCH][11];
+  char name[DIRBATCH][256];      /* large enough for 16-byte loads */
+};
+
+/* reads the next entries of directory dp into b (skipping "." and ".." if
+ * skipdots is set) and translates their names into FCB blocks in one batch.
+ * returns the number of entries read, 0 once the directory is exhausted. */
+static int readdirbatch(DIR *dp, struct dirbatch *b, int skipdots) {
+  struct dirent *entry;
+  b->count = 0;
+  while ((b->count < DIRBATCH) && ((entry = readdir(dp)) != NULL)) {
+    if ((skipdots != 0) && ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0))) continue;
+    strcpy(b->name[b->count], entry->d_name);
+    b->type[b->count] = entry->d_type;
+    b->count++;
+  }
+  filenames2fcb(b->fcb[0], b->name[0], sizeof(b->name[0]), b->count);
+  return(b->count);
+}
+
+/* (re)generates the listing of directory root and returns the number of
+ * file system entries, or a negative value on error. The new listing is
+ * built aside and swapped in at the end, so fsdb_stats() never sees it half
+ * made. */
+static long gendirlist(struct fsdb *db, struct sfsdb *root, unsigned char fatflag) {
   char fullpath[1024];
-  int fullpathoffset;
-  struct dirent *diridx;
+  int fullpathoffset, i;
+  struct dirbatch batch;
   DIR *dp;
-  struct sdirlist *lastnode = NULL, *newnode;
+  struct sdirlist *list = NULL, *lastnode = NULL, *newnode;
+  time_t listtime = time(NULL);
   long res = 0;
-  freedirlist(root->dirlist);
   dp = opendir(root->name);
-  if (dp == NULL) return(-1);
-  fullpathoffset = sprintf(fullpath, "%s/", root->name);
-  for (;;) {
-    diridx = readdir(dp);
-    if (diridx == NULL) break;
-    newnode = calloc(1, sizeof(struct sdirlist));
-    if (newnode == NULL) {
-      fprintf(stderr, "ERROR: out of mem!");
-      break;
-    }
-    sprintf(fullpath + fullpathoffset, "%s", diridx->d_name);
-    getitemattr(fullpath, &(newnode->fprops), fatflag);
-    /* add new node to linked list */
-    if (lastnode == NULL) {
-      root->dirlist = newnode;
-    } else {
-      lastnode->next = newnode;
+  fullpathoffset = (dp != NULL) ? sprintf(fullpath, "%s/", root->name) : 0;
+  while ((dp != NULL) && (readdirbatch(dp, &batch, 0) > 0)) {
+    for (i = 0; i < batch.count; i++) {
+      newnode = calloc(1, sizeof(struct sdirlist) + strlen(batch.name[i]) + 1);
+      if (newnode == NULL) {
+        log_msg(LOG_ERR, "ERROR: out of mem!");
+        break;
+      }
+      newnode->name = (char *)(newnode + 1);
+      strcpy(newnode->name, batch.name[i]);
+      sprintf(fullpath + fullpathoffset, "%s", batch.name[i]);
+      statitem(fullpath, &(newnode->fprops), fatflag, batch.fcb[i]);
+      /* add new node to linked list */
+      if (lastnode == NULL) {
+        list = newnode;
+      } else {
+        lastnode->next = newnode;
+      }
+      lastnode = newnode;
+      res++;
     }
-    lastnode = newnode;
-    res++;
   }
+  pthread_mutex_lock(&(db->lock));
+  lastnode = root->dirlist;
+  root->dirlist = list;
+  root->cursor = NULL;
+  root->listtime = listtime;
+  pthread_mutex_unlock(&(db->lock));
+  freedirlist(lastnode);
+  if (dp == NULL) return(-1);
   closedir(dp);
   return(res);
 }
 
 /* searches for file matching the FCB-style template fcbtmpl in directory dss (dss is the starting sector of the directory, as obtained via getitemss) with AT MOST attributes attr, fills 'out' with the nth match. returns 0 on success, non-zero otherwise. *nth is updated with the nth id of the file that matched */
-int findfile(struct fileprops *f, unsigned short dss, char *fcbtmpl, unsigned char attr, unsigned short *nth, int flags) {
+int findfile(struct fsdb *db, struct fileprops *f, unsigned short dss, char *fcbtmpl, unsigned char attr, unsigned short *nth, int flags) {
   int n = 0;
   struct sdirlist *dirlist;
+  /* mark the directory as used (it is held by the caller) */
+  pthread_mutex_lock(&(db->lock));
+  db->item[dss].lastused = time(NULL);
+  pthread_mutex_unlock(&(db->lock));
   /* recompute the dir listing if operation is FFirst (nth == 0) or if no
    * cache found */
-  if ((*nth == 0) || (fsdb[dss].dirlist == NULL)) {
-    long count = gendirlist(&(fsdb[dss]), flags & FFILE_ISFAT);
+  if ((*nth == 0) || (db->item[dss].dirlist == NULL)) {
+    long count = gendirlist(db, &(db->item[dss]), flags & FFILE_ISFAT);
     if (count < 0) {
-      fprintf(stderr, "Error: failed to scan dir '%s'\n", fsdb[dss].name);
+      log_msg(LOG_ERR, "Error: failed to scan dir '%s'\n", db->item[dss].name);
       return(-1);
 #ifdef DEBUG
     } else {
-      DBG("scanned dir '%s' and found %ld items\n", fsdb[dss].name, count);
-      for (dirlist = fsdb[dss].dirlist; dirlist != NULL; dirlist = dirlist->next) {
+      DBG("scanned dir '%s' and found %ld items\n", db->item[dss].name, count);
+      for (dirlist = db->item[dss].dirlist; dirlist != NULL; dirlist = dirlist->next) {
         DBG("  '%s' attr %02Xh (%ld bytes)\n", dirlist->fprops.fcbname, dirlist->fprops.fattr, dirlist->fprops.fsize);
       }
 #endif
     }
   }
-  /* */
-  for (dirlist = fsdb[dss].dirlist; dirlist != NULL; dirlist = dirlist->next) {
+  /* resume from where the previous search stopped if possible, instead of
+   * walking the whole list again (FindNext over huge directories) */
+  dirlist = db->item[dss].dirlist;
+  if ((db->item[dss].cursor != NULL) && (*nth >= db->item[dss].cursorpos)) {
+    dirlist = db->item[dss].cursor;
+    n = db->item[dss].cursorpos - 1;
+  }
+  for (; dirlist != NULL; dirlist = dirlist->next) {
     /* forward to where we need to start listing */
     n++;
     if (n <= *nth) continue;
+    if (dirlist->deleted != 0) continue;
     /* skip '.' and '..' items if directory is root */
     if ((dirlist->fprops.fcbname[0] == '.') && (flags & FFILE_ISROOT)) continue;
 
@@ -368,7 +770,9 @@ int findfile(struct fileprops *f, unsigned short dss, char *fcbtmpl, unsigned ch
   }
   if (dirlist != NULL) {
     *nth = n;
-    memcpy(f, &(dirlist->fprops), sizeof(struct sdirlist));
+    db->item[dss].cursor = dirlist;
+    db->item[dss].cursorpos = n;
+    memcpy(f, &(dirlist->fprops), sizeof(struct fileprops));
     return(0);
   }
   return(-1);
@@ -386,7 +790,7 @@ int createfile(struct fileprops *f, char *d, char *fn, unsigned char attr, unsig
   fclose(fd);
   /* set attribs (only if FAT drive) */
   if (fatflag != 0) {
-    if (setitemattr(fullpath, attr) != 0) fprintf(stderr, "Error: failed to set attribute %02Xh to '%s'\n", attr, fullpath);
+    if (setitemattr(fullpath, attr) != 0) log_msg(LOG_ERR, "Error: failed to set attribute %02Xh to '%s'\n", attr, fullpath);
   }
   /* collect and set attributes */
   getitemattr(fullpath, f, fatflag);
@@ -425,36 +829,33 @@ int changedir(char *d) {
 
 /* reads len bytes from file starting at sector fss, from offset, writes to
  * buff. returns amount of bytes read or a negative value on error. */
-long readfile(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len) {
+long readfile(struct fsdb *db, unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len) {
   long res;
-  char *fname;
-  FILE *fd;
-  fname = fsdb[fss].name;
-  if (fname == NULL) return(-1);
-  fd = fopen(fname, "rb");
-  if (fd == NULL) return(-1);
-  if (fseek(fd, offset, SEEK_SET) != 0) {
-    fclose(fd);
-    return(-1);
-  }
-  res = fread(buff, 1, len, fd);
-  fclose(fd);
+  char fname[HOSTPATH_MAX];
+  int fd;
+  if (fsdbname(db, fname, fss) != 0) return(-1);
+  /* read straight into buff, no stdio buffering so the data is copied only
+   * once (by the kernel) */
+  fd = open(fname, O_RDONLY);
+  if (fd == -1) return(-1);
+  learnlocation(db, fss, fd, offset);
+  res = pread(fd, buff, len, offset);
+  close(fd);
   return(res);
 }
 
 
 /* writes len bytes from buff to file starting at sect fss, starting at
  * offset. returns amount of bytes written or a negative value on error. */
-long writefile(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len) {
+long writefile(struct fsdb *db, unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len) {
   long res;
-  char *fname;
+  char fname[HOSTPATH_MAX];
   FILE *fd;
-  fname = fsdb[fss].name;
-  if (fname == NULL) return(-1);
+  if (fsdbname(db, fname, fss) != 0) return(-1);
   /* if len is 0, then it means "truncate" or "extend" ! */
   if (len == 0) {
     DBG("truncate '%s' to %lu bytes\n", fname, offset);
-    if (truncate(fname, offset) != 0) fprintf(stderr, "Error: truncate() failed\n");
+    if (truncate(fname, offset) != 0) log_msg(LOG_ERR, "Error: truncate() failed\n");
     return(0);
   }
   /* otherwise do a regular write */
@@ -468,60 +869,99 @@ long writefile(unsigned char *buff, unsigned short fss, unsigned long offset, un
   }
   res = fwrite(buff, 1, len, fd);
   fclose(fd);
+  /* the file may have got new blocks, learn them on the next read */
+  pthread_mutex_lock(&(db->lock));
+  if (db->item[fss].loc != NULL) db->item[fss].loc->count = -1;
+  pthread_mutex_unlock(&(db->lock));
   return(res);
 }
 
 
 /* remove all files matching the pattern, returns the number of removed files if any found,
  * or -1 on error or if no matching file found */
-int delfiles(char *pattern) {
+int delfiles(struct fsdb *db, char *pattern, unsigned char fatflag) {
   unsigned int i, fileoffset = 0;
-  int ispattern = 0;
-  char patterncopy[512];
-  char dirnamefcb[12];
+  int ispattern = 0, count = 0, dirfd;
+  char patterncopy[HOSTPATH_MAX], fullpath[HOSTPATH_MAX + 256];
   char *dir, *fil;
   char filfcb[12];
-  struct dirent *diridx;
-  DIR *dp;
+  unsigned short dss;
+  struct sdirlist *node;
+  struct stat statbuf;
+  unsigned char attr;
   /* scan the pattern for '?' characters, and find where the file part starts, also copy the pattern to patterncopy[] */
-  for (i = 0; pattern[i] != 0; i++) {
+  for (i = 0; (pattern[i] != 0) && (i < sizeof(patterncopy) - 1); i++) {
     if (pattern[i] == '?') ispattern = 1;
     if (pattern[i] == '/') fileoffset = i;
     patterncopy[i] = pattern[i];
   }
   patterncopy[i] = 0;
+  dir = patterncopy;
+  patterncopy[fileoffset] = 0;
+  fil = patterncopy + fileoffset + 1;
   /* if regular file, delete it right away*/
   if (ispattern == 0) {
     if (unlink(pattern) != 0) {
       DBG("Error: failure to delete file '%s' (%s)\n", pattern, strerror(errno));
       return(-1);
     }
+    /* forget it in the listing of its directory, if there is one */
+    pthread_mutex_lock(&(db->lock));
+    dss = fsdbfinddir(db, dir);
+    if (dss != 0xffffu) db->item[dss].users++;
+    pthread_mutex_unlock(&(db->lock));
+    if (dss != 0xffffu) {
+      for (node = db->item[dss].dirlist; node != NULL; node = node->next) {
+        if (strcmp(node->name, fil) == 0) node->deleted = 1;
+      }
+      releaseitem(db, dss);
+    }
     return(1);
   }
-  /* if pattern, get dir and fil parts and iterate over all directory */
-  dir = patterncopy;
-  patterncopy[fileoffset] = 0;
-  fil = patterncopy + fileoffset + 1;
+  /* if pattern, walk the listing of the directory. The one left by the last
+   * FindFirst is reused, unless the directory changed since (or during the
+   * second it was made, since mtimes are in seconds) */
   filename2fcb(filfcb, fil);
-  /* iterate over the directory and delete whatever is matching the pattern */
-  dp = opendir(dir);
-  if (dp == NULL) return(-1);
-  for (;;) {
-    diridx = readdir(dp);
-    if (diridx == NULL) break;
-    /* skip directories */
-    if (diridx->d_type == DT_DIR) continue;
-    /* if match, delete the file and continue */
-    filename2fcb(dirnamefcb, diridx->d_name);
-    if (matchfile2mask(filfcb, dirnamefcb) == 0) {
-      char fname[512];
-      sprintf(fname, "%s/%s", dir, diridx->d_name);
-      if (unlink(fname) != 0) fprintf(stderr, "failed to delete '%s'\n", fname);
+  pthread_mutex_lock(&(db->lock));
+  dss = fsdbfinddir(db, dir);
+  if (dss == 0xffffu) dss = getitemss_locked(db, dir);
+  if (dss != 0xffffu) db->item[dss].users++;
+  pthread_mutex_unlock(&(db->lock));
+  if (dss == 0xffffu) return(-1);
+  if ((db->item[dss].dirlist == NULL) || (stat(dir, &statbuf) != 0) || (statbuf.st_mtime >= db->item[dss].listtime)) {
+    if (gendirlist(db, &(db->item[dss]), fatflag) < 0) {
+      releaseitem(db, dss);
+      return(-1);
     }
   }
-  closedir(dp);
-
-  return(0);
+  dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (dirfd < 0) {
+    releaseitem(db, dss);
+    return(-1);
+  }
+  for (node = db->item[dss].dirlist; node != NULL; node = node->next) {
+    if (node->deleted != 0) continue;
+    if (node->fprops.fattr & (FAT_DIR | FAT_VOL)) continue;
+    if (matchfile2mask(filfcb, node->fprops.fcbname) != 0) continue;
+    /* skip directories, volumes and read-only files (as DOS does). The
+     * read-only bit may have changed since the listing was made (ATTRIB does
+     * not touch the directory mtime), so attributes are checked again. */
+    snprintf(fullpath, sizeof(fullpath), "%s/%s", dir, node->name);
+    attr = getitemattr(fullpath, NULL, fatflag);
+    if (attr == 0xff) continue; /* gone already */
+    node->fprops.fattr = attr;
+    if (attr & (FAT_DIR | FAT_VOL | FAT_RO)) continue;
+    /* delete the file relative to its directory, and update the listing */
+    if (unlinkat(dirfd, node->name, 0) != 0) {
+      log_msg(LOG_ERR, "failed to delete '%s/%s'\n", dir, node->name);
+      continue;
+    }
+    node->deleted = 1;
+    count++;
+  }
+  close(dirfd);
+  releaseitem(db, dss);
+  return((count > 0) ? count : -1);
 }
 
 /* rename fn1 into fn2 */
@@ -546,113 +986,98 @@ int isfat(char *d) {
 }
 
 /* returns the size of an open file (or -1 on error) */
-long getfopsize(unsigned short fss) {
+long getfopsize(struct fsdb *db, unsigned short fss) {
   struct fileprops fprops;
-  char *fname = fsdb[fss].name;
-  if (fname == NULL) return(-1);
+  char fname[HOSTPATH_MAX];
+  if (fsdbname(db, fname, fss) != 0) return(-1);
   if (getitemattr(fname, &fprops, 0) == 0xff) return(-1);
   return(fprops.fsize);
 }
 
 
-/**/
-int shorttolong(char *dst, char *src, const char *root) {
-  int found = 0;
-
-  char *writeptr = dst;
-  char *tmpdir = NULL;
-  char *tmpdir_next = NULL;
-  char to_find_fcb [12];
-  char tmp_fcb [12];
-
-  struct dirent *entry;
-  DIR *dir;
-
-  size_t root_len = strlen(root);
-
-  to_find_fcb[11] = 0;  /* null terminate these */
-  tmp_fcb[11] = 0;
-
-  assert(strncmp(root, src, strlen(root)) == 0);
-
-  src += root_len;
-  writeptr += sprintf(dst, "%s/", root);
-
-  printf("shorttolong: %s %s %s\n", dst, src, root);
-
-  if (src[0] != '/') {
-    DBG("ERROR: invalid string for shorttolong encountered: '%s'\n", src);
-    return -1;
+/* splits DOS path src of srclen bytes into p, in a single pass */
+int parsedospath(struct dospath *p, const char *src, int srclen) {
+  int i, len = 0, off = 0;
+  /* if drive present, skip it */
+  if ((srclen >= 2) && (src[1] == ':')) {
+    src += 2;
+    srclen -= 2;
   }
-
-  src++;
-
-  /* get the first token */
-  tmpdir = strtok(src, "/");
-   
-  /* walk through other tokens */
-  while (tmpdir != NULL) {
-    
-    tmpdir_next = strtok(NULL, "/");
-
-    /* Turn this back into an FCB string */
-    filename2fcb(to_find_fcb, tmpdir);
-
-    /* Walk the current directory depicted by destination */
-
-    dir = opendir(dst);
-
-    if (dir == NULL) {
-      DBG("ERROR: Failed to open directory %s", dst);
-      return -1;
+  p->count = 0;
+  for (i = 0;; i++) {
+    char c = 0;
+    if (i < srclen) c = src[i];
+    if ((c != '\\') && (c != '/') && (c != 0)) {
+      if (len >= DIR_MAX - 1) return(-1);
+      if ((c >= 'A') && (c <= 'Z')) c += ('a' - 'A');
+      p->buf[len++] = c;
+      continue;
     }
+    /* end of a component - skip empty ones, unless it is the last one */
+    if ((len == off) && (c != 0)) continue;
+    if ((p->count == DOSPATH_COMPMAX) || (len >= DIR_MAX - 1)) return(-1);
+    p->buf[len] = 0;
+    p->comp[p->count].off = off;
+    p->comp[p->count].len = len - off;
+    filename2fcb(p->comp[p->count].fcb, p->buf + off);
+    p->count++;
+    off = ++len;
+    if (c == 0) break;
+  }
+  return(0);
+}
 
-    found = 0;
-
-    while (!found && (entry = readdir(dir)) != NULL) {
-      if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0))
+/* looks in host directory dir for an item whose FCB form is fcb, and
+ * copies its name into name. returns 0 if found, non-zero otherwise. */
+static int findhostname(char *name, const char *dir, const char *fcb, int wantdir) {
+  struct dirbatch batch;
+  int i;
+  DIR *dp;
+  dp = opendir(dir);
+  if (dp == NULL) {
+    DBG("ERROR: Failed to open directory %s\n", dir);
+    return(-1);
+  }
+  while (readdirbatch(dp, &batch, 1) > 0) {
+    for (i = 0; i < batch.count; i++) {
+      if (memcmp(batch.fcb[i], fcb, 11) != 0) continue;
+      /* only directories are acceptable in the middle of a path */
+      if ((wantdir != 0) && (batch.type[i] != DT_DIR)) {
+        DBG("The name matched but isnt a directory.\n");
         continue;
-
-      /* get FCB name for this */
-      filename2fcb(tmp_fcb, entry->d_name);
-
-      /*if if its fcb name matches what we are trying to find, this may be our destination. */
-
-      if (strcmp(tmp_fcb, to_find_fcb) == 0) {
-        /*if we're not in the last section of the input path, this must be a directory*/
-
-        if ((tmpdir_next != NULL) && (entry->d_type != DT_DIR)) {
-          DBG("The name matched but isnt a directory.\n");
-          continue;
-        }
-
-        writeptr += sprintf(writeptr, "%s", entry->d_name);
-
-        /* it is a directory, so we must append a / to our destination */
-        if (tmpdir_next != NULL) {
-          writeptr += sprintf(writeptr, "/");
-        }
-
-        found = 1;
-
       }
-
+      strcpy(name, batch.name[i]);
+      closedir(dp);
+      return(0);
     }
+  }
+  closedir(dp);
+  return(-1);
+}
 
-    closedir(dir);
-
-    if (!found) {
-      /* Print the raw version as is to the destination string. Is useful for mkdir. */
-      writeptr += sprintf(writeptr, "%s", tmpdir);
-
+/* appends to host path dst the host names of components first..last-1 of p */
+int resolvepath(char *dst, int *dstlen, const struct dospath *p, int first, int last) {
+  char name[DIR_MAX];
+  int i, len = *dstlen, res = 0;
+  for (i = first; i < last; i++) {
+    int namelen;
+    if (p->comp[i].len == 0) continue;
+    /* once a component is missing, the rest of the path is appended as-is */
+    if ((res == 0) && (findhostname(name, dst, p->comp[i].fcb, i + 1 < p->count) != 0)) {
       DBG("Part of the path was not found - ergo it does not exist.\n");
-      return -1;
+      res = -1;
     }
-
-    tmpdir = tmpdir_next;
+    if (res != 0) strcpy(name, p->buf + p->comp[i].off);
+    namelen = strlen(name);
+    if (len + namelen + 2 > HOSTPATH_MAX) {
+      res = -1;
+      break;
+    }
+    if ((len == 0) || (dst[len - 1] != '/')) dst[len++] = '/';
+    memcpy(dst + len, name, namelen + 1);
+    len += namelen;
   }
-
-  DBG("shorttolong RESULT: %s\n", dst);
-
-  return 0;
+  *dstlen = len;
+  DBG("resolvepath RESULT: %s\n", dst);
+  return(res);
 }
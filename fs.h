@@ -5,6 +5,8 @@
 #ifndef FS_H_SENTINEL
 #define FS_H_SENTINEL
 
+#include <time.h>            /* time_t */
+
 struct fileprops {
   char fcbname[12];  /* FCB-style file name (FILE0001TXT) */
   unsigned long fsize;
@@ -27,11 +29,49 @@ struct fileprops {
 
 #define DIR_MAX 512
 
-/* returns the "start sector" of a filesystem item (file or directory).
- * returns 0xffff on error */
-unsigned short getitemss(char *f);
+/* longest host path built from a DOS path (host names may be long) */
+#define HOSTPATH_MAX 1024
+
+/* most components a DOS path may be made of (DOS paths are 64 chars) */
+#define DOSPATH_COMPMAX 32
+
+/* a DOS path split into its components, as parsed by parsedospath() */
+struct dospath {
+  char buf[DIR_MAX];  /* lower-cased components, each NUL-terminated */
+  int count;          /* number of components (at least 1) */
+  struct {
+    unsigned short off;  /* offset of the component in buf */
+    unsigned short len;  /* its length */
+    char fcb[11];        /* its FCB form ("FILE0001TXT") */
+  } comp[DOSPATH_COMPMAX];
+};
+
+/* the file database: the 16bit ids of files and directories given to
+ * clients, with the directory listings made for them. Each server context
+ * has its own, so ids of one never evict those of another. */
+struct fsdb;
+
+/* allocates an empty file database, returns NULL if out of memory */
+struct fsdb *fsdb_new(void);
+
+/* frees file database db and all it holds */
+void fsdb_free(struct fsdb *db);
+
+/* returns the "start sector" of a filesystem item (file or directory),
+ * registering it into db. returns 0xffff on error */
+unsigned short getitemss(struct fsdb *db, char *f);
 
-char *sstoitem(unsigned short ss);
+/* returns the host path of item ss. Only valid while the item is held. */
+char *sstoitem(struct fsdb *db, unsigned short ss);
+
+/* holds item ss (as obtained from a client) for the calling thread, so it
+ * is not recycled meanwhile, provided it lies under host directory root:
+ * ids of another drive are refused, as their items are used by the thread
+ * of that drive. returns 0 on success, non-zero otherwise. */
+int holditem(struct fsdb *db, unsigned short ss, const char *root);
+
+/* releases item ss held by holditem() */
+void releaseitem(struct fsdb *db, unsigned short ss);
 
 /* turns a character c into its upper-case variant */
 char upchar(char c);
@@ -39,6 +79,15 @@ char upchar(char c);
 /* translates a filename string into a fcb-style block ("FILE0001TXT") */
 void filename2fcb(char *d, char *s);
 
+/* translates count filenames, stored every stride bytes in names, into
+ * consecutive 11-byte FCB blocks in d. Each name must be readable for 16
+ * bytes (stride >= 16 does it), results are the same as filename2fcb() */
+void filenames2fcb(char *d, const char *names, int stride, int count);
+
+/* converts a time_t into a DWORD with DOS (FAT-style) timestamp bits, in
+ * local time. Dates are cached per day and per thread. */
+unsigned long time2dos(time_t t);
+
 /* provides DOS-like attributes for item i, as well as size, filling fprops
  * accordingly. returns item's attributes or 0xff on error.
  * DOS attr flags: 1=RO 2=HID 4=SYS 8=VOL 16=DIR 32=ARCH 64=DEVICE */
@@ -47,8 +96,8 @@ unsigned char getitemattr(char *i, struct fileprops *fprops, unsigned char isfat
 /* set attributes fattr on file i. returns 0 on success, non-zero otherwise. */
 int setitemattr(char *i, unsigned char fattr);
 
-/* searches for file matching template tmpl in directory dss (dss is the starting sector of the directory, as obtained via getitemss) with attribute attr, fills 'out' with the nth match. returns 0 on success, non-zero otherwise. */
-int findfile(struct fileprops *f, unsigned short dss, char *tmpl, unsigned char attr, unsigned short *fpos, int flags);
+/* searches for file matching template tmpl in directory dss (dss is the starting sector of the directory, as obtained via getitemss, and held) with attribute attr, fills 'out' with the nth match. returns 0 on success, non-zero otherwise. */
+int findfile(struct fsdb *db, struct fileprops *f, unsigned short dss, char *tmpl, unsigned char attr, unsigned short *fpos, int flags);
 
 /* creates or truncates a file f in directory d with attributes attr. returns 0 on success (and f filled), non-zero otherwise. */
 int createfile(struct fileprops *f, char *d, char *fn, unsigned char attr, unsigned char fatflag);
@@ -69,15 +118,16 @@ int changedir(char *d);
 
 /* reads len bytes from file fname starting offset, writes to buff. returns
  * amount of bytes read or a negative value on error. */
-long readfile(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len);
+long readfile(struct fsdb *db, unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len);
 
 /* writes len bytes from buff to file fname, starting at offset. returns
  * amount of bytes written or a negative value on error. */
-long writefile(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len);
+long writefile(struct fsdb *db, unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len);
 
 /* remove all files matching the pattern, returns the number of removed files if any found,
- * or -1 on error or if no matching file found */
-int delfiles(char *pattern);
+ * or -1 on error or if no matching file found. Patterns are matched against
+ * the cached listing of the directory, which is kept up to date. */
+int delfiles(struct fsdb *db, char *pattern, unsigned char fatflag);
 
 /* rename fn1 into fn2 */
 int renfile(char *fn1, char *fn2);
@@ -86,9 +136,28 @@ int renfile(char *fn1, char *fn2);
 int isfat(char *d);
 
 /* returns the size of an open file (or -1 on error) */
-long getfopsize(unsigned short fss);
-
-/* Converts a path full of lowercase 8.3 names to the host name, provided it exists */
-int shorttolong(char *dst, char *src, const char *root);
+long getfopsize(struct fsdb *db, unsigned short fss);
+
+/* returns where byte offset of file fss lies on disk, as a position that
+ * can be compared with those of other files of the same filesystem: the
+ * physical offset if the extents of the file are known, its inode and
+ * offset otherwise. Returns 0 if nothing is known yet (the file was not
+ * read from). */
+unsigned long long fs_location(struct fsdb *db, unsigned short fss, unsigned long offset);
+
+/* splits DOS path src of srclen bytes ("X:\DIR\FILE.TXT") into p in a single
+ * pass. Empty components are skipped, except the last one ("\DIR\" is made
+ * of "dir" and ""). returns 0 on success, non-zero if the path is too long. */
+int parsedospath(struct dospath *p, const char *src, int srclen);
+
+/* appends to the host path dst (currently *dstlen bytes long, at most
+ * HOSTPATH_MAX) the host names of components first..last-1 of p, looked up
+ * by their FCB form. returns 0 if all of them exist, non-zero otherwise, in
+ * which case the missing components are appended as they are. */
+int resolvepath(char *dst, int *dstlen, const struct dospath *p, int first, int last);
+
+/* reports how many items file database db holds, and how many directory
+ * entries are cached in their listings */
+void fsdb_stats(struct fsdb *db, unsigned long *items, unsigned long *dirents);
 
 #endif
@@ -0,0 +1,225 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * network impairment simulator: drops, duplicates, reorders, delays and
+ * rate-limits frames according to runtime rules, for testing only. All the
+ * randomness comes from a seeded PRNG so runs can be reproduced.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>      /* strtod(), strtoul() */
+#include <string.h>
+#include <time.h>        /* clock_gettime() */
+
+#include "proto.h"       /* FRAME_MAX */
+#include "impair.h" /* include self for control */
+
+#define RULESMAX 8
+#define HELDMAX 64   /* max amount of frames held back at any time */
+#define REORDERMS 20 /* max extra hold time of a reordered frame */
+
+static struct srule {
+  int dir;             /* IMPAIR_IN, IMPAIR_OUT or both */
+  int anymac;          /* non-zero if the rule applies to all clients */
+  unsigned char mac[6];
+  double loss, dup, reorder; /* probabilities (0..1) */
+  unsigned long delay; /* ms */
+  unsigned long rate;  /* bytes per second, 0 = unlimited */
+  unsigned long long nextfree; /* when the link is free again (rate limit), in us */
+} rules[RULESMAX];
+static int rulescount;
+
+static struct sheld {
+  unsigned long long due; /* us */
+  int dir;
+  int len;                /* 0 = slot free */
+  unsigned char frame[FRAME_MAX];
+} held[HELDMAX];
+
+static struct {
+  unsigned long frames, lost, duped, reordered, delayed, overflow;
+} stats[2];
+
+static unsigned long long prngstate = 1;
+
+/* xorshift64* - returns a pseudo-random value in range [0..1) */
+static double prng(void) {
+  prngstate ^= prngstate >> 12;
+  prngstate ^= prngstate << 25;
+  prngstate ^= prngstate >> 27;
+  return((double)((prngstate * 2685821657736338717ull) >> 11) / 9007199254740992.0);
+}
+
+/* monotonic clock, in microseconds */
+static unsigned long long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* parses a mac address in XX:XX:XX:XX:XX:XX notation, returns 0 on success */
+static int parsemac(unsigned char *mac, const char *s) {
+  unsigned int b[6];
+  int i;
+  if (sscanf(s, "%2x:%2x:%2x:%2x:%2x:%2x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6) return(-1);
+  for (i = 0; i < 6; i++) mac[i] = b[i];
+  return(0);
+}
+
+int impair_addrule(const char *spec) {
+  struct srule r;
+  char buf[256];
+  char *tok, *val;
+  if (rulescount >= RULESMAX) return(-1);
+  if (strlen(spec) >= sizeof(buf)) return(-1);
+  strcpy(buf, spec);
+  memset(&r, 0, sizeof(r));
+  r.dir = IMPAIR_IN | IMPAIR_OUT;
+  r.anymac = 1;
+  for (tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    val = strchr(tok, '=');
+    if (val == NULL) return(-1);
+    *val = 0;
+    val++;
+    if (strcmp(tok, "dir") == 0) {
+      if (strcmp(val, "in") == 0) {
+        r.dir = IMPAIR_IN;
+      } else if (strcmp(val, "out") == 0) {
+        r.dir = IMPAIR_OUT;
+      } else if (strcmp(val, "both") != 0) {
+        return(-1);
+      }
+    } else if (strcmp(tok, "mac") == 0) {
+      if (parsemac(r.mac, val) != 0) return(-1);
+      r.anymac = 0;
+    } else if (strcmp(tok, "loss") == 0) {
+      r.loss = strtod(val, NULL) / 100;
+    } else if (strcmp(tok, "dup") == 0) {
+      r.dup = strtod(val, NULL) / 100;
+    } else if (strcmp(tok, "reorder") == 0) {
+      r.reorder = strtod(val, NULL) / 100;
+    } else if (strcmp(tok, "delay") == 0) {
+      r.delay = strtoul(val, NULL, 10);
+    } else if (strcmp(tok, "rate") == 0) {
+      r.rate = strtoul(val, NULL, 10);
+    } else if (strcmp(tok, "seed") == 0) {
+      prngstate = strtoul(val, NULL, 10);
+      if (prngstate == 0) prngstate = 1; /* xorshift must not start at 0 */
+    } else {
+      return(-1);
+    }
+  }
+  /* a rule made only of a seed is not a rule */
+  if ((r.loss == 0) && (r.dup == 0) && (r.reorder == 0) && (r.delay == 0) && (r.rate == 0)) return(0);
+  rules[rulescount++] = r;
+  return(0);
+}
+
+int impair_active(void) {
+  return(rulescount);
+}
+
+/* queues a copy of frame to be released at time due, returns 0 on success */
+static int hold(int dir, const unsigned char *frame, int len, unsigned long long due) {
+  int i;
+  for (i = 0; i < HELDMAX; i++) {
+    if (held[i].len != 0) continue;
+    if (len > FRAME_MAX) len = FRAME_MAX;
+    held[i].due = due;
+    held[i].dir = dir;
+    held[i].len = len;
+    memcpy(held[i].frame, frame, len);
+    return(0);
+  }
+  return(-1);
+}
+
+int impair_frame(int dir, const unsigned char *frame, int len) {
+  struct srule *r = NULL;
+  const unsigned char *mac;
+  unsigned long long now, due;
+  int i, copies, res = 0;
+  /* the client is the source of incoming frames and the destination of
+   * outgoing ones */
+  mac = (dir == IMPAIR_IN) ? frame + 6 : frame;
+  for (i = 0; i < rulescount; i++) {
+    if ((rules[i].dir & dir) == 0) continue;
+    if ((rules[i].anymac == 0) && (memcmp(rules[i].mac, mac, 6) != 0)) continue;
+    r = &(rules[i]);
+    break;
+  }
+  if (r == NULL) return(1);
+  stats[dir - 1].frames++;
+  if (prng() < r->loss) {
+    stats[dir - 1].lost++;
+    return(0);
+  }
+  copies = 1;
+  if (prng() < r->dup) {
+    stats[dir - 1].duped++;
+    copies = 2;
+  }
+  now = now_us();
+  for (; copies > 0; copies--) {
+    due = now + r->delay * 1000;
+    /* bandwidth cap: the frame leaves once the link is done with the previous ones */
+    if (r->rate != 0) {
+      if (r->nextfree < now) r->nextfree = now;
+      due += r->nextfree - now;
+      r->nextfree += (unsigned long long)len * 1000000 / r->rate;
+    }
+    /* reordering: hold the frame a bit longer, so others overtake it */
+    if (prng() < r->reorder) {
+      stats[dir - 1].reordered++;
+      due += 1000 + (unsigned long long)(prng() * REORDERMS * 1000);
+    }
+    if (due <= now) {
+      res++;
+    } else if (hold(dir, frame, len, due) == 0) {
+      stats[dir - 1].delayed++;
+    } else {
+      stats[dir - 1].overflow++; /* nowhere to hold it: it's lost */
+    }
+  }
+  return(res);
+}
+
+long impair_nextdue(void) {
+  int i;
+  unsigned long long now, first = 0;
+  for (i = 0; i < HELDMAX; i++) {
+    if (held[i].len == 0) continue;
+    if ((first == 0) || (held[i].due < first)) first = held[i].due;
+  }
+  if (first == 0) return(-1);
+  now = now_us();
+  if (first <= now) return(0);
+  return((long)((first - now + 999) / 1000));
+}
+
+int impair_pop(int *dir, unsigned char *buf) {
+  int i, best = -1, len;
+  unsigned long long now = now_us();
+  /* release frames in order of due time */
+  for (i = 0; i < HELDMAX; i++) {
+    if ((held[i].len == 0) || (held[i].due > now)) continue;
+    if ((best < 0) || (held[i].due < held[best].due)) best = i;
+  }
+  if (best < 0) return(0);
+  *dir = held[best].dir;
+  len = held[best].len;
+  memcpy(buf, held[best].frame, len);
+  held[best].len = 0;
+  return(len);
+}
+
+void impair_printstats(FILE *fd) {
+  int i;
+  for (i = 0; i < 2; i++) {
+    fprintf(fd, "impair %s: %lu frames, %lu lost, %lu duplicated, %lu reordered, %lu delayed, %lu overflowed\n",
+            (i == 0) ? "in" : "out", stats[i].frames, stats[i].lost, stats[i].duped, stats[i].reordered, stats[i].delayed, stats[i].overflow);
+  }
+}
@@ -0,0 +1,40 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#ifndef IMPAIR_H_SENTINEL
+#define IMPAIR_H_SENTINEL
+
+#include <stdio.h>
+
+/* frame directions, as seen from ethersrv */
+#define IMPAIR_IN  1
+#define IMPAIR_OUT 2
+
+/* parses an impairment rule (see README.TXT for the syntax) and adds it to
+ * the list of active rules. returns 0 on success, non-zero otherwise. */
+int impair_addrule(const char *spec);
+
+/* returns non-zero if at least one impairment rule is active */
+int impair_active(void);
+
+/* submits frame (len bytes) travelling in direction dir to the impairment
+ * layer. Copies that must be held back are queued internally, the function
+ * returns how many copies (0, 1 or 2) shall be delivered right away. */
+int impair_frame(int dir, const unsigned char *frame, int len);
+
+/* returns the number of milliseconds until the next held frame is due, or
+ * -1 if no frame is held */
+long impair_nextdue(void);
+
+/* fetches the next held frame that is due into buf (FRAME_MAX bytes), sets
+ * *dir to its direction. returns its length, or 0 if no frame is due yet. */
+int impair_pop(int *dir, unsigned char *buf);
+
+/* prints impairment counters to fd */
+void impair_printstats(FILE *fd);
+
+#endif
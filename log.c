@@ -0,0 +1,212 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * asynchronous logger: threads that serve requests never wait for a
+ * terminal or syslog. They format messages into a lock-free ring, that a
+ * background thread drains. A misbehaving client that triggers the same
+ * error over and over only gets a few lines per second logged, the rest
+ * is counted and reported as suppressed.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>          /* pthread_sigmask() */
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>            /* time(), nanosleep() */
+
+#include "log.h" /* include self for control */
+
+/* ring size (power of 2), and longest message */
+#define LOG_RING 256
+#define LOG_MSGMAX 240
+
+/* how many messages of a kind may be logged per second */
+#define LOG_BURST 10
+
+/* how many kinds (distinct formats) are rate-limited separately. Beyond
+ * this, kinds share their limits. */
+#define LOG_KINDS 64
+
+/* how long the thread sleeps between two looks at the ring (ns) */
+#define LOG_NAP 50000000
+
+/* stack size of the thread, kept small as it may get locked in memory */
+#define LOG_STACK 262144
+
+/* slot of the ring. seq tells its state: equal to the position a producer
+ * may claim, or to that position + 1 once the message is complete. This is
+ * the bounded queue design of D. Vyukov. */
+static struct logslot {
+  unsigned long seq;
+  int prio;
+  char msg[LOG_MSGMAX];
+} ring[LOG_RING];
+static unsigned long head; /* next position to claim (producers) */
+static unsigned long tail; /* next position to write out (the thread) */
+
+static struct logkind {
+  const char *fmt;           /* NULL = unused */
+  unsigned long window;      /* second the count applies to */
+  unsigned long count;       /* messages logged in that second */
+  unsigned long suppressed;  /* not logged since the last report */
+} kinds[LOG_KINDS];
+
+static unsigned long lost; /* messages dropped, the ring being full */
+static int started, stopping, tosyslog;
+static pthread_t thread;
+
+/* writes out one message */
+static void emit(int prio, const char *msg) {
+  if (tosyslog != 0) {
+    syslog(prio, "%s", msg);
+  } else {
+    fprintf(stderr, "%s\n", msg);
+  }
+}
+
+/* returns the rate-limiting entry of messages of format fmt */
+static struct logkind *getkind(const char *fmt) {
+  unsigned long i, h = ((unsigned long)fmt >> 3) % LOG_KINDS;
+  const char *cur;
+  for (i = 0; i < LOG_KINDS; i++) {
+    struct logkind *k = &(kinds[(h + i) % LOG_KINDS]);
+    cur = __atomic_load_n(&(k->fmt), __ATOMIC_ACQUIRE);
+    if (cur == fmt) return(k);
+    if (cur != NULL) continue;
+    if (__atomic_compare_exchange_n(&(k->fmt), &cur, fmt, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return(k);
+    if (cur == fmt) return(k); /* another thread just took it for fmt */
+  }
+  return(&(kinds[h])); /* table full, share */
+}
+
+/* returns non-zero if a message of kind k may be logged now */
+static int allowed(struct logkind *k) {
+  unsigned long now = time(NULL), win;
+  win = __atomic_load_n(&(k->window), __ATOMIC_RELAXED);
+  if ((win != now) && __atomic_compare_exchange_n(&(k->window), &win, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&(k->count), 0, __ATOMIC_RELAXED);
+  }
+  if (__atomic_add_fetch(&(k->count), 1, __ATOMIC_RELAXED) <= LOG_BURST) return(1);
+  __atomic_add_fetch(&(k->suppressed), 1, __ATOMIC_RELAXED);
+  return(0);
+}
+
+void log_msg(int prio, const char *fmt, ...) {
+  va_list args;
+  struct logslot *s;
+  unsigned long pos, seq;
+  int len;
+  if (allowed(getkind(fmt)) == 0) return;
+  va_start(args, fmt);
+  if (__atomic_load_n(&started, __ATOMIC_ACQUIRE) == 0) {
+    /* no thread to hand it to yet, write it myself */
+    vfprintf(stderr, fmt, args);
+    if ((*fmt == 0) || (fmt[strlen(fmt) - 1] != '\n')) fputc('\n', stderr);
+    va_end(args);
+    return;
+  }
+  /* claim a slot */
+  pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  for (;;) {
+    s = &(ring[pos % LOG_RING]);
+    seq = __atomic_load_n(&(s->seq), __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n(&head, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if ((long)(seq - pos) < 0) { /* full */
+      __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+      va_end(args);
+      return;
+    } else {
+      pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    }
+  }
+  s->prio = prio;
+  vsnprintf(s->msg, LOG_MSGMAX, fmt, args);
+  va_end(args);
+  len = strlen(s->msg);
+  if ((len > 0) && (s->msg[len - 1] == '\n')) s->msg[len - 1] = 0;
+  __atomic_store_n(&(s->seq), pos + 1, __ATOMIC_RELEASE);
+}
+
+/* writes out the messages waiting in the ring, and the counts of those that
+ * were not logged. returns the number of messages written. */
+static int flush(void) {
+  struct logslot *s;
+  unsigned long n, now = time(NULL);
+  static unsigned long reported[LOG_KINDS]; /* second of the last report */
+  char msg[LOG_MSGMAX], *nl;
+  int i, res = 0;
+  for (;;) {
+    s = &(ring[tail % LOG_RING]);
+    if (__atomic_load_n(&(s->seq), __ATOMIC_ACQUIRE) != tail + 1) break;
+    emit(s->prio, s->msg);
+    __atomic_store_n(&(s->seq), tail + LOG_RING, __ATOMIC_RELEASE);
+    tail++;
+    res++;
+  }
+  /* report suppressed messages, at most once per second and kind */
+  for (i = 0; i < LOG_KINDS; i++) {
+    if (__atomic_load_n(&(kinds[i].suppressed), __ATOMIC_RELAXED) == 0) continue;
+    if ((stopping == 0) && (reported[i] == now)) continue;
+    reported[i] = now;
+    n = __atomic_exchange_n(&(kinds[i].suppressed), 0, __ATOMIC_RELAXED);
+    snprintf(msg, sizeof(msg), "%lu more messages suppressed: %.60s", n, kinds[i].fmt);
+    nl = strchr(msg, '\n');
+    if (nl != NULL) *nl = 0;
+    emit(LOG_WARNING, msg);
+  }
+  n = __atomic_exchange_n(&lost, 0, __ATOMIC_RELAXED);
+  if (n != 0) {
+    snprintf(msg, sizeof(msg), "%lu log messages lost (logger fell behind)", n);
+    emit(LOG_WARNING, msg);
+  }
+  return(res);
+}
+
+static void *logloop(void *arg) {
+  struct timespec nap;
+  (void)arg;
+  nap.tv_sec = 0;
+  nap.tv_nsec = LOG_NAP;
+  while (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE) == 0) {
+    if (flush() == 0) nanosleep(&nap, NULL);
+  }
+  flush();
+  return(NULL);
+}
+
+int log_start(int usesyslog) {
+  pthread_attr_t attr;
+  sigset_t all, prev;
+  int i, err;
+  for (i = 0; i < LOG_RING; i++) ring[i].seq = i;
+  tosyslog = usesyslog;
+  if (tosyslog != 0) openlog("ethersrv", LOG_PID, LOG_DAEMON);
+  /* signals are for the main thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &prev);
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, LOG_STACK);
+  err = pthread_create(&thread, &attr, logloop, NULL);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+  if (err != 0) {
+    errno = err;
+    return(-1);
+  }
+  __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+  return(0);
+}
+
+void log_stop(void) {
+  if (started == 0) return;
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+  __atomic_store_n(&started, 0, __ATOMIC_RELEASE);
+  if (tosyslog != 0) closelog();
+}
@@ -0,0 +1,27 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#ifndef LOG_H_SENTINEL
+#define LOG_H_SENTINEL
+
+#include <syslog.h>          /* LOG_ERR, LOG_WARNING, LOG_INFO */
+
+/* starts the thread that writes messages out: to syslog if usesyslog is
+ * non-zero, to stderr otherwise. Until then, messages are written right
+ * away to stderr. returns 0 on success, non-zero otherwise. */
+int log_start(int usesyslog);
+
+/* logs a message of priority prio (LOG_xxx) without waiting for it to be
+ * written out. Messages sharing the same fmt are rate-limited together:
+ * beyond a few per second they are only counted, and the count is logged
+ * later. A trailing newline in fmt is optional. */
+void log_msg(int prio, const char *fmt, ...);
+
+/* writes out all pending messages and stops the thread */
+void log_stop(void);
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * A minimal LZ4 block codec. LZ4 is byte-aligned and needs no tables to
+ * decode, so a DOS client on a 286 can decompress it with a short loop.
+ */
+
+#include <stdint.h>
+#include <string.h>  /* memcpy(), memset() */
+
+#include "lz.h" /* include self for control */
+
+#define LZ_MINMATCH 4
+#define LZ_MFLIMIT 12   /* last match must start at least 12 bytes before end */
+#define LZ_LASTLITERALS 5 /* last 5 bytes are always literals */
+#define LZ_HASHBITS 12
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t r;
+  memcpy(&r, p, 4);
+  return(r);
+}
+
+/* writes a LZ4 length extension (for lengths >= 15) at dst, returns the
+ * number of bytes written */
+static int putlen(unsigned char *dst, int l) {
+  int res = 0;
+  for (; l >= 255; l -= 255) dst[res++] = 255;
+  dst[res++] = l;
+  return(res);
+}
+
+/* writes one sequence (literals + optional match) into dst at op. returns the
+ * new op, or -1 if there was not enough room */
+static int putseq(unsigned char *dst, int op, int dstmax, const unsigned char *lit, int litlen, int offset, int mlen) {
+  unsigned char *token;
+  /* worst case: token + literal length + literals + offset + match length */
+  if (op + 1 + (litlen / 255 + 1) + litlen + 2 + (mlen / 255 + 1) > dstmax) return(-1);
+  token = dst + op++;
+  *token = ((litlen < 15) ? litlen : 15) << 4;
+  if (litlen >= 15) op += putlen(dst + op, litlen - 15);
+  memcpy(dst + op, lit, litlen);
+  op += litlen;
+  if (mlen == 0) return(op); /* last sequence has no match */
+  dst[op++] = offset & 0xff;
+  dst[op++] = offset >> 8;
+  mlen -= LZ_MINMATCH;
+  *token |= (mlen < 15) ? mlen : 15;
+  if (mlen >= 15) op += putlen(dst + op, mlen - 15);
+  return(op);
+}
+
+int lz_compress(unsigned char *dst, int dstmax, const unsigned char *src, int srclen) {
+  uint16_t htab[1 << LZ_HASHBITS];
+  int ip = 0, anchor = 0, op = 0;
+  int mflimit = srclen - LZ_MFLIMIT;
+  int matchlimit = srclen - LZ_LASTLITERALS;
+  if ((srclen < 0) || (srclen > 65535)) return(-1);
+  memset(htab, 0, sizeof(htab));
+  while (ip < mflimit) {
+    uint32_t seq = read32(src + ip);
+    unsigned h = (seq * 2654435761u) >> (32 - LZ_HASHBITS);
+    int ref = htab[h];
+    htab[h] = ip;
+    if ((ref < ip) && (read32(src + ref) == seq)) {
+      int mlen = LZ_MINMATCH;
+      while ((ip + mlen < matchlimit) && (src[ref + mlen] == src[ip + mlen])) mlen++;
+      op = putseq(dst, op, dstmax, src + anchor, ip - anchor, ip - ref, mlen);
+      if (op < 0) return(-1);
+      ip += mlen;
+      anchor = ip;
+    } else {
+      ip++;
+    }
+  }
+  /* flush remaining literals */
+  return(putseq(dst, op, dstmax, src + anchor, srclen - anchor, 0, 0));
+}
+
+int lz_decompress(unsigned char *dst, int dstmax, const unsigned char *src, int srclen) {
+  int ip = 0, op = 0;
+  while (ip < srclen) {
+    int token = src[ip++];
+    int litlen = token >> 4;
+    int mlen, offset;
+    if (litlen == 15) {
+      int b;
+      do {
+        if (ip >= srclen) return(-1);
+        b = src[ip++];
+        litlen += b;
+      } while (b == 255);
+    }
+    if ((ip + litlen > srclen) || (op + litlen > dstmax)) return(-1);
+    memcpy(dst + op, src + ip, litlen);
+    ip += litlen;
+    op += litlen;
+    if (ip == srclen) break; /* last sequence has no match */
+    if (ip + 2 > srclen) return(-1);
+    offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    if ((offset == 0) || (offset > op)) return(-1);
+    mlen = token & 15;
+    if (mlen == 15) {
+      int b;
+      do {
+        if (ip >= srclen) return(-1);
+        b = src[ip++];
+        mlen += b;
+      } while (b == 255);
+    }
+    mlen += LZ_MINMATCH;
+    if (op + mlen > dstmax) return(-1);
+    /* byte by byte, since source and destination may overlap */
+    for (; mlen > 0; mlen--) {
+      dst[op] = dst[op - offset];
+      op++;
+    }
+  }
+  return(op);
+}
@@ -0,0 +1,24 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#ifndef LZ_H_SENTINEL
+#define LZ_H_SENTINEL
+
+/* largest block (uncompressed) ethersrv is willing to decompress */
+#define LZ_MAXRAW 8192
+
+/* compresses srclen bytes of src into dst using the LZ4 block format, the
+ * result being at most dstmax bytes long. returns the compressed length, or
+ * -1 if the data does not fit (ie. is not compressible enough). */
+int lz_compress(unsigned char *dst, int dstmax, const unsigned char *src, int srclen);
+
+/* decompresses a LZ4 block of srclen bytes from src into dst, writing at most
+ * dstmax bytes. returns the decompressed length, or -1 if the block is
+ * malformed or does not fit. */
+int lz_decompress(unsigned char *dst, int dstmax, const unsigned char *src, int srclen);
+
+#endif
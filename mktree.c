@@ -0,0 +1,171 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * generates synthetic share trees of a controllable shape, so that the
+ * scaling of ethersrv can be measured on trees of 1k to 10M files (see
+ * "bench mix"). File contents are sparse: only sizes matter.
+ */
+
+#include <errno.h>
+#include <fcntl.h>           /* open() */
+#include <stdio.h>
+#include <stdlib.h>          /* atol() */
+#include <string.h>
+#include <sys/stat.h>        /* mkdir() */
+#include <unistd.h>          /* ftruncate(), getopt() */
+
+static struct {
+  int depth;           /* levels of subdirectories below the root */
+  int fanout;          /* subdirectories per directory */
+  long files;          /* files per directory */
+  int namelen;         /* length of file names, extension excluded */
+  int collide;         /* percentage of names sharing the FCB of the previous one */
+  unsigned long maxsize; /* largest file size */
+} shape = {2, 10, 100, 8, 0, 65536};
+
+static unsigned long long prngstate = 1;
+static unsigned long totalfiles, totaldirs;
+
+/* xorshift64 */
+static unsigned long prng(void) {
+  prngstate ^= prngstate << 13;
+  prngstate ^= prngstate >> 7;
+  prngstate ^= prngstate << 17;
+  return((unsigned long)(prngstate >> 16));
+}
+
+/* writes n in base 36 into s, zero-padded to width characters */
+static void base36(char *s, unsigned long n, int width) {
+  static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+  char tmp[16];
+  int len = 0;
+  do {
+    tmp[len++] = digits[n % 36];
+    n /= 36;
+  } while ((n != 0) && (len < 15));
+  while (width-- > len) *s++ = '0';
+  while (len > 0) *s++ = tmp[--len];
+  *s = 0;
+}
+
+/* returns a file size, sizes being spread evenly over orders of magnitude */
+static unsigned long filesize(void) {
+  unsigned long res;
+  int bits = 0;
+  while ((bits < 40) && ((1ul << bits) <= shape.maxsize)) bits++;
+  bits = prng() % (bits + 1);
+  if (bits == 0) return(0);
+  res = (1ul << (bits - 1)) + prng() % (1ul << (bits - 1));
+  return((res > shape.maxsize) ? shape.maxsize : res);
+}
+
+/* fills directory dir with files, then with subdirectories down to depth
+ * more levels. returns 0 on success, non-zero otherwise. */
+static int filldir(char *dir, int dirlen, int depth) {
+  static const char *exts[] = {"txt", "exe", "dat", "c", "com", ""};
+  const char *ext = "";
+  char prefix[16], tail[64];
+  long i;
+  int fd, tailen, width = (shape.namelen < 8) ? shape.namelen : 8;
+  totaldirs++;
+  for (i = 0; i < shape.files; i++) {
+    /* the first 8 characters of a long name make its FCB name. Colliding
+     * names keep those (and the extension) of the previous file, the rest
+     * of their name keeps them unique. */
+    tailen = shape.namelen - width;
+    if ((i == 0) || (tailen == 0) || ((int)(prng() % 100) >= shape.collide)) {
+      prefix[0] = 'f';
+      base36(prefix + 1, i, width - 1);
+      ext = exts[i % 6];
+    }
+    tail[0] = 0;
+    if (tailen > 0) base36(tail, i, tailen);
+    sprintf(dir + dirlen, "/%s%s%s%s", prefix, tail, (ext[0] != 0) ? "." : "", ext);
+    fd = open(dir, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "ERROR: failed to create '%s' (%s)\n", dir, strerror(errno));
+      return(-1);
+    }
+    if (ftruncate(fd, filesize()) != 0) {
+      fprintf(stderr, "ERROR: failed to size '%s' (%s)\n", dir, strerror(errno));
+      close(fd);
+      return(-1);
+    }
+    close(fd);
+    totalfiles++;
+  }
+  if (depth == 0) return(0);
+  for (i = 0; i < shape.fanout; i++) {
+    base36(prefix, i, 7);
+    sprintf(dir + dirlen, "/d%s", prefix);
+    if ((mkdir(dir, 0755) != 0) && (errno != EEXIST)) {
+      fprintf(stderr, "ERROR: failed to create '%s' (%s)\n", dir, strerror(errno));
+      return(-1);
+    }
+    if (filldir(dir, strlen(dir), depth - 1) != 0) return(-1);
+  }
+  return(0);
+}
+
+static void help(void) {
+  printf("usage: mktree [options] DIR\n"
+         "\n"
+         "Options:\n"
+         "  -d n   levels of subdirectories (default 2)\n"
+         "  -f n   subdirectories per directory (default 10)\n"
+         "  -n n   files per directory (default 100)\n"
+         "  -l n   length of file names, extension excluded (default 8)\n");
+  printf("  -c p   percentage of long names (-l above 8) sharing the FCB name of\n"
+         "         the previous file of their directory (default 0)\n"
+         "  -s n   largest file size, sizes are spread evenly over orders of\n"
+         "         magnitude (default 65536)\n"
+         "  -r n   seed of the random generator (default 1)\n");
+}
+
+int main(int argc, char **argv) {
+  char dir[1024];
+  int opt;
+  while ((opt = getopt(argc, argv, "d:f:n:l:c:s:r:h")) != -1) {
+    switch (opt) {
+      case 'd':
+        shape.depth = atoi(optarg);
+        break;
+      case 'f':
+        shape.fanout = atoi(optarg);
+        break;
+      case 'n':
+        shape.files = atol(optarg);
+        break;
+      case 'l':
+        shape.namelen = atoi(optarg);
+        break;
+      case 'c':
+        shape.collide = atoi(optarg);
+        break;
+      case 's':
+        shape.maxsize = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        prngstate = strtoull(optarg, NULL, 10) | 1;
+        break;
+      default:
+        help();
+        return(1);
+    }
+  }
+  if ((optind + 1 != argc) || (shape.namelen < 2) || (shape.namelen > 60) || (strlen(argv[optind]) > 512)) {
+    help();
+    return(1);
+  }
+  strcpy(dir, argv[optind]);
+  if ((mkdir(dir, 0755) != 0) && (errno != EEXIST)) {
+    fprintf(stderr, "ERROR: failed to create '%s' (%s)\n", dir, strerror(errno));
+    return(1);
+  }
+  if (filldir(dir, strlen(dir), shape.depth) != 0) return(1);
+  printf("%lu files in %lu directories\n", totalfiles, totaldirs);
+  return(0);
+}
@@ -0,0 +1,224 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * sampling profiler: while it runs, each thread is interrupted every
+ * millisecond of CPU time it uses, and the sample is counted against the
+ * stage of the pipeline and the query the thread works on. Samples are
+ * taken with perf_event_open() on Linux, one CPU clock event per thread,
+ * or with the ITIMER_PROF timer of the process elsewhere (or if perf events
+ * are not permitted), which the kernel delivers to whichever thread runs.
+ */
+
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+  #define _GNU_SOURCE        /* F_SETSIG, F_SETOWN_EX */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>        /* setitimer() */
+#include <unistd.h>
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+  #include <linux/perf_event.h>
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>   /* SYS_gettid, SYS_perf_event_open */
+#endif
+
+#include "proto.h"           /* dfs_opname() */
+#include "prof.h" /* include self for control */
+
+/* sampling period (us of CPU time) */
+#define PROF_PERIOD 1000
+
+/* how many threads may be sampled: the main one and a worker per drive */
+#define PROF_THREADS 27
+
+static const char *stagenames[PROF_STAGES] = {"poll", "receive", "schedule", "handle", "transmit", "notify", "report"};
+
+static struct profthread {
+  char name[16];
+  long tid;                    /* kernel thread id, for perf events */
+  int fd;                      /* perf event, or -1 */
+  unsigned long stage[PROF_STAGES]; /* samples per stage */
+  unsigned long query[256];    /* samples in PROF_HANDLE, per query */
+} threads[PROF_THREADS];
+static int threadcount;
+static pthread_mutex_t proflock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile sig_atomic_t active;
+static int useperf;
+
+/* what the current thread does, read by the signal handler */
+static __thread int myslot = -1;
+static __thread volatile sig_atomic_t mystage, myquery;
+
+/* SIGPROF handler: counts a sample for the thread it interrupted */
+static void sample(int sig, siginfo_t *si, void *ctx) {
+  int saved = errno;
+  (void)sig;
+  (void)ctx;
+  if ((active != 0) && (myslot >= 0)) {
+    threads[myslot].stage[mystage]++;
+    if (mystage == PROF_HANDLE) threads[myslot].query[myquery & 255]++;
+  }
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+  /* a perf event stops after each overflow, so it is not lost in the
+   * middle of a signal. Re-arm it. */
+  if ((useperf != 0) && (active != 0)) ioctl(si->si_fd, PERF_EVENT_IOC_REFRESH, 1);
+#else
+  (void)si;
+#endif
+  errno = saved;
+}
+
+void prof_thread(const char *name) {
+  sigset_t set;
+  pthread_mutex_lock(&proflock);
+  if (threadcount < PROF_THREADS) {
+    myslot = threadcount++;
+    snprintf(threads[myslot].name, sizeof(threads[myslot].name), "%s", name);
+    threads[myslot].fd = -1;
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+    threads[myslot].tid = syscall(SYS_gettid);
+#endif
+  }
+  pthread_mutex_unlock(&proflock);
+  /* worker threads block signals, but this one is theirs */
+  sigemptyset(&set);
+  sigaddset(&set, SIGPROF);
+  pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+}
+
+void prof_stage(int stage, int query) {
+  mystage = stage;
+  myquery = query;
+}
+
+int prof_active(void) {
+  return(active);
+}
+
+const char *prof_method(void) {
+  return(useperf ? "perf_event_open" : "setitimer");
+}
+
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+/* opens a CPU clock sampling event on thread t, that sends SIGPROF to it on
+ * each period. returns 0 on success, non-zero otherwise. */
+static int perfopen(struct profthread *t) {
+  struct perf_event_attr attr;
+  struct f_owner_ex owner;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = PERF_COUNT_SW_TASK_CLOCK;
+  attr.sample_period = PROF_PERIOD * 1000ull; /* ns */
+  attr.disabled = 1;
+  attr.exclude_hv = 1;
+  attr.wakeup_events = 1;
+  t->fd = syscall(SYS_perf_event_open, &attr, (pid_t)(t->tid), -1, -1, 0);
+  if (t->fd < 0) return(-1);
+  owner.type = F_OWNER_TID;
+  owner.pid = t->tid;
+  if ((fcntl(t->fd, F_SETFL, O_ASYNC | O_NONBLOCK) != 0) || (fcntl(t->fd, F_SETSIG, SIGPROF) != 0) || (fcntl(t->fd, F_SETOWN_EX, &owner) != 0)) {
+    close(t->fd);
+    t->fd = -1;
+    return(-1);
+  }
+  return(0);
+}
+#endif
+
+int prof_start(void) {
+  struct sigaction sa;
+  struct itimerval it;
+  int i;
+  if (active != 0) return(0);
+  pthread_mutex_lock(&proflock);
+  for (i = 0; i < threadcount; i++) {
+    memset(threads[i].stage, 0, sizeof(threads[i].stage));
+    memset(threads[i].query, 0, sizeof(threads[i].query));
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = sample;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+  useperf = 0;
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+  for (i = 0; i < threadcount; i++) {
+    if (perfopen(&(threads[i])) != 0) break;
+  }
+  if (i == threadcount) {
+    useperf = 1;
+  } else { /* perf events not permitted here, fall back to the timer */
+    while (i-- > 0) {
+      close(threads[i].fd);
+      threads[i].fd = -1;
+    }
+  }
+#endif
+  active = 1;
+  if (useperf != 0) {
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+    for (i = 0; i < threadcount; i++) ioctl(threads[i].fd, PERF_EVENT_IOC_REFRESH, 1);
+#endif
+  } else {
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = PROF_PERIOD;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_PROF, &it, NULL) != 0) active = 0;
+  }
+  pthread_mutex_unlock(&proflock);
+  return(active ? 0 : -1);
+}
+
+long prof_stop(const char *path) {
+  struct itimerval it;
+  FILE *fd;
+  long total = 0;
+  int i, s, q;
+  const char *name;
+  if (active == 0) return(-1);
+  active = 0;
+  pthread_mutex_lock(&proflock);
+  if (useperf == 0) {
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+  }
+  for (i = 0; i < threadcount; i++) {
+    if (threads[i].fd < 0) continue;
+    close(threads[i].fd);
+    threads[i].fd = -1;
+  }
+  fd = fopen(path, "w");
+  for (i = 0; (fd != NULL) && (i < threadcount); i++) {
+    for (s = 0; s < PROF_STAGES; s++) {
+      if (threads[i].stage[s] == 0) continue;
+      total += threads[i].stage[s];
+      if (s != PROF_HANDLE) {
+        fprintf(fd, "%s;%s %lu\n", threads[i].name, stagenames[s], threads[i].stage[s]);
+        continue;
+      }
+      for (q = 0; q < 256; q++) {
+        if (threads[i].query[q] == 0) continue;
+        name = dfs_opname(q);
+        if (name != NULL) {
+          fprintf(fd, "%s;%s;%s %lu\n", threads[i].name, stagenames[s], name, threads[i].query[q]);
+        } else {
+          fprintf(fd, "%s;%s;AL_%02X %lu\n", threads[i].name, stagenames[s], q, threads[i].query[q]);
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock(&proflock);
+  if (fd == NULL) return(-1);
+  if (fclose(fd) != 0) return(-1);
+  return(total);
+}
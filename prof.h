@@ -0,0 +1,44 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#ifndef PROF_H_SENTINEL
+#define PROF_H_SENTINEL
+
+/* pipeline stages samples are attributed to */
+#define PROF_POLL     0 /* waiting for frames, select() */
+#define PROF_RECEIVE  1 /* reading frames from the network */
+#define PROF_SCHEDULE 2 /* choosing the next request */
+#define PROF_HANDLE   3 /* processing a request (file system work) */
+#define PROF_TRANSMIT 4 /* sending answers */
+#define PROF_NOTIFY   5 /* tracking host file system changes */
+#define PROF_REPORT   6 /* printing statistics */
+#define PROF_STAGES   7
+
+/* registers the calling thread under name, so it gets sampled once the
+ * profiler runs */
+void prof_thread(const char *name);
+
+/* tells the profiler what the calling thread does from now on: stage
+ * PROF_xxx and, for PROF_HANDLE, the query (AL) being processed */
+void prof_stage(int stage, int query);
+
+/* returns non-zero if the profiler runs */
+int prof_active(void);
+
+/* starts sampling all registered threads. returns 0 on success, non-zero
+ * otherwise. */
+int prof_start(void);
+
+/* stops sampling and writes the samples to file path, as folded stacks
+ * (thread;stage;query count) that flame graph tools understand. returns the
+ * number of samples written, or -1 on error. */
+long prof_stop(const char *path);
+
+/* returns how samples are taken: "perf_event_open" or "setitimer" */
+const char *prof_method(void);
+
+#endif
@@ -0,0 +1,1290 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2017, 2018 Mateusz Viste
+ * Copyright (C) 2020 Michael Ortmann
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#include <arpa/inet.h>       /* htons() */
+#include <errno.h>
+#if defined(__FreeBSD__) || defined(__APPLE__)
+  #include <sys/types.h>
+  #include <sys/endian.h>
+#else
+  #include <endian.h>        /* le16toh(), le32toh() */
+#endif
+#include <limits.h>          /* PATH_MAX */
+#include <stdio.h>
+#include <stdint.h>          /* uint16_t, uint32_t */
+#include <stdlib.h>          /* realpath() */
+#include <string.h>
+#include <time.h>            /* time() */
+
+#include "cksum.h"
+#include "debug.h"
+#include "fs.h"
+#include "log.h"
+#include "lz.h"
+#include "watch.h"
+#include "proto.h" /* include self for control */
+
+/* kinds of checksum an answer may carry */
+#define CKS_NONE   0
+#define CKS_BSD    1
+#define CKS_CRC32C 2
+
+/* all the calls I support are in the range AL=0..2Eh - the list below serves
+ * as a convenience to compare AL (subfunction) values */
+enum AL_SUBFUNCTIONS {
+  AL_INSTALLCHK = 0x00,
+  AL_RMDIR      = 0x01,
+  AL_MKDIR      = 0x03,
+  AL_CHDIR      = 0x05,
+  AL_CLSFIL     = 0x06,
+  AL_CMMTFIL    = 0x07,
+  AL_READFIL    = 0x08,
+  AL_WRITEFIL   = 0x09,
+  AL_LOCKFIL    = 0x0A,
+  AL_UNLOCKFIL  = 0x0B,
+  AL_DISKSPACE  = 0x0C,
+  AL_SETATTR    = 0x0E,
+  AL_GETATTR    = 0x0F,
+  AL_RENAME     = 0x11,
+  AL_DELETE     = 0x13,
+  AL_OPEN       = 0x16,
+  AL_CREATE     = 0x17,
+  AL_FINDFIRST  = 0x1B,
+  AL_FINDNEXT   = 0x1C,
+  AL_SKFMEND    = 0x21,
+  AL_UNKNOWN_2D = 0x2D,
+  AL_SPOPNFIL   = 0x2E,
+  AL_UNKNOWN    = 0xFF
+};
+
+
+/* returns a printable version of a FCB block (ie. with added null terminator), this is used only by debug routines */
+#if DEBUG > 0
+static char *pfcb(char *s) {
+  static __thread char r[12] = "FILENAMEEXT";
+  memcpy(r, s, 11);
+  return(r);
+}
+#endif
+
+/* finds the cache entry related to given client, or NULL if the cache is
+ * full of clients with requests in progress. called with ctx->lock held. */
+static struct struct_answclient *findcacheentry(struct dfsctx *ctx, unsigned char *clientmac) {
+  struct struct_answclient *answcache = ctx->answcache;
+  int i, oldest = -1;
+  /* iterate through cache entries until matching mac is found */
+  for (i = 0; i < ANSWCACHESZ; i++) {
+    if (memcmp(answcache[i].mac, clientmac, 6) == 0) {
+      return(&(answcache[i])); /* found! */
+    }
+    /* is this the oldest entry? remember it. */
+    if (answcache[i].busy != 0) continue;
+    if ((oldest < 0) || (answcache[i].timestamp < answcache[oldest].timestamp)) oldest = i;
+  }
+  if (oldest < 0) return(NULL);
+  /* if nothing found, over-write the oldest entry */
+  memcpy(answcache[oldest].mac, clientmac, 6);
+  for (i = 0; i < ANSWWINDOW; i++) answcache[oldest].slot[i].len = 0;
+  return(&(answcache[oldest]));
+}
+
+/* returns the number of clients known to the answer cache */
+int dfs_clientcount(struct dfsctx *ctx) {
+  int i, res = 0;
+  struct struct_answclient *answcache = ctx->answcache;
+  pthread_mutex_lock(&(ctx->lock));
+  for (i = 0; i < ANSWCACHESZ; i++) {
+    if (answcache[i].timestamp != 0) res++;
+  }
+  pthread_mutex_unlock(&(ctx->lock));
+  return(res);
+}
+
+int dfs_iosize(const unsigned char *frame, int len) {
+  if (len < 60) return(0);
+  if ((frame[59] == AL_READFIL) && (len >= 68)) return(frame[66] | (frame[67] << 8));
+  if ((frame[59] == AL_WRITEFIL) && (len > 66)) return(len - 66);
+  return(0);
+}
+
+unsigned long long dfs_location(struct dfsctx *ctx, const unsigned char *frame, int len) {
+  unsigned long offset;
+  if (len < 66) return(0);
+  if ((frame[59] != AL_READFIL) && (frame[59] != AL_WRITEFIL)) return(0);
+  offset = frame[60] | (frame[61] << 8) | ((unsigned long)frame[62] << 16) | ((unsigned long)frame[63] << 24);
+  return(fs_location(ctx->fsdb, frame[64] | (frame[65] << 8), offset));
+}
+
+/* returns the answer slot that belongs to the request in frame */
+static struct struct_answcache *findcacheslot(struct struct_answclient *client, unsigned char *frame) {
+  if ((frame[58] >> 5) & RQF_WINDOW) return(&(client->slot[frame[57] % ANSWWINDOW]));
+  return(&(client->slot[0]));
+}
+
+
+/* checks whether dir is belonging to the root directory. returns 0 if so, 1
+ * otherwise */
+static int isroot(char *root, char *dir) {
+  /* fast-forward to the 'virtual directory' part */
+  while ((*root != 0) && (*dir != 0)) {
+    root++;
+    dir++;
+  }
+  /* skip any leading / */
+  while (*dir == '/') dir++;
+  /* is there any subsequent '/' ? if so, then it's not root */
+  while (*dir != 0) {
+    if (*dir == '/') return(0);
+    dir++;
+  }
+  /* otherwise it's root */
+  return(1);
+}
+
+
+/* resolves the first n components of DOS path p into host path dst (of
+ * HOSTPATH_MAX bytes), relative to root. returns 0 if they all exist. */
+static int hostpath(char *dst, const char *root, const struct dospath *p, int n) {
+  int len = strlen(root);
+  memcpy(dst, root, len);
+  dst[len++] = '/';
+  dst[len] = 0;
+  return(resolvepath(dst, &len, p, 0, n));
+}
+
+
+/* compute the checksum of l bytes starting at ptr, using either the BSD
+ * checksum or a folded CRC32C if the client asked for it (RQF_CRC32C) */
+static unsigned short framecksum(unsigned char *ptr, unsigned short l, int crcflag) {
+  if (crcflag != 0) return(crc32c16(ptr, l));
+  return(bsdsum(ptr, l));
+}
+
+/* returns the length of the directory part of DOS path p (up to and
+ * including its last backslash) */
+static int dosdirlen(char *p, int plen) {
+  int i, res = 0;
+  for (i = 0; i < plen; i++) {
+    if (p[i] == '\\') res = i + 1;
+  }
+  return(res);
+}
+
+/* writes a 24 bytes FindFirst/FindNext entry describing fprops into e */
+static void packdirentry(unsigned char *e, struct fileprops *fprops, unsigned short dirss, unsigned short fpos) {
+  e[0] = fprops->fattr; /* fattr (1=RO 2=HID 4=SYS 8=VOL 16=DIR 32=ARCH 64=DEVICE) */
+  memcpy(e + 1, fprops->fcbname, 11);
+  e[12] = fprops->ftime & 0xff;
+  e[13] = (fprops->ftime >> 8) & 0xff;
+  e[14] = (fprops->ftime >> 16) & 0xff;
+  e[15] = (fprops->ftime >> 24) & 0xff;
+  e[16] = fprops->fsize & 0xff;         /* fsize */
+  e[17] = (fprops->fsize >> 8) & 0xff;  /* fsize */
+  e[18] = (fprops->fsize >> 16) & 0xff; /* fsize */
+  e[19] = (fprops->fsize >> 24) & 0xff; /* fsize */
+  e[20] = dirss & 0xff; /* dir id */
+  e[21] = dirss >> 8;
+  e[22] = fpos & 0xff;  /* file position in dir */
+  e[23] = fpos >> 8;
+}
+
+
+/* a request being processed, as seen by opcode handlers */
+struct dfsreq {
+  struct dfsctx *ctx;
+  struct struct_answcache *answer; /* cache slot the answer is built in */
+  unsigned char *reqbuff;  /* request payload (past the 60 bytes header) */
+  int reqbufflen;          /* length of the request payload */
+  unsigned char *answ;     /* answer payload (past the 60 bytes header) */
+  unsigned short *ax;      /* where to store the value of AX */
+  char *root;              /* host directory of the requested drive */
+  unsigned char *clientmac;
+  int reqdrv;
+  int reqflags;            /* RQF_xxx */
+  int query;               /* AL */
+  int cksumkind;           /* kind of checksum requested (CKS_xxx) */
+};
+
+/* returns disk geometry and free space (AL=0Ch) */
+static int op_diskspace(struct dfsreq *rq) {
+  unsigned short *wansw = (uint16_t *)rq->answ;
+  unsigned short *ax = rq->ax;
+  char *root = rq->root;
+  unsigned long long diskspace, freespace;
+  int reslen = 0;
+  DBG("DISKSPACE for drive '%c:'\n", 'A' + rq->reqdrv);
+  diskspace = diskinfo(root, &freespace);
+  /* limit results to slightly under 2 GiB (otherwise MS-DOS is confused) */
+  if (diskspace >= 2lu*1024*1024*1024) diskspace = 2lu*1024*1024*1024 - 1;
+  if (freespace >= 2lu*1024*1024*1024) freespace = 2lu*1024*1024*1024 - 1;
+  DBG("TOTAL: %llu KiB ; FREE: %llu KiB\n", diskspace >> 10, freespace >> 10);
+  *ax = 1; /* AX: media id (8 bits) | sectors per cluster (8 bits) -- MSDOS tolerates only 1 here! */
+  wansw[1] = htole16(32768);  /* CX: bytes per sector */
+  diskspace >>= 15; /* space to number of 32K clusters */
+  freespace >>= 15; /* space to number of 32K clusters */
+  wansw[0] = htole16(diskspace); /* BX: total clusters */
+  wansw[2] = htole16(freespace); /* DX: available clusters */
+  reslen += 6;
+  return(reslen);
+}
+
+/* reads a chunk of an open file (AL=08h), fast path */
+static int op_readfil(struct dfsreq *rq) {
+  unsigned char *reqbuff = rq->reqbuff;
+  unsigned char *answ = rq->answ;
+  unsigned short *wreqbuff = (uint16_t *)rq->reqbuff;
+  unsigned short *wansw = (uint16_t *)rq->answ;
+  unsigned short *ax = rq->ax;
+  int reqflags = rq->reqflags;
+  struct struct_answcache *answer = rq->answer;
+  int cksumkind = rq->cksumkind;
+  uint16_t len, fileid;
+  uint32_t offset;
+  long readlen;
+  int reslen = 0;
+  offset = le32toh(((uint32_t *)reqbuff)[0]);
+  fileid = le16toh(wreqbuff[2]);
+  len = le16toh(wreqbuff[3]);
+  DBG("Asking for %u bytes of the file #%u, starting offset %u\n", len, fileid, offset);
+  /* the raw fallback of a compressed read must fit in the frame */
+  if (((reqflags & RQF_EXT) != 0) && (len > FRAME_MAX - 62)) {
+    log_msg(LOG_ERR, "ERROR: compressed read of %u bytes does not fit in a frame\n", len);
+    *ax = 5; /* "access denied" */
+    return(reslen);
+  }
+  if (holditem(rq->ctx->fsdb, fileid, rq->root) != 0) {
+    log_msg(LOG_ERR, "ERROR: invalid handle\n");
+    *ax = 6; /* "invalid handle" */
+    return(reslen);
+  }
+  if ((reqflags & RQF_EXT) == 0) {
+    if (len > FRAME_MAX - 60) len = FRAME_MAX - 60; /* what fits in a frame */
+    readlen = readfile(rq->ctx->fsdb, answ, fileid, offset, len);
+  } else { /* compressed read: LEN16 followed by LZ4 block (or raw data) */
+    static __thread unsigned char lzbuf[FRAME_MAX];
+    readlen = readfile(rq->ctx->fsdb, lzbuf, fileid, offset, len);
+    if (readlen >= 0) {
+      int complen = lz_compress(answ + 2, readlen - 1, lzbuf, readlen);
+      if (complen < 0) { /* not compressible, send it as-is */
+        memcpy(answ + 2, lzbuf, readlen);
+        complen = readlen;
+      }
+      DBG("compressed %ld bytes into %d\n", readlen, complen);
+      wansw[0] = htole16(readlen);
+      readlen = complen + 2;
+    }
+  }
+  releaseitem(rq->ctx->fsdb, fileid);
+  if (readlen < 0) {
+    log_msg(LOG_ERR, "ERROR: invalid handle\n");
+    *ax = 5; /* "access denied" */
+  } else {
+    reslen += readlen;
+    /* checksum the answer now, while its payload is still hot in the CPU
+     * cache, so it is not walked over a second time later */
+    if (cksumkind != CKS_NONE) {
+      answer->cksum = framecksum(answer->frame + 56, 4 + reslen, cksumkind == CKS_CRC32C);
+      answer->cksumkind = cksumkind;
+    }
+  }
+  return(reslen);
+}
+
+/* writes a chunk into an open file (AL=09h), fast path */
+static int op_writefil(struct dfsreq *rq) {
+  unsigned char *reqbuff = rq->reqbuff;
+  int reqbufflen = rq->reqbufflen;
+  unsigned short *wreqbuff = (uint16_t *)rq->reqbuff;
+  unsigned short *wansw = (uint16_t *)rq->answ;
+  unsigned short *ax = rq->ax;
+  int reqflags = rq->reqflags;
+  uint16_t fileid;
+  uint32_t offset;
+  long writelen;
+  unsigned char *data = reqbuff + 6;
+  int datalen = reqbufflen - 6;
+  int reslen = 0;
+  offset = le32toh(((uint32_t *)reqbuff)[0]);
+  fileid = le16toh(wreqbuff[2]);
+  /* compressed write: LEN16 followed by LZ4 block (or raw data) */
+  if (reqflags & RQF_EXT) {
+    static __thread unsigned char lzbuf[LZ_MAXRAW];
+    int rawlen = -1;
+    if (datalen >= 2) rawlen = le16toh(wreqbuff[3]);
+    if ((rawlen >= 0) && (rawlen == datalen - 2)) { /* stored as-is */
+      data += 2;
+      datalen = rawlen;
+    } else if ((rawlen >= 0) && (lz_decompress(lzbuf, LZ_MAXRAW, data + 2, datalen - 2) == rawlen)) {
+      data = lzbuf;
+      datalen = rawlen;
+    } else {
+      log_msg(LOG_ERR, "ERROR: malformed compressed write\n");
+      *ax = 0x0D; /* "invalid data" */
+      return(reslen);
+    }
+  }
+  DBG("Writing %u bytes into file #%u, starting offset %u\n", datalen, fileid, offset);
+  if (holditem(rq->ctx->fsdb, fileid, rq->root) != 0) {
+    log_msg(LOG_ERR, "ERROR: invalid handle\n");
+    *ax = 6; /* "invalid handle" */
+    return(reslen);
+  }
+  writelen = writefile(rq->ctx->fsdb, data, fileid, offset, datalen);
+  if (writelen < 0) {
+    log_msg(LOG_ERR, "ERROR: Access denied");
+    *ax = 5; /* "access denied" */
+  } else {
+    wansw[0] = htole16(writelen);
+    reslen += 2;
+    watch_touchitem(rq->ctx->watches, sstoitem(rq->ctx->fsdb, fileid));
+  }
+  releaseitem(rq->ctx->fsdb, fileid);
+  return(reslen);
+}
+
+/* locks or unlocks a region of a file (AL=0Ah / AL=0Bh) */
+static int op_lockfil(struct dfsreq *rq) {
+  (void)rq;
+  /* I do nothing, except lying that lock/unlock succeeded */
+  return(0);
+}
+
+/* starts a directory search (AL=1Bh) */
+static int op_findfirst(struct dfsreq *rq) {
+  unsigned char *reqbuff = rq->reqbuff;
+  int reqbufflen = rq->reqbufflen;
+  unsigned char *answ = rq->answ;
+  unsigned short *ax = rq->ax;
+  int reqdrv = rq->reqdrv;
+  int reqflags = rq->reqflags;
+  unsigned char *clientmac = rq->clientmac;
+  struct dfsctx *ctx = rq->ctx;
+  struct fileprops fprops;
+  struct dospath dp;
+  char host_directory[HOSTPATH_MAX];
+  char *filemaskfcb;
+  unsigned short dirss = 0xffffu;
+  unsigned fattr;
+  unsigned short fpos = 0;
+  int flags;
+  int reslen = 0;
+  fattr = reqbuff[0];
+  /* split the full "\DIR\FILE????.???" search path into directory and mask */
+  if (parsedospath(&dp, (char *)reqbuff + 1, reqbufflen - 1) != 0) {
+    *ax = 3; /* "path not found" */
+    return(0);
+  }
+  filemaskfcb = dp.comp[dp.count - 1].fcb;
+  flags = 0;
+  if (dp.count == 1) flags |= FFILE_ISROOT;
+  if (ctx->drivesfat[reqdrv] != 0) flags |= FFILE_ISFAT;
+
+  /* try to get the host name for this string */
+  if (hostpath(host_directory, rq->root, &dp, dp.count - 1) != 0) {
+    log_msg(LOG_ERR, "FINDFIRST Error (%s): Cannot obtain host path for directory.\n", host_directory);
+  } else {
+    dirss = getitemss(rq->ctx->fsdb, host_directory);
+    if (holditem(rq->ctx->fsdb, dirss, rq->root) != 0) dirss = 0xffffu;
+  }
+  DBG("FindFirst in '%s'\nfilemask: '%s' (FCB '%s')\nattribs: 0x%2X\n", host_directory, dp.buf + dp.comp[dp.count - 1].off, pfcb(filemaskfcb), fattr);
+
+  if ((dirss == 0xffffu) || (findfile(rq->ctx->fsdb, &fprops, dirss, filemaskfcb, fattr, &fpos, flags) != 0)) {
+    DBG("No matching file found\n");
+    *ax = 0x12; /* 0x12 is "no more files" -- one would assume 0x02 "file not found" would be better, but that's not what MS-DOS 5.x does, some applications rely on a failing FFirst to return 0x12 (for example LapLink 5) */
+  } else { /* found a file */
+    DBG("found file: FCB '%s' (attr %02Xh)\n", pfcb(fprops.fcbname), fprops.fattr);
+    packdirentry(answ, &fprops, dirss, fpos);
+    reslen = 24;
+  }
+  /* client wants to be told when this directory changes */
+  if ((reqflags & RQF_EXT) && (dirss != 0xffffu)) {
+    watch_add(rq->ctx->watches, clientmac, reqdrv, rq->cksumkind, (char *)reqbuff + 1, dosdirlen((char *)reqbuff + 1, reqbufflen - 1), host_directory);
+  }
+  if (dirss != 0xffffu) releaseitem(rq->ctx->fsdb, dirss);
+  return(reslen);
+}
+
+/* continues a directory search (AL=1Ch) */
+static int op_findnext(struct dfsreq *rq) {
+  unsigned char *reqbuff = rq->reqbuff;
+  unsigned char *answ = rq->answ;
+  unsigned short *wreqbuff = (uint16_t *)rq->reqbuff;
+  unsigned short *ax = rq->ax;
+  char *root = rq->root;
+  int reqdrv = rq->reqdrv;
+  int reqflags = rq->reqflags;
+  struct dfsctx *ctx = rq->ctx;
+  unsigned short fpos;
+  struct fileprops fprops;
+  char *fcbmask;
+  unsigned char fattr;
+  unsigned short dirss;
+  int flags;
+  int reslen = 0;
+  dirss = le16toh(wreqbuff[0]);
+  fpos = le16toh(wreqbuff[1]);
+  fattr = reqbuff[4];
+  fcbmask = (char *)reqbuff + 5;
+  /* */
+  DBG("FindNext looks for nth file %u in dir #%u\nfcbmask: '%s'\nattribs: 0x%2X\n", fpos, dirss, pfcb(fcbmask), fattr);
+  /* the dir id comes from the client, it may be stale or of another drive */
+  if (holditem(rq->ctx->fsdb, dirss, root) != 0) {
+    *ax = 0x12; /* "no more files" */
+    return(reslen);
+  }
+  flags = 0;
+  if (isroot(root, sstoitem(rq->ctx->fsdb, dirss)) != 0) flags |= FFILE_ISROOT;
+  if (ctx->drivesfat[reqdrv] != 0) flags |= FFILE_ISFAT;
+  if (findfile(rq->ctx->fsdb, &fprops, dirss, fcbmask, fattr, &fpos, flags)) {
+    DBG("No more matching files found\n");
+    *ax = 0x12; /* "no more files" */
+  } else { /* found a file */
+    DBG("found file: FCB '%s' (attr %02Xh)\n", pfcb(fprops.fcbname), fprops.fattr);
+    packdirentry(answ, &fprops, dirss, fpos);
+    reslen = 24;
+    /* batched FindNext: append as many subsequent matches as the frame can
+     * carry, each entry holds its own fpos so the client can resume from
+     * the last one */
+    if (reqflags & RQF_EXT) {
+      while (reslen + 24 <= FRAME_MAX - 60) {
+        if (findfile(rq->ctx->fsdb, &fprops, dirss, fcbmask, fattr, &fpos, flags) != 0) break;
+        DBG("found file: FCB '%s' (attr %02Xh)\n", pfcb(fprops.fcbname), fprops.fattr);
+        packdirentry(answ + reslen, &fprops, dirss, fpos);
+        reslen += 24;
+      }
+    }
+  }
+  releaseitem(rq->ctx->fsdb, dirss);
+  return(reslen);
+}
+
+/* creates or removes a directory (AL=03h / AL=01h) */
+static int op_mkrmdir(struct dfsreq *rq) {
+  unsigned short *ax = rq->ax;
+  int query = rq->query;
+  struct dospath dp;
+  char host_directory[HOSTPATH_MAX];
+  if (parsedospath(&dp, (char *)rq->reqbuff, rq->reqbufflen) != 0) {
+    *ax = 3; /* "path not found" */
+    return(0);
+  }
+
+  /* try to get the host name for this string - for MKDIR this is expected
+   * to fail, the missing part of the path being appended as-is */
+  if ((hostpath(host_directory, rq->root, &dp, dp.count) == 0) && (query == AL_MKDIR)) {
+    log_msg(LOG_ERR, "MKDIR Error (%s): A file exists that matches this name pattern.\n", host_directory);
+  }
+
+  if (query == AL_MKDIR) {
+    DBG("MKDIR '%s'\n", host_directory);
+    if (makedir(host_directory) != 0) {
+      *ax = 29;
+      log_msg(LOG_ERR, "MKDIR Error: %s\n", strerror(errno));
+    }
+  } else {
+    DBG("RMDIR '%s'\n", host_directory);
+    if (remdir(host_directory) != 0) {
+      *ax = 29;
+      log_msg(LOG_ERR, "RMDIR Error: %s\n", strerror(errno));
+    }
+  }
+  if (*ax == 0) watch_touchitem(rq->ctx->watches, host_directory);
+  return(0);
+}
+
+/* checks that a directory exists (AL=05h) */
+static int op_chdir(struct dfsreq *rq) {
+  unsigned short *ax = rq->ax;
+  struct dospath dp;
+  char host_directory[HOSTPATH_MAX];
+
+  /* try to get the host name for this string */
+  if ((parsedospath(&dp, (char *)rq->reqbuff, rq->reqbufflen) != 0) || (hostpath(host_directory, rq->root, &dp, dp.count) != 0)) {
+    log_msg(LOG_ERR, "CHDIR Error: Cannot obtain host path for directory.\n");
+    *ax = 3;
+  } else if (changedir(host_directory) != 0) {
+    log_msg(LOG_ERR, "CHDIR Error (%s): %s\n", host_directory, strerror(errno));
+    *ax = 3;
+  }
+  DBG("CHDIR '%s'\n", host_directory);
+  return(0);
+}
+
+/* closes a file (AL=06h) */
+static int op_clsfil(struct dfsreq *rq) {
+  unsigned short *ax = rq->ax;
+  /* I do nothing, since I do not keep any open files around anyway.
+   * just say 'ok' by sending back AX=0 */
+  DBG("CLOSE FILE\n");
+  *ax = 0;
+  return(0);
+}
+
+/* sets the attributes of a file (AL=0Eh) */
+static int op_setattr(struct dfsreq *rq) {
+  unsigned short *ax = rq->ax;
+  struct dospath dp;
+  char host_fullpathname[HOSTPATH_MAX];
+  unsigned char fattr;
+  fattr = rq->reqbuff[0];
+
+  /* try to get the host name for this string */
+  if ((parsedospath(&dp, (char *)rq->reqbuff + 1, rq->reqbufflen - 1) != 0) || (hostpath(host_fullpathname, rq->root, &dp, dp.count) != 0)) {
+    log_msg(LOG_ERR, "SETATTR Error: Cannot obtain host path for file.\n");
+    *ax = 2;
+  } else if (rq->ctx->drivesfat[rq->reqdrv] != 0) {
+    DBG("SETATTR [file: '%s', attr: 0x%02X]\n", host_fullpathname, fattr);
+    /* set attr, but only if drive is FAT */
+    if (setitemattr(host_fullpathname, fattr) != 0) {
+      *ax = 2;
+    } else {
+      watch_touchitem(rq->ctx->watches, host_fullpathname);
+    }
+  }
+  return(0);
+}
+
+/* returns the attributes, time and size of a file (AL=0Fh) */
+static int op_getattr(struct dfsreq *rq) {
+  unsigned char *reqbuff = rq->reqbuff;
+  int reqbufflen = rq->reqbufflen;
+  unsigned char *answ = rq->answ;
+  unsigned short *ax = rq->ax;
+  int reqdrv = rq->reqdrv;
+  int reqflags = rq->reqflags;
+  unsigned char *clientmac = rq->clientmac;
+  struct dfsctx *ctx = rq->ctx;
+  struct dospath dp;
+  char host_fullpathname[HOSTPATH_MAX];
+  struct fileprops fprops;
+  int reslen = 0;
+
+  /* try to get the host name for this string */
+  if ((parsedospath(&dp, (char *)reqbuff, reqbufflen) != 0) || (hostpath(host_fullpathname, rq->root, &dp, dp.count) != 0)) {
+    DBG("GETATTR: Cannot obtain host path for file.\n");
+    *ax = 2;
+  } else if (getitemattr(host_fullpathname, &fprops, ctx->drivesfat[reqdrv]) == 0xFF) {
+    DBG("no file found\n");
+    *ax = 2;
+  } else {
+    DBG("GETATTR on file: '%s' (fatflag=%d)\n", host_fullpathname, ctx->drivesfat[reqdrv]);
+    DBG("found it (%lu bytes, attr 0x%02X)\n", fprops.fsize, fprops.fattr);
+    answ[reslen++] = fprops.ftime & 0xff;
+    answ[reslen++] = (fprops.ftime >> 8) & 0xff;
+    answ[reslen++] = (fprops.ftime >> 16) & 0xff;
+    answ[reslen++] = (fprops.ftime >> 24) & 0xff;
+    answ[reslen++] = fprops.fsize & 0xff;
+    answ[reslen++] = (fprops.fsize >> 8) & 0xff;
+    answ[reslen++] = (fprops.fsize >> 16) & 0xff;
+    answ[reslen++] = (fprops.fsize >> 24) & 0xff;
+    answ[reslen++] = fprops.fattr;
+    /* client wants to be told when this file (or its directory) changes */
+    if (reqflags & RQF_EXT) {
+      watch_additem(rq->ctx->watches, clientmac, reqdrv, rq->cksumkind, (char *)reqbuff, dosdirlen((char *)reqbuff, reqbufflen), host_fullpathname);
+    }
+  }
+  return(reslen);
+}
+
+/* renames a file (AL=11h) */
+static int op_rename(struct dfsreq *rq) {
+  unsigned char *reqbuff = rq->reqbuff;
+  int reqbufflen = rq->reqbufflen;
+  unsigned short *ax = rq->ax;
+  /* query is LSSS...DDD... */
+  struct dospath dp1, dp2;
+  char host_fn1[HOSTPATH_MAX], host_fn2[HOSTPATH_MAX];
+  int fn1len;
+  fn1len = reqbuff[0];
+  if ((reqbufflen <= fn1len + 1) || (parsedospath(&dp1, (char *)reqbuff + 1, fn1len) != 0) || (parsedospath(&dp2, (char *)reqbuff + 1 + fn1len, reqbufflen - (1 + fn1len)) != 0)) {
+    *ax = 2;
+    return(0);
+  }
+
+  /* try to get the host name for this string */
+  if (hostpath(host_fn1, rq->root, &dp1, dp1.count) != 0) {
+    log_msg(LOG_ERR, "RENAME Error (%s): Cannot obtain host path for file.\n", host_fn1);
+    *ax = 2;
+  } else if (hostpath(host_fn2, rq->root, &dp2, dp2.count) == 0) {
+    /* if fn2 destination exists, abort with errcode=5 (as does MS-DOS 5) */
+    DBG("ERROR: '%s' exists already\n", host_fn2);
+    *ax = 5;
+  } else {
+    DBG("RENAME src='%s' dst='%s'\n", host_fn1, host_fn2);
+    if (renfile(host_fn1, host_fn2) != 0) {
+      *ax = 5;
+    } else {
+      watch_touchitem(rq->ctx->watches, host_fn1);
+      watch_touchitem(rq->ctx->watches, host_fn2);
+    }
+  }
+  return(0);
+}
+
+/* deletes one or more files (AL=13h) */
+static int op_delete(struct dfsreq *rq) {
+  unsigned short *ax = rq->ax;
+  struct dospath dp;
+  char host_fullpathname[HOSTPATH_MAX];
+  int len, res, ispattern;
+  if (parsedospath(&dp, (char *)rq->reqbuff, rq->reqbufflen) != 0) {
+    *ax = 3; /* "path not found" */
+    return(0);
+  }
+  /* resolve the directory, then the file itself - unless it is a pattern,
+   * in which case it is passed as-is to delfiles() */
+  ispattern = (memchr(dp.comp[dp.count - 1].fcb, '?', 11) != NULL);
+  res = hostpath(host_fullpathname, rq->root, &dp, dp.count - 1);
+  if (res == 0) {
+    len = strlen(host_fullpathname);
+    if (ispattern == 0) {
+      res = resolvepath(host_fullpathname, &len, &dp, dp.count - 1, dp.count);
+    } else {
+      sprintf(host_fullpathname + len, "%s%s", (host_fullpathname[len - 1] == '/') ? "" : "/", dp.buf + dp.comp[dp.count - 1].off);
+    }
+  }
+  DBG("DELETE '%s'\n", host_fullpathname);
+
+  if (res != 0) {
+    log_msg(LOG_ERR, "DELETE Error (%s): Cannot obtain host path for file.\n", host_fullpathname);
+    *ax = 2;
+  } else if ((ispattern == 0) && (getitemattr(host_fullpathname, NULL, rq->ctx->drivesfat[rq->reqdrv]) & 1)) { /* is it read-only? */
+    *ax = 5; /* "access denied" */
+  } else if (delfiles(rq->ctx->fsdb, host_fullpathname, rq->ctx->drivesfat[rq->reqdrv]) < 0) {
+    *ax = 2;
+  } else {
+    watch_touchitem(rq->ctx->watches, host_fullpathname);
+  }
+  return(0);
+}
+
+/* opens, creates or truncates a file (AL=16h / AL=17h / AL=2Eh) */
+static int op_open(struct dfsreq *rq) {
+  unsigned char *reqbuff = rq->reqbuff;
+  int reqbufflen = rq->reqbufflen;
+  unsigned char *answ = rq->answ;
+  unsigned short *wreqbuff = (uint16_t *)rq->reqbuff;
+  unsigned short *ax = rq->ax;
+  int reqdrv = rq->reqdrv;
+  int query = rq->query;
+  struct dfsctx *ctx = rq->ctx;
+  struct fileprops fprops;
+  struct dospath dp;
+  char host_directory[HOSTPATH_MAX];
+  char host_fullpathname[HOSTPATH_MAX];
+  char *fname;
+  int dirlen;
+  int fileres;
+  unsigned short stackattr, actioncode, spopen_openmode, spopres = 0;
+  unsigned char resopenmode;
+  int reslen = 0;
+  /* fetch args */
+  stackattr = le16toh(wreqbuff[0]);
+  actioncode = le16toh(wreqbuff[1]);
+  spopen_openmode = le16toh(wreqbuff[2]);
+  /* split the path into its directory and file components */
+  if (parsedospath(&dp, (char *)reqbuff + 6, reqbufflen - 6) != 0) {
+    *ax = 3; /* "path not found" */
+    return(0);
+  }
+
+  /* does the directory exist? */
+  if ((hostpath(host_directory, rq->root, &dp, dp.count - 1) != 0) || (changedir(host_directory) != 0)) {
+    DBG("open/create/spop failed because directory does not exist\n");
+    *ax = 3; /* "path not found" */
+  } else {
+    /* directory exists, look for the host version of the file name. If it
+     * does not exist, its lower-case DOS name is appended as-is */
+    dirlen = strlen(host_directory);
+    memcpy(host_fullpathname, host_directory, dirlen + 1);
+    resolvepath(host_fullpathname, &dirlen, &dp, dp.count - 1, dp.count);
+    fname = strrchr(host_fullpathname, '/') + 1;
+
+    DBG("stack word: %04X\n", stackattr);
+    DBG("looking for file '%s' (FCB '%s') in '%s'\n", fname, pfcb(dp.comp[dp.count - 1].fcb), host_directory);
+    /* open or create file, depending on exact subfunction */
+    if (query == AL_CREATE) {
+      DBG("CREATEFIL / stackattr (attribs)=%04Xh / fn='%s'\n", stackattr, host_fullpathname);
+      fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, ctx->drivesfat[reqdrv]);
+      resopenmode = 2; /* read/write */
+    } else if (query == AL_SPOPNFIL) {
+      /* actioncode contains instructions about how to behave...
+       *   high nibble = action if file does NOT exist:
+       *     0000 fail
+       *     0001 create
+       *   low nibble = action if file DOES exist
+       *     0000 fail
+       *     0001 open
+       *     0010 replace/open */
+      int attr;
+      DBG("SPOPNFIL / stackattr=%04Xh / action=%04Xh / openmode=%04Xh / fn='%s'\n", stackattr, actioncode, spopen_openmode, host_fullpathname);
+      /* see if file exists (and is a file) */
+      attr = getitemattr(host_fullpathname, &fprops, ctx->drivesfat[reqdrv]);
+      resopenmode = spopen_openmode & 0x7f; /* that's what PHANTOM.C does */
+      if (attr == 0xff) { /* file not found - look at high nibble of action code */
+        DBG("file doesn't exist -> ");
+        if ((actioncode & 0xf0) == 16) { /* create */
+          DBG("create file host_fullpathname='%s' fname='%s'\n", host_fullpathname, fname);
+          fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, ctx->drivesfat[reqdrv]);
+          if (fileres == 0) spopres = 2; /* spopres == 2 means 'file created' */
+        } else { /* fail */
+          DBG("fail\n");
+          fileres = 1;
+        }
+      } else if ((attr & (FAT_VOL | FAT_DIR)) != 0) { /* item is a DIR or a VOL */
+        DBG("fail: item '%s' is either a DIR or a VOL\n", host_fullpathname);
+        fileres = 1;
+      } else { /* file found (not a VOL, not a dir) - look at low nibble of action code */
+        DBG("file exists already (attr %02Xh) -> ", attr);
+        if ((actioncode & 0x0f) == 1) { /* open */
+          DBG("open file\n");
+          fileres = 0;
+          spopres = 1; /* spopres == 1 means 'file opened' */
+        } else if ((actioncode & 0x0f) == 2) { /* truncate */
+          DBG("truncate file host_fullpathname='%s' fname='%s'\n", host_fullpathname, fname);
+          fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, ctx->drivesfat[reqdrv]);
+          if (fileres == 0) spopres = 3; /* spopres == 3 means 'file truncated' */
+        } else { /* fail */
+          DBG("fail\n");
+          fileres = 1;
+        }
+      }
+    } else { /* simple 'OPEN' */
+      int attr;
+      DBG("OPENFIL / stackattr (open modes)=%04Xh / fn='%s'\n", stackattr, host_fullpathname);
+      resopenmode = stackattr & 0xff;
+      attr = getitemattr(host_fullpathname, &fprops, ctx->drivesfat[reqdrv]);
+      /* check that item exists, and is neither a volume nor a directory */
+      if ((attr != 0xff) && ((attr & (FAT_VOL | FAT_DIR)) == 0)) {
+        fileres = 0;
+      } else {
+        fileres = 1;
+      }
+    }
+    if (fileres != 0) {
+      DBG("open/create/spop failed with fileres = %d\n", fileres);
+      *ax = 2;
+    } else { /* success (found a file, created it or truncated it) */
+      unsigned short fileid;
+      fileid = getitemss(rq->ctx->fsdb, host_fullpathname);
+      DBG("found file: '%s' FCB '%s' (id %04X)\n", host_fullpathname, pfcb(fprops.fcbname), fileid);
+      DBG("     fsize: %lu\n", fprops.fsize);
+      DBG("     fattr: %02Xh\n", fprops.fattr);
+      DBG("     ftime: %04lX\n", fprops.ftime);
+      if (fileid == 0xffffu) {
+        log_msg(LOG_ERR, "ERROR: failed to get a proper fileid!\n");
+        return(-1);
+      }
+      /* a file has been created or truncated */
+      if ((query == AL_CREATE) || (spopres >= 2)) watch_touchdir(rq->ctx->watches, host_directory);
+      answ[reslen++] = fprops.fattr; /* fattr (1=RO 2=HID 4=SYS 8=VOL 16=DIR 32=ARCH 64=DEVICE) */
+      memcpy(answ + reslen, fprops.fcbname, 11);
+      reslen += 11;
+      answ[reslen++] = fprops.ftime & 0xff; /* time: YYYYYYYM MMMDDDDD hhhhhmmm mmmsssss */
+      answ[reslen++] = (fprops.ftime >> 8) & 0xff;
+      answ[reslen++] = (fprops.ftime >> 16) & 0xff;
+      answ[reslen++] = (fprops.ftime >> 24) & 0xff;
+      answ[reslen++] = fprops.fsize & 0xff;         /* fsize */
+      answ[reslen++] = (fprops.fsize >> 8) & 0xff;  /* fsize */
+      answ[reslen++] = (fprops.fsize >> 16) & 0xff; /* fsize */
+      answ[reslen++] = (fprops.fsize >> 24) & 0xff; /* fsize */
+      answ[reslen++] = fileid & 0xff;
+      answ[reslen++] = fileid >> 8;
+      /* CX result (only relevant for SPOPNFIL) */
+      answ[reslen++] = spopres & 0xff;
+      answ[reslen++] = spopres >> 8;
+      answ[reslen++] = resopenmode;
+    }
+  }
+  return(reslen);
+}
+
+/* translates a seek-from-end offset (AL=21h) */
+static int op_skfmend(struct dfsreq *rq) {
+  unsigned char *reqbuff = rq->reqbuff;
+  unsigned char *answ = rq->answ;
+  unsigned short *ax = rq->ax;
+  int reslen = 0;
+  /* translate a 'seek from end' offset into an 'seek from start' offset */
+  int32_t offs = le32toh(((uint32_t *)reqbuff)[0]);
+  long fsize;
+  unsigned short fss = le16toh(((unsigned short *)reqbuff)[2]);
+  DBG("SKFMEND on file #%u at offset %d\n", fss, offs);
+  /* if arg is positive, zero it out */
+  if (offs > 0) offs = 0;
+  /* */
+  if (holditem(rq->ctx->fsdb, fss, rq->root) != 0) {
+    *ax = 6; /* "invalid handle" */
+    return(reslen);
+  }
+  fsize = getfopsize(rq->ctx->fsdb, fss);
+  releaseitem(rq->ctx->fsdb, fss);
+  if (fsize < 0) {
+    DBG("ERROR: file not found or other error\n");
+    *ax = 2;
+  } else { /* compute new offset and send it back */
+    DBG("file #%u is %lu bytes long\n", fss, fsize);
+    offs += fsize;
+    if (offs < 0) offs = 0;
+    DBG("new offset: %d\n", offs);
+    ((uint32_t *)answ)[0] = htole32(offs);
+    reslen = 4;
+  }
+  return(reslen);
+}
+
+/* opcode handlers: each one fills the answer payload, sets AX and returns
+ * the payload length, or a negative value if the query must be ignored.
+ * READFIL and WRITEFIL are listed for the sake of statistics, but process()
+ * calls them directly, without a table lookup. */
+static const struct dfsop {
+  unsigned char query;
+  short minlen, maxlen; /* accepted payload lengths (-1 = no limit) */
+  int (*handler)(struct dfsreq *rq);
+  const char *name;
+} dfsops[] = {
+  {AL_RMDIR,     0, -1, op_mkrmdir,   "RMDIR"},
+  {AL_MKDIR,     0, -1, op_mkrmdir,   "MKDIR"},
+  {AL_CHDIR,     0, -1, op_chdir,     "CHDIR"},
+  {AL_CLSFIL,    0, -1, op_clsfil,    "CLSFIL"},
+  {AL_READFIL,   8,  8, op_readfil,   "READFIL"},
+  {AL_WRITEFIL,  6, -1, op_writefil,  "WRITEFIL"},
+  {AL_LOCKFIL,   0, -1, op_lockfil,   "LOCKFIL"},
+  {AL_UNLOCKFIL, 0, -1, op_lockfil,   "UNLOCKFIL"},
+  {AL_DISKSPACE, 0, -1, op_diskspace, "DISKSPACE"},
+  {AL_SETATTR,   2, -1, op_setattr,   "SETATTR"},
+  {AL_GETATTR,   1, -1, op_getattr,   "GETATTR"},
+  {AL_RENAME,    3, -1, op_rename,    "RENAME"},
+  {AL_DELETE,    0, -1, op_delete,    "DELETE"},
+  {AL_OPEN,      6, -1, op_open,      "OPEN"},
+  {AL_CREATE,    6, -1, op_open,      "CREATE"},
+  {AL_FINDFIRST, 0, -1, op_findfirst, "FINDFIRST"},
+  {AL_FINDNEXT,  0, -1, op_findnext,  "FINDNEXT"},
+  {AL_SKFMEND,   6,  6, op_skfmend,   "SKFMEND"},
+  {AL_SPOPNFIL,  6, -1, op_open,      "SPOPNFIL"},
+  {0, 0, 0, NULL, NULL}
+};
+
+/* handlers indexed by AL, filled from dfsops by dfs_init() */
+static const struct dfsop *optable[DFS_OPMAX];
+
+
+/* counts an answered query of AL query, with the resulting AX and answer
+ * payload length, and hands it to the embedder's hook. Handlers of
+ * different drives run concurrently, so the counters are atomic. */
+static void countop(struct dfsctx *ctx, int query, unsigned short ax, int reslen) {
+  __atomic_add_fetch(&(ctx->opstats[query].calls), 1, __ATOMIC_RELAXED);
+  /* DISKSPACE returns data in AX */
+  if ((ax != 0) && (query != AL_DISKSPACE)) __atomic_add_fetch(&(ctx->opstats[query].errors), 1, __ATOMIC_RELAXED);
+  if (ctx->ophook != NULL) ctx->ophook(ctx, query, ax, reslen);
+}
+
+
+/* answers a file read or write (AL=08h/09h) of a known drive: the bulk of
+ * the traffic. Only the header fields of the answer that these need are
+ * built, and only what op_readfil() and op_writefil() look at is set in
+ * the request descriptor. */
+static int fastio(struct dfsctx *ctx, struct struct_answcache *answer, unsigned char *reqbuff, int reqbufflen) {
+  struct dfsreq rq;
+  unsigned char *answ = answer->frame;
+  int reslen;
+  answer->cksumkind = CKS_NONE;
+  rq.cksumkind = CKS_NONE;
+  if (reqbuff[56] & 128) rq.cksumkind = (((reqbuff[58] >> 5) & RQF_CRC32C) != 0) ? CKS_CRC32C : CKS_BSD;
+  /* addresses, ethertype, version and seq - the padding is not looked at */
+  memcpy(answ, reqbuff + 6, 6);
+  memcpy(answ + 6, ctx->mymac, 6);
+  answ[12] = reqbuff[12];
+  answ[13] = reqbuff[13];
+  answ[56] = reqbuff[56];
+  answ[57] = reqbuff[57];
+  rq.ax = (uint16_t *)answ + 29;
+  *(rq.ax) = 0;
+  rq.ctx = ctx;
+  rq.answer = answer;
+  rq.reqbuff = reqbuff + 60;
+  rq.reqbufflen = reqbufflen - 60;
+  rq.answ = answ + 60;
+  rq.root = ctx->root[reqbuff[58] & 31];
+  rq.reqflags = reqbuff[58] >> 5;
+  if (reqbuff[59] == AL_READFIL) {
+    reslen = op_readfil(&rq);
+  } else {
+    reslen = op_writefil(&rq);
+  }
+  countop(ctx, reqbuff[59], *(rq.ax), reslen);
+  return(reslen + 60);
+}
+
+
+static int process(struct dfsctx *ctx, struct struct_answcache *answer, unsigned char *reqbuff, int reqbufflen) {
+  int query, reqdrv, reqflags, cksumkind;
+  int reslen = 0;
+  unsigned short *ax;     /* pointer to store the value of AX after the query */
+  unsigned char *answ;    /* convenience pointer to answer->frame */
+  char *root;
+  struct dfsreq rq;
+  const struct dfsop *op;
+  unsigned char *clientmac = reqbuff + 6;
+  answ = answer->frame;
+  /* must be at least 60 bytes long */
+  if (reqbufflen < 60) return(-1);
+  /* does it match the cache entry (same seq and same mac and len > 0)? if so, just re-send it again */
+  if ((answ[57] == reqbuff[57]) && (memcmp(answ, reqbuff + 6, 6) == 0) && (answer->len > 0)) {
+    DBG("Cache HIT (seq %u)\n", answ[57]);
+    __atomic_add_fetch(&(ctx->answcachehits), 1, __ATOMIC_RELAXED);
+    return(answer->len);
+  }
+
+  /* bulk file I/O is the hot path, it skips all the generic work below */
+  reqdrv = reqbuff[58] & 31;
+  if ((reqdrv >= 2) && (reqdrv <= 25) && (ctx->root[reqdrv] != NULL)) {
+    if ((reqbuff[59] == AL_READFIL) && (reqbufflen == 68)) return(fastio(ctx, answer, reqbuff, reqbufflen));
+    if ((reqbuff[59] == AL_WRITEFIL) && (reqbufflen >= 66)) return(fastio(ctx, answer, reqbuff, reqbufflen));
+  }
+
+  /* this is a new answer, any checksum computed for the previous one is void */
+  answer->cksumkind = CKS_NONE;
+  cksumkind = CKS_NONE;
+  if (reqbuff[56] & 128) cksumkind = (((reqbuff[58] >> 5) & RQF_CRC32C) != 0) ? CKS_CRC32C : CKS_BSD;
+
+  /* copy all headers as-is */
+  memcpy(answ, reqbuff, 60);
+
+  /* switch src and dst addresses so the reply header is ready */
+  memcpy(answ, answ + 6, 6);  /* copy source mac into dst field */
+  memcpy(answ + 6, ctx->mymac, 6); /* copy my mac into source field */
+  /* remember the pointer to the AX result, and fetch reqflags and AL query */
+  ax = (uint16_t *)answ + 29;
+  reqflags = reqbuff[58] >> 5; /* 3 highest bits -> flags */
+  query = reqbuff[59];
+  /* skip eth headers now, as well as padding, seq, reqdrv and AL */
+  reqbuff += 60;
+  answ += 60;
+  reqbufflen -= 60;
+  reslen = 0;
+
+  /* is the drive valid? (C: - Z:) */
+  if ((reqdrv < 2) || (reqdrv > 25)) { /* 0=A, 1=B, 2=C, etc */
+    log_msg(LOG_ERR, "invalid drive value: 0x%02Xh\n", reqdrv);
+    return(-3);
+  }
+  /* do I know this drive? */
+  root = ctx->root[reqdrv];
+  if (root == NULL) {
+    log_msg(LOG_ERR, "unknown drive: %c: (%02Xh)\n", 'A' + reqdrv, reqdrv);
+    return(-3);
+  }
+  /* assume success (hence AX == 0 most of the time) */
+  *ax = 0;
+  /* let's look at the exact query */
+  DBG("Got query: %02Xh [%02X %02X %02X %02X]\n", query, reqbuff[0], reqbuff[1], reqbuff[2], reqbuff[3]);
+  /* fill in the request descriptor for handlers */
+  rq.ctx = ctx;
+  rq.answer = answer;
+  rq.reqbuff = reqbuff;
+  rq.reqbufflen = reqbufflen;
+  rq.answ = answ;
+  rq.ax = ax;
+  rq.root = root;
+  rq.clientmac = clientmac;
+  rq.reqdrv = reqdrv;
+  rq.reqflags = reqflags;
+  rq.query = query;
+  rq.cksumkind = cksumkind;
+  if (query >= DFS_OPMAX) return(-1);
+  op = optable[query];
+  /* unknown query, or malformed - ignore */
+  if ((op == NULL) || (reqbufflen < op->minlen)) return(-1);
+  if ((op->maxlen >= 0) && (reqbufflen > op->maxlen)) return(-1);
+  if ((op->handler != op_lockfil) && (strlen(root) + reqbufflen + 2 > DIR_MAX)) {
+    /* paths are appended to root in DIR_MAX buffers, one that long is not
+     * a DOS path anyway */
+    *ax = 3; /* "path not found" */
+  } else {
+    reslen = op->handler(&rq);
+  }
+  if (reslen < 0) return(reslen);
+  countop(ctx, query, *ax, reslen);
+  return(reslen + 60);
+}
+
+
+/* used for debug output of frames on screen */
+#if DEBUG > 0
+static void dumpframe(unsigned char *frame, int len) {
+  int i, b;
+  int lines;
+  const int LINEWIDTH=16;
+  lines = (len + LINEWIDTH - 1) / LINEWIDTH; /* compute the number of lines */
+  /* display line by line */
+  for (i = 0; i < lines; i++) {
+    /* read the line and output hex data */
+    for (b = 0; b < LINEWIDTH; b++) {
+      int offset = (i * LINEWIDTH) + b;
+      if (b == LINEWIDTH / 2) printf(" ");
+      if (offset < len) {
+        printf(" %02X", frame[offset]);
+      } else {
+        printf("   ");
+      }
+    }
+    printf(" | "); /* delimiter between hex and ascii */
+    /* now output ascii data */
+    for (b = 0; b < LINEWIDTH; b++) {
+      int offset = (i * LINEWIDTH) + b;
+      if (b == LINEWIDTH / 2) printf(" ");
+      if (offset >= len) {
+        printf(" ");
+        continue;
+      }
+      if ((frame[offset] >= ' ') && (frame[offset] <= '~')) {
+        printf("%c", frame[offset]);
+      } else {
+        printf(".");
+      }
+    }
+    /* newline and loop */
+    printf("\n");
+  }
+}
+#endif
+
+/* generates a formatted MAC address printout and returns a static buffer */
+char *printmac(unsigned char *b) {
+  static __thread char macbuf[18];
+  sprintf(macbuf, "%02X:%02X:%02X:%02X:%02X:%02X", b[0], b[1], b[2], b[3], b[4], b[5]);
+  return(macbuf);
+}
+
+/* initializes server context ctx, answering as mac address mymac */
+int dfs_init(struct dfsctx *ctx, const unsigned char *mymac) {
+  int i;
+  memset(ctx, 0, sizeof(struct dfsctx));
+  ctx->fsdb = fsdb_new();
+  ctx->watches = watch_new();
+  if ((ctx->fsdb == NULL) || (ctx->watches == NULL)) {
+    fsdb_free(ctx->fsdb);
+    watch_free(ctx->watches);
+    return(-1);
+  }
+  pthread_mutex_init(&(ctx->lock), NULL);
+  memcpy(ctx->mymac, mymac, 6);
+  for (i = 0; dfsops[i].handler != NULL; i++) optable[dfsops[i].query] = &dfsops[i];
+  crc32c_init();
+  return(0);
+}
+
+/* releases everything server context ctx holds */
+void dfs_free(struct dfsctx *ctx) {
+  int i;
+  for (i = 0; i < 26; i++) free(ctx->root[i]);
+  fsdb_free(ctx->fsdb);
+  watch_free(ctx->watches);
+  pthread_mutex_destroy(&(ctx->lock));
+  memset(ctx, 0, sizeof(struct dfsctx));
+}
+
+/* maps host directory path to drive drv, returns 0 on success */
+int dfs_adddrive(struct dfsctx *ctx, int drv, const char *path) {
+  char tmppath[PATH_MAX];
+  if ((drv < 2) || (drv > 25)) return(-1);
+  if (realpath(path, tmppath) == NULL) return(-1);
+  ctx->root[drv] = strdup(tmppath);
+  if (ctx->root[drv] == NULL) return(-1);
+  ctx->drivesfat[drv] = (isfat(ctx->root[drv]) == 0) ? 1 : 0;
+  return(0);
+}
+
+/* validates and processes a frame received from a client, and prepares
+ * the answer to send back */
+int dfs_handleframe(struct dfsctx *ctx, unsigned char *buff, int len, unsigned char **answer) {
+  unsigned char cksumflag, crcflag;
+  unsigned short edf5framelen;
+  struct struct_answclient *clientptr;
+  struct struct_answcache *cacheptr = NULL;
+  /* copy of the answer, handed to the caller once the slot is released */
+  static __thread unsigned char answcopy[FRAME_MAX];
+  if (len < 60) return(-1);
+  /* is this ETHERTYPE_DFS? */
+  if (((unsigned short *)buff)[6] != htons(ETHERTYPE_DFS)) {
+    log_msg(LOG_ERR, "Error: Received non-ETHERTYPE_DFS frame\n");
+    return(-1);
+  }
+  /* validate protocol version matches what I expect */
+  if ((buff[56] & 127) != PROTOVER) {
+    log_msg(LOG_ERR, "Error: unsupported protocol version from %s\n", printmac(buff + 6));
+    return(-1);
+  }
+  cksumflag = buff[56] >> 7;
+  crcflag = (buff[58] >> 5) & RQF_CRC32C;
+  /* trim of padding, if any, or reject frame if it came truncated */
+  edf5framelen = le16toh(((unsigned short *)buff)[26]);
+  if (edf5framelen == 0) {
+    /* nothing to do, edf5framelen is not provided */
+  } else if (edf5framelen > len) { /* frame seems truncated */
+    log_msg(LOG_ERR, "Error: received a truncated frame from %s\n", printmac(buff + 6));
+    return(-1);
+  } else if (edf5framelen < 60) { /* obvious error */
+    log_msg(LOG_ERR, "Error: received a malformed frame from %s\n", printmac(buff + 6));
+    return(-1);
+  } else { /* edf5framelen seems sane, use it instead of the Ethernet length */
+    #if DEBUG > 0
+      if (len != edf5framelen) {
+        DBG("Note: Received frame with padding from %s (edf5len = %u, ethernet len = %u)\n", printmac(buff + 6), edf5framelen, len);
+      }
+    #endif
+    len = edf5framelen;
+  }
+  /* */
+#if DEBUG > 0
+  DBG("Received frame of %d bytes (cksum = %s)\n", len, (cksumflag != 0)?"ENABLED":"DISABLED");
+  dumpframe(buff, len);
+#endif
+  /* validate the CKSUM, if any */
+  if (cksumflag != 0) {
+    unsigned short cksum_remote, cksum_mine;
+    cksum_mine = framecksum(buff + 56, len - 56, crcflag);
+    cksum_remote = le16toh(((unsigned short *)buff)[27]);
+    if (cksum_mine != cksum_remote) {
+      log_msg(LOG_WARNING, "CHECKSUM MISMATCH! Computed: 0x%02Xh Received: 0x%02Xh\n", cksum_mine, cksum_remote);
+      return(-1);
+    }
+  }
+  /* */
+  pthread_mutex_lock(&(ctx->lock));
+  clientptr = findcacheentry(ctx, buff + 6);
+  if (clientptr != NULL) {
+    /* a slot holds one request at a time. A client that gave up on a
+     * request to a slow drive may send its next one to another drive while
+     * the first is still being processed into the same slot. */
+    cacheptr = findcacheslot(clientptr, buff);
+    if (cacheptr->busy == 0) {
+      cacheptr->busy = 1;
+      clientptr->busy++;
+    } else {
+      cacheptr = NULL;
+    }
+  }
+  pthread_mutex_unlock(&(ctx->lock));
+  if (clientptr == NULL) {
+    DBG("answer cache full of busy clients, query dropped\n");
+    return(-1);
+  }
+  if (cacheptr == NULL) {
+    DBG("previous request of %s still in progress, query dropped\n", printmac(buff + 6));
+    return(-1);
+  }
+  /* process frame */
+  len = process(ctx, cacheptr, buff, len);
+  /* update cache entry */
+  if (len >= 0) {
+    cacheptr->len = len;
+  } else {
+    cacheptr->len = 0;
+  }
+  /* */
+  DBG("---------------------------------\n");
+  if (len > 0) {
+    /* fill in frame's length */
+    cacheptr->frame[52] = len & 0xff;
+    cacheptr->frame[53] = (len >> 8) & 0xff;
+    /* fill in checksum into the answer */
+    if (cksumflag != 0) {
+      unsigned char kind = (crcflag != 0) ? CKS_CRC32C : CKS_BSD;
+      cacheptr->frame[56] |= 128; /* make sure to set the CKS bit */
+      /* compute the checksum unless already known (answer checksummed
+       * while it was built, or re-sent from the cache) */
+      if (cacheptr->cksumkind != kind) {
+        cacheptr->cksum = framecksum(cacheptr->frame + 56, len - 56, crcflag);
+        cacheptr->cksumkind = kind;
+      }
+      cacheptr->frame[54] = cacheptr->cksum & 0xff;
+      cacheptr->frame[55] = (cacheptr->cksum >> 8) & 0xff;
+    } else {
+      cacheptr->frame[54] = 0;
+      cacheptr->frame[55] = 0;
+      cacheptr->frame[56] &= 127; /* make sure to reset the CKS bit */
+      cacheptr->cksumkind = CKS_NONE;
+    }
+#if DEBUG > 0
+    DBG("Sending back an answer of %d bytes\n", len);
+    dumpframe(cacheptr->frame, len);
+#endif
+    memcpy(answcopy, cacheptr->frame, len);
+    *answer = answcopy;
+  } else {
+    log_msg(LOG_WARNING, "Query ignored (result: %d)\n", len);
+  }
+  pthread_mutex_lock(&(ctx->lock));
+  if (len >= 0) clientptr->timestamp = time(NULL);
+  cacheptr->busy = 0;
+  clientptr->busy--;
+  pthread_mutex_unlock(&(ctx->lock));
+  DBG("---------------------------------\n");
+  return(len);
+}
+
+/* builds an invalidation frame for the next client watching a directory
+ * that changed. The frame looks like an answer with DFS_NOTIFYFLAG set in
+ * its version byte and AX=FFFFh, followed by the drive number and the DOS
+ * path of the directory. It is checksummed like the requests the client
+ * registered with. */
+int dfs_notification(struct dfsctx *ctx, unsigned char *frame) {
+  char dospath[WATCH_DOSMAX];
+  unsigned char mac[6];
+  unsigned short cksum;
+  int drv, cksumkind, len;
+  if (watch_nextchange(ctx->watches, mac, &drv, &cksumkind, dospath) == 0) {
+    memset(frame, 0, 61);
+    memcpy(frame, mac, 6);
+    memcpy(frame + 6, ctx->mymac, 6);
+    ((unsigned short *)frame)[6] = htons(ETHERTYPE_DFS);
+    frame[56] = PROTOVER | DFS_NOTIFYFLAG;
+    frame[58] = 0xff; /* AX = FFFFh */
+    frame[59] = 0xff;
+    frame[60] = drv;
+    len = strlen(dospath);
+    memcpy(frame + 61, dospath, len);
+    len += 61;
+    frame[52] = len & 0xff;
+    frame[53] = (len >> 8) & 0xff;
+    if (cksumkind != CKS_NONE) {
+      frame[56] |= 128;
+      cksum = framecksum(frame + 56, len - 56, cksumkind == CKS_CRC32C);
+      frame[54] = cksum & 0xff;
+      frame[55] = (cksum >> 8) & 0xff;
+    }
+    DBG("notifying %s about a change in %c:%s\n", printmac(mac), 'A' + drv, dospath);
+    return(len);
+  }
+  return(0);
+}
+
+
+const char *dfs_opname(int query) {
+  if ((query < 0) || (query >= DFS_OPMAX) || (optable[query] == NULL)) return(NULL);
+  return(optable[query]->name);
+}
+
+
+/* prints per-opcode counters of ctx to fd */
+void dfs_printopstats(struct dfsctx *ctx, FILE *fd) {
+  int i;
+  fprintf(fd, "ops:");
+  for (i = 0; dfsops[i].handler != NULL; i++) {
+    struct dfsopstats *s = &(ctx->opstats[dfsops[i].query]);
+    unsigned long calls = __atomic_load_n(&(s->calls), __ATOMIC_RELAXED);
+    unsigned long errors = __atomic_load_n(&(s->errors), __ATOMIC_RELAXED);
+    if (calls == 0) continue;
+    fprintf(fd, " %s %lu", dfsops[i].name, calls);
+    if (errors != 0) fprintf(fd, " (%lu err)", errors);
+  }
+  fprintf(fd, "\n");
+}
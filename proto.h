@@ -0,0 +1,143 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2017, 2018 Mateusz Viste
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * the EtherDFS protocol engine: turns request frames into answer frames.
+ * It does not know about sockets, so it can be driven by ethersrv's main
+ * loop as well as embedded in an emulator, a fuzzer or a benchmark.
+ */
+
+#ifndef PROTO_H_SENTINEL
+#define PROTO_H_SENTINEL
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define ETHERTYPE_DFS 0xEDF5
+
+/* protocol version (single byte, must be in sync with etherdfs) */
+#define PROTOVER 2
+
+/* largest ethernet frame I am allowed to send (without FCS) */
+#define FRAME_MAX 1514
+
+/* size of a buffer able to hold any notification frame */
+#define DFS_NOTIFYMAX 160
+
+/* set in the version byte (offset 56) of notification frames, so clients
+ * tell them apart from answers: every seq value may belong to a request in
+ * flight, and the reqdrv byte is overwritten by AX in answers */
+#define DFS_NOTIFYFLAG 0x40
+
+/* request flags, carried in the 3 highest bits of the reqdrv byte. These are
+ * ethersrv extensions, a vanilla EtherDFS client always leaves them at 0. */
+#define RQF_EXT    1 /* opcode-specific extension (see README.TXT) */
+#define RQF_WINDOW 2 /* client pipelines several requests (windowed mode) */
+#define RQF_CRC32C 4 /* checksums are CRC32C instead of BSD sums */
+
+/* answer cache - last answers sent to clients - used if said client didn't
+ * receive my answer, and re-sends his requests so I don't process this
+ * request again (which might be dangerous in case of write requests, like
+ * write to file, delete file, rename file, etc. For every client that ever
+ * sent me a query, there is exactly one entry in the cache. A regular client
+ * has a single request in flight and uses only the first slot of its entry,
+ * while a client running in windowed mode (RQF_WINDOW) may pipeline up to
+ * ANSWWINDOW requests, each answer being kept in slot (seq % ANSWWINDOW). */
+#define ANSWCACHESZ 16
+#define ANSWWINDOW 8
+struct struct_answcache {
+  unsigned char frame[1520]; /* entire frame that was sent (first 6 bytes is the client's mac) */
+  unsigned short len;  /* frame's length */
+  unsigned short cksum; /* checksum of the frame, valid if cksumkind != CKS_NONE */
+  unsigned char cksumkind; /* kind of checksum stored in cksum (CKS_xxx) */
+  int busy;            /* a request is being processed into the slot */
+};
+struct struct_answclient {
+  unsigned char mac[6];
+  time_t timestamp; /* time of last answer (so if cache full I can drop oldest) */
+  int busy;         /* requests being processed, the entry must stay */
+  struct struct_answcache slot[ANSWWINDOW];
+};
+
+/* file I/O of at least this many bytes is considered a bulk transfer */
+#define DFS_BULKMIN 512
+
+/* opcodes (AL values) are all below this */
+#define DFS_OPMAX 0x30
+
+/* per-opcode counters */
+struct dfsopstats {
+  unsigned long calls;  /* queries answered */
+  unsigned long errors; /* ...out of which with a non-zero AX */
+};
+
+/* server context: everything the engine needs to answer requests. Several
+ * contexts may live in one process, they share nothing. */
+struct dfsctx {
+  pthread_mutex_t lock;        /* protects the answer cache */
+  char *root[26];              /* host directory of each drive, or NULL */
+  unsigned char drivesfat[26]; /* non-zero if the drive is FAT-based */
+  unsigned char mymac[6];      /* my mac address, source of all answers */
+  unsigned long answcachehits; /* answers re-sent from the cache (atomic) */
+  struct fsdb *fsdb;           /* ids of files and dirs given to clients */
+  struct watchtab *watches;    /* directories clients asked to watch */
+  struct struct_answclient answcache[ANSWCACHESZ];
+  struct dfsopstats opstats[DFS_OPMAX]; /* updated atomically */
+  /* optional hook, called after each answered query with its AL, the
+   * resulting AX and the answer's payload length. It runs in the thread
+   * that answered the query, with no lock held: queries of different
+   * drives may call it concurrently. */
+  void (*ophook)(struct dfsctx *ctx, int query, unsigned short ax, int reslen);
+};
+
+/* initializes server context ctx, answering as mac address mymac. returns
+ * 0 on success, non-zero if out of memory. */
+int dfs_init(struct dfsctx *ctx, const unsigned char *mymac);
+
+/* releases everything server context ctx holds */
+void dfs_free(struct dfsctx *ctx);
+
+/* maps host directory path to drive drv (2=C:, 3=D:, ...). returns 0 on
+ * success, non-zero if the path cannot be resolved. */
+int dfs_adddrive(struct dfsctx *ctx, int drv, const char *path);
+
+/* handles a request frame of len bytes. On success *answer points to the
+ * answer frame (valid until the calling thread handles another request)
+ * and its length is returned. Returns 0 or a negative value if there is
+ * nothing to send back, which is also the case of a request arriving while
+ * the previous one of the same client (or window slot) is still being
+ * processed. Requests for different drives may be handled by concurrent
+ * threads, as long as no two drives share host directories. */
+int dfs_handleframe(struct dfsctx *ctx, unsigned char *frame, int len, unsigned char **answer);
+
+/* builds into frame (at least DFS_NOTIFYMAX bytes) the next pending
+ * invalidation notification. returns its length, or 0 if none is pending. */
+int dfs_notification(struct dfsctx *ctx, unsigned char *frame);
+
+/* returns the number of clients known to the answer cache */
+int dfs_clientcount(struct dfsctx *ctx);
+
+/* returns how many bytes of file data the request frame of len bytes reads
+ * or writes, 0 for anything else (metadata, directory listings...). Reads
+ * and writes of at least DFS_BULKMIN bytes are bulk transfers, everything
+ * else is interactive. */
+int dfs_iosize(const unsigned char *frame, int len);
+
+/* returns where on disk the data read or written by the request frame of
+ * len bytes lies (see fs_location()), 0 if unknown or not a read/write */
+unsigned long long dfs_location(struct dfsctx *ctx, const unsigned char *frame, int len);
+
+/* prints per-opcode counters of ctx to fd */
+void dfs_printopstats(struct dfsctx *ctx, FILE *fd);
+
+/* returns the name of query (AL), or NULL if it is not a known one */
+const char *dfs_opname(int query);
+
+/* generates a formatted MAC address printout and returns a static buffer */
+char *printmac(unsigned char *b);
+
+#endif
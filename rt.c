@@ -0,0 +1,143 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * latency tuning of the host: pinning threads to CPUs, real-time scheduling
+ * and memory locking, so tail latencies do not depend on what else runs on
+ * a shared host
+ */
+
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+  #define _GNU_SOURCE        /* cpu_set_t, sched_setaffinity() */
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>           /* SCHED_FIFO, SCHED_RR, sched_setaffinity() */
+#include <stdlib.h>          /* strtol() */
+#include <string.h>
+#include <sys/mman.h>        /* mlockall() */
+#if defined(__FreeBSD__)
+  #include <sys/param.h>
+  #include <sys/cpuset.h>    /* cpuset_setaffinity() */
+#endif
+#if defined(__GLIBC__)
+  #include <malloc.h>        /* mallopt() */
+#endif
+
+#include "rt.h" /* include self for control */
+
+/* how many CPUs may be listed */
+#define RT_CPUSMAX 64
+
+/* how much stack (bytes) is faulted in once memory is locked */
+#define RT_STACKPREFAULT 262144
+
+static int cpus[RT_CPUSMAX];
+static int cpucount;
+static int policy = -1; /* SCHED_FIFO or SCHED_RR, -1 = unchanged */
+static int priority;
+
+int rt_pincpu(int cpu) {
+#if defined(__FreeBSD__)
+  cpuset_t set;
+  if ((cpu < 0) || (cpu >= CPU_SETSIZE)) {
+    errno = EINVAL;
+    return(-1);
+  }
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return(cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1, sizeof(set), &set));
+#elif defined(__APPLE__)
+  /* macOS only knows affinity hints, that do not pin anything */
+  errno = (cpu < 0) ? EINVAL : ENOTSUP;
+  return(-1);
+#else
+  cpu_set_t set;
+  if ((cpu < 0) || (cpu >= CPU_SETSIZE)) {
+    errno = EINVAL;
+    return(-1);
+  }
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return(sched_setaffinity(0, sizeof(set), &set));
+#endif
+}
+
+int rt_setcpus(const char *spec) {
+  char *end;
+  long cpu;
+  cpucount = 0;
+  for (;;) {
+    cpu = strtol(spec, &end, 10);
+    if ((end == spec) || (cpu < 0) || (cpucount == RT_CPUSMAX)) return(-1);
+    cpus[cpucount++] = cpu;
+    if (*end == 0) return(0);
+    if (*end != ',') return(-1);
+    spec = end + 1;
+  }
+}
+
+int rt_setpolicy(const char *spec) {
+  char *end;
+  long prio;
+  if (strncmp(spec, "fifo:", 5) == 0) {
+    policy = SCHED_FIFO;
+    spec += 5;
+  } else if (strncmp(spec, "rr:", 3) == 0) {
+    policy = SCHED_RR;
+    spec += 3;
+  } else {
+    return(-1);
+  }
+  prio = strtol(spec, &end, 10);
+  if ((end == spec) || (*end != 0)) return(-1);
+  if ((prio < sched_get_priority_min(policy)) || (prio > sched_get_priority_max(policy))) return(-1);
+  priority = prio;
+  return(0);
+}
+
+int rt_apply(int n) {
+  struct sched_param param;
+  int cpu, err;
+  if (cpucount > 0) {
+    cpu = cpus[0];
+    if ((n > 0) && (cpucount > 1)) cpu = cpus[1 + (n - 1) % (cpucount - 1)];
+    if (rt_pincpu(cpu) != 0) return(-1);
+  }
+  if (policy >= 0) {
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    err = pthread_setschedparam(pthread_self(), policy, &param);
+    if (err != 0) {
+      errno = err;
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+/* writes to every page of the next RT_STACKPREFAULT bytes of stack */
+static void prefaultstack(void) {
+  unsigned char buf[RT_STACKPREFAULT];
+  volatile unsigned char *p = buf; /* so the writes are not optimized out */
+  int i;
+  for (i = 0; i < RT_STACKPREFAULT; i += 4096) p[i] = 0;
+}
+
+int rt_lockmem(void) {
+#if defined(__GLIBC__)
+  /* never give heap memory back to the system, it would have to be faulted
+   * in again later, and serve big allocations from the (locked) heap */
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+#endif
+  /* this faults in all that is mapped already, the file database and other
+   * static tables included, and whatever gets mapped later (buffers,
+   * thread stacks) as soon as it is */
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) return(-1);
+  prefaultstack();
+  return(0);
+}
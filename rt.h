@@ -0,0 +1,35 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#ifndef RT_H_SENTINEL
+#define RT_H_SENTINEL
+
+/* pins the calling thread to CPU cpu. returns 0 on success, non-zero
+ * otherwise (errno is set). */
+int rt_pincpu(int cpu);
+
+/* sets the CPUs threads are pinned to, from a comma-separated list: the
+ * first one is for the main loop, the next ones are shared in turn by the
+ * drive workers (or the first one is used by all, if it is alone). returns
+ * 0 on success, non-zero if spec is invalid. */
+int rt_setcpus(const char *spec);
+
+/* sets the real-time scheduling policy of all threads, from "fifo:prio" or
+ * "rr:prio". returns 0 on success, non-zero if spec is invalid. */
+int rt_setpolicy(const char *spec);
+
+/* applies the CPU and scheduling policy set up for thread n (0 = main
+ * loop, 1 and up = drive workers) to the calling thread. returns 0 on
+ * success, non-zero otherwise (errno is set). */
+int rt_apply(int n);
+
+/* locks all memory of the process, present and future, and faults in the
+ * stack, so that serving a request never waits for a page fault. returns 0
+ * on success, non-zero otherwise (errno is set). */
+int rt_lockmem(void);
+
+#endif
@@ -0,0 +1,534 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * request scheduler: frames read from the network wait here until served,
+ * so small interactive queries (DIR, opening a program...) do not have to
+ * wait behind bulk transfers, and no single client can monopolize the
+ * server. Clients are served by start-time fair queueing: each one has a
+ * virtual time that grows with the work done for it, divided by its weight,
+ * and the client with the lowest virtual time goes next. Optional caps hold
+ * a client's requests back once it used up its bandwidth or request rate.
+ * Each request also has a deadline: the time its client will give up and
+ * send it again, learned from the retransmits seen so far. Requests about
+ * to miss it jump the queue, those that missed it already go last. Bulk
+ * transfers of a drive are served in the order of their position on disk,
+ * like an elevator, as long as this does not delay any of them for long.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>          /* strtoul() */
+#include <string.h>
+
+#include "proto.h"           /* FRAME_MAX, printmac() */
+#include "stats.h"           /* stats_now(), stats_queuetime() */
+#include "sched.h" /* include self for control */
+
+/* how many frames may wait at most - beyond this they are dropped, and the
+ * client sends them again. A drive may fill at most half of the room the
+ * other drives leave, so that a slow drive cannot lock the others out. */
+#define SCHED_MAX 128
+
+/* how many frames a single client may have waiting. A client never has
+ * more than ANSWWINDOW requests in flight, anything beyond that are
+ * duplicates. */
+#define SCHED_CLIENTQ 16
+
+/* how many frames the clients sharing a cap may have waiting while the cap
+ * holds them back, and how many such frames may wait in all. Their next
+ * frames are dropped, so that capped clients do not fill the queue. */
+#define SCHED_HELD 4
+#define SCHED_HELDMAX (SCHED_MAX / 4)
+
+/* how many clients I keep track of */
+#define SCHED_CLIENTS 64
+
+#define RULESMAX 8
+
+/* starvation protection: a bulk request is served after this many
+ * interactive ones in a row, or once it waited for that long (us) */
+#define SCHED_BURST 8
+#define SCHED_BULKWAIT 50000
+
+/* how long (us) the elevator may hold a bulk transfer back to serve the
+ * ones next to the disk head first */
+#define SCHED_SEEKWAIT 20000
+
+/* how long a client waits for an answer before it sends its request again
+ * (us), until I learn the actual value from its retransmits. Once requests
+ * wait in the queue for longer than their clients' timeouts, the server is
+ * overloaded: requests are answered after their client gave up on them. */
+#define SCHED_TIMEOUT 100000
+
+/* retransmits that come sooner than this (us) are not caused by a timeout
+ * (duplicated frames...) and do not tell anything about it */
+#define SCHED_TIMEOUTMIN 10000
+
+/* how many recently served requests I remember per client, to recognize
+ * their retransmits. Matches the window of pipelined requests. */
+#define SCHED_RECENT 8
+
+/* fixed cost of a request, in bytes, on top of the file data it moves. It
+ * stands for the CPU and disk seek work any request takes. */
+#define SCHED_REQCOST 512
+
+/* how much unused cap (in us worth of rate) a client may save for a burst */
+#define SCHED_CAPBURST 100000
+
+/* a cap, as the times (us) from which the next byte and the next request
+ * may be served */
+struct bucket {
+  unsigned long long bytefree;
+  unsigned long long opfree;
+  int queued;                /* frames waiting of the clients it caps */
+};
+
+static struct schedrule {
+  int maclen;                /* mac prefix length, 0 = applies to all clients */
+  unsigned char mac[6];
+  unsigned long weight;
+  unsigned long rate;        /* bytes per second, 0 = unlimited */
+  unsigned long iops;        /* requests per second, 0 = unlimited */
+  struct bucket group;       /* cap shared by all clients of a mac rule */
+} rules[RULESMAX];
+static int rulescount;
+
+static struct schedclient {
+  unsigned char mac[6];
+  int used;
+  int queued;                /* frames waiting */
+  unsigned long long vtime;  /* virtual time, in weighted bytes */
+  unsigned long long lastseen; /* us */
+  struct schedrule *rule;    /* NULL if no rule applies */
+  struct bucket own;         /* cap of a client matched by a catch-all rule */
+  unsigned long timeout;     /* learned retransmit timeout (us) */
+  struct {                   /* recently served requests, by seq % SCHED_RECENT */
+    unsigned char seq, al;
+    unsigned long long rx;   /* when first received (us), 0 = none */
+  } recent[SCHED_RECENT];
+  unsigned long requests;    /* served during the interval */
+  unsigned long long bytes;  /* file data moved, same interval */
+  unsigned long throttled;   /* frames held back by the cap, same interval */
+} clients[SCHED_CLIENTS];
+
+static struct schedentry {
+  unsigned char frame[FRAME_MAX];
+  int len;              /* 0 if the entry is free */
+  int cls;              /* SCHED_xxx class */
+  int iosize;           /* bytes of file data read or written */
+  struct schedclient *client;
+  unsigned long long queued; /* when the frame was received (us) */
+  unsigned long long lastrx; /* when it was last received, retransmits included */
+  unsigned long long deadline; /* when the client will send it again */
+  unsigned long long where; /* position of its data on disk, 0 = unknown */
+} queue[SCHED_MAX];
+
+static int pending;   /* frames waiting */
+static int held;      /* frames waiting of capped clients */
+static int drivepending[32]; /* frames waiting, per drive */
+static unsigned long busydrives; /* drives that cannot take a request now */
+static unsigned long long drivehead[32]; /* where the last bulk transfer of each drive ended */
+static int burst;     /* interactive requests served in a row while bulk waits */
+static unsigned long long vclock; /* virtual time of the last served client */
+static unsigned long qdelay;  /* average queueing delay (us) */
+
+/* shedding counters, since the last report */
+static struct {
+  unsigned long duplicates; /* retransmits of a request still queued */
+  unsigned long expired;    /* requests that waited past the client timeout */
+  unsigned long dropped;    /* frames refused, the queue being full */
+  unsigned long overcap;    /* frames refused, their client being over its cap */
+  unsigned long late;       /* requests served past their deadline */
+} shed;
+
+/* parses a mac address, or the first bytes of one, in XX:XX:XX notation.
+ * returns the number of bytes parsed, or -1 on error */
+static int parsemacprefix(unsigned char *mac, const char *s) {
+  int res = 0;
+  char *end;
+  for (;;) {
+    unsigned long b = strtoul(s, &end, 16);
+    if ((end == s) || (end - s > 2) || (res == 6)) return(-1);
+    mac[res++] = b;
+    if (*end == 0) return(res);
+    if (*end != ':') return(-1);
+    s = end + 1;
+  }
+}
+
+int sched_addrule(const char *spec) {
+  struct schedrule r;
+  char buf[256];
+  char *tok, *val;
+  if (rulescount >= RULESMAX) return(-1);
+  if (strlen(spec) >= sizeof(buf)) return(-1);
+  strcpy(buf, spec);
+  memset(&r, 0, sizeof(r));
+  r.weight = 1;
+  for (tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    val = strchr(tok, '=');
+    if (val == NULL) return(-1);
+    *val = 0;
+    val++;
+    if (strcmp(tok, "mac") == 0) {
+      r.maclen = parsemacprefix(r.mac, val);
+      if (r.maclen < 0) return(-1);
+    } else if (strcmp(tok, "weight") == 0) {
+      r.weight = strtoul(val, NULL, 10);
+      if ((r.weight < 1) || (r.weight > 1000)) return(-1);
+    } else if (strcmp(tok, "rate") == 0) {
+      r.rate = strtoul(val, NULL, 10);
+    } else if (strcmp(tok, "iops") == 0) {
+      r.iops = strtoul(val, NULL, 10);
+    } else {
+      return(-1);
+    }
+  }
+  rules[rulescount++] = r;
+  return(0);
+}
+
+/* returns the client entry of mac, allocating one if needed, or NULL */
+static struct schedclient *getclient(const unsigned char *mac, unsigned long long now) {
+  struct schedclient *c, *res = NULL;
+  int i;
+  for (i = 0; i < SCHED_CLIENTS; i++) {
+    c = &(clients[i]);
+    if ((c->used != 0) && (memcmp(c->mac, mac, 6) == 0)) return(c);
+    /* remember the free entry, or the idle one that was seen the longest ago */
+    if (c->queued != 0) continue;
+    if ((res == NULL) || (res->used != 0 && ((c->used == 0) || (c->lastseen < res->lastseen)))) res = c;
+  }
+  if (res == NULL) return(NULL);
+  memset(res, 0, sizeof(*res));
+  memcpy(res->mac, mac, 6);
+  res->used = 1;
+  res->vtime = vclock;
+  res->lastseen = now;
+  res->timeout = SCHED_TIMEOUT;
+  for (i = 0; i < rulescount; i++) {
+    if (memcmp(rules[i].mac, mac, rules[i].maclen) != 0) continue;
+    res->rule = &(rules[i]);
+    break;
+  }
+  return(res);
+}
+
+/* returns the cap bucket of client c */
+static struct bucket *getbucket(struct schedclient *c) {
+  if (c->rule->maclen != 0) return(&(c->rule->group));
+  return(&(c->own));
+}
+
+/* returns the time (us) from which client c may be served, 0 if now */
+static unsigned long long freeat(struct schedclient *c) {
+  struct bucket *b;
+  unsigned long long res = 0;
+  if (c->rule == NULL) return(0);
+  b = getbucket(c);
+  if ((c->rule->rate != 0) && (b->bytefree > res)) res = b->bytefree;
+  if ((c->rule->iops != 0) && (b->opfree > res)) res = b->opfree;
+  return(res);
+}
+
+/* accounts a served request of iosize bytes to client c */
+static void charge(struct schedclient *c, int iosize, unsigned long long now) {
+  unsigned long weight = 1;
+  c->requests++;
+  c->bytes += iosize;
+  if (c->rule != NULL) {
+    struct bucket *b = getbucket(c);
+    weight = c->rule->weight;
+    /* unused cap may be saved, but only for a short burst */
+    if (b->bytefree + SCHED_CAPBURST < now) b->bytefree = now - SCHED_CAPBURST;
+    if (b->opfree + SCHED_CAPBURST < now) b->opfree = now - SCHED_CAPBURST;
+    if (c->rule->rate != 0) b->bytefree += (unsigned long long)iosize * 1000000 / c->rule->rate;
+    if (c->rule->iops != 0) b->opfree += 1000000 / c->rule->iops;
+  }
+  vclock = c->vtime;
+  c->vtime += (unsigned long long)(SCHED_REQCOST + iosize) * 256 / weight;
+}
+
+/* returns non-zero if the requests of client c are served more slowly on
+ * purpose, because of its caps */
+static int capped(struct schedclient *c) {
+  return((c->rule != NULL) && ((c->rule->rate != 0) || (c->rule->iops != 0)));
+}
+
+/* removes entry e from the queue */
+static void unqueue(struct schedentry *e) {
+  e->client->queued--;
+  if (capped(e->client) != 0) {
+    getbucket(e->client)->queued--;
+    held--;
+  }
+  drivepending[e->frame[58] & 31]--;
+  e->len = 0;
+  pending--;
+}
+
+/* learns from a retransmit received at time rx of a request first received
+ * at time firstrx how long client c waits for answers */
+static void learntimeout(struct schedclient *c, unsigned long long firstrx, unsigned long long rx) {
+  unsigned long sample;
+  if (rx < firstrx + SCHED_TIMEOUTMIN) return;
+  sample = rx - firstrx;
+  c->timeout = (c->timeout * 3 + sample) / 4;
+}
+
+int sched_push(const unsigned char *frame, int len, int cls, int iosize, unsigned long long where, unsigned long age) {
+  struct schedclient *c;
+  unsigned long long now, rx;
+  int i, drv = frame[58] & 31;
+  if (len > FRAME_MAX) len = FRAME_MAX;
+  now = stats_now();
+  if (age > now) age = 0;
+  rx = now - age;
+  /* a retransmit of a request that is still queued only tells me the
+   * client still waits for it. The work is done once, for the retransmit. */
+  for (i = 0; i < SCHED_MAX; i++) {
+    if ((queue[i].len != len) || (memcmp(queue[i].frame + 6, frame + 6, len - 6) != 0)) continue;
+    learntimeout(queue[i].client, queue[i].lastrx, rx);
+    queue[i].lastrx = rx;
+    queue[i].deadline = rx + queue[i].client->timeout;
+    shed.duplicates++;
+    return(0);
+  }
+  c = getclient(frame + 6, now);
+  /* retransmit of a request I answered already? (the answer got lost, or
+   * came too late) */
+  if (c != NULL) {
+    i = frame[57] % SCHED_RECENT;
+    if ((c->recent[i].rx != 0) && (c->recent[i].seq == frame[57]) && (c->recent[i].al == frame[59])) {
+      learntimeout(c, c->recent[i].rx, rx);
+      c->recent[i].rx = 0;
+    }
+  }
+  /* a client held back by its cap gets only a few frames queued, the
+   * others are better read again once the cap allows them to be served */
+  if ((c != NULL) && (freeat(c) > now) && ((getbucket(c)->queued >= SCHED_HELD) || (held >= SCHED_HELDMAX))) {
+    c->throttled++;
+    shed.overcap++;
+    return(-1);
+  }
+  /* no room: the queue is full, the client has too many frames waiting, or
+   * the drive has taken its share of the queue */
+  if ((c == NULL) || (c->queued >= SCHED_CLIENTQ) || (pending >= SCHED_MAX) || (drivepending[drv] * 2 >= SCHED_MAX - (pending - drivepending[drv]))) {
+    shed.dropped++;
+    return(-1);
+  }
+  for (i = 0; queue[i].len != 0; i++);
+  memcpy(queue[i].frame, frame, len);
+  queue[i].len = len;
+  queue[i].cls = cls;
+  queue[i].iosize = iosize;
+  queue[i].client = c;
+  queue[i].queued = rx;
+  queue[i].lastrx = rx;
+  queue[i].deadline = rx + c->timeout;
+  queue[i].where = where;
+  if (freeat(c) > now) c->throttled++;
+  /* a client that was idle does not get credit for the time it did not use */
+  if ((c->queued == 0) && (c->vtime < vclock)) c->vtime = vclock;
+  c->queued++;
+  c->lastseen = now;
+  if (capped(c) != 0) {
+    getbucket(c)->queued++;
+    held++;
+  }
+  pending++;
+  drivepending[drv]++;
+  return(0);
+}
+
+int sched_drivedepth(int drv) {
+  return(drivepending[drv & 31]);
+}
+
+/* returns non-zero if entry e cannot be served now, because its client is
+ * held back by a cap or its drive is busy */
+static int blocked(const struct schedentry *e, unsigned long long now) {
+  if ((busydrives >> (e->frame[58] & 31)) & 1) return(1);
+  return(freeat(e->client) > now);
+}
+
+/* returns the entry of class cls to serve first: the oldest one of the
+ * client with the lowest virtual time, among clients not held back by a
+ * cap. Requests past their deadline are skipped unless late is set.
+ * returns -1 if there is none. */
+static int pick(int cls, unsigned long long now, int late) {
+  int i, res = -1;
+  struct schedentry *e, *r;
+  for (i = 0; i < SCHED_MAX; i++) {
+    e = &(queue[i]);
+    if ((e->len == 0) || (e->cls != cls)) continue;
+    if (blocked(e, now) != 0) continue;
+    if ((late == 0) && (e->deadline < now)) continue;
+    if (res >= 0) {
+      r = &(queue[res]);
+      if (e->client->vtime > r->client->vtime) continue;
+      if ((e->client->vtime == r->client->vtime) && (e->queued >= r->queued)) continue;
+    }
+    res = i;
+  }
+  return(res);
+}
+
+/* returns the entry closest to its deadline among those that would miss it
+ * if served after the other ones, or -1 if none is in such a hurry */
+static int urgent(unsigned long long now) {
+  int i, res = -1;
+  struct schedentry *e;
+  for (i = 0; i < SCHED_MAX; i++) {
+    e = &(queue[i]);
+    if ((e->len == 0) || (e->deadline < now)) continue;
+    if (blocked(e, now) != 0) continue;
+    /* less than a quarter of the timeout left */
+    if (e->deadline - now > e->client->timeout / 4) continue;
+    if ((res >= 0) && (e->deadline >= queue[res].deadline)) continue;
+    res = i;
+  }
+  return(res);
+}
+
+/* remembers served entry e, to recognize its retransmits later */
+static void remember(struct schedentry *e) {
+  int i = e->frame[57] % SCHED_RECENT;
+  e->client->recent[i].seq = e->frame[57];
+  e->client->recent[i].al = e->frame[59];
+  e->client->recent[i].rx = e->queued;
+}
+
+/* elevator: returns the bulk entry of the drive of entry b (the one fair
+ * queueing chose) that comes next on disk after the previous transfer,
+ * sweeping upwards and starting over from the lowest position. b itself is
+ * returned if it waited for too long already, or if its position is not
+ * known. late is as for pick(). */
+static int elevator(int b, unsigned long long now, int late) {
+  int i, drv, res = -1, lowest = -1;
+  struct schedentry *e;
+  if ((queue[b].where == 0) || (now - queue[b].queued >= SCHED_SEEKWAIT)) return(b);
+  drv = queue[b].frame[58] & 31;
+  for (i = 0; i < SCHED_MAX; i++) {
+    e = &(queue[i]);
+    if ((e->len == 0) || (e->cls != SCHED_BULK) || (e->where == 0)) continue;
+    if ((e->frame[58] & 31) != drv) continue;
+    if (blocked(e, now) != 0) continue;
+    if ((late == 0) && (e->deadline < now)) continue;
+    if ((e->where >= drivehead[drv]) && ((res < 0) || (e->where < queue[res].where))) res = i;
+    if ((lowest < 0) || (e->where < queue[lowest].where)) lowest = i;
+  }
+  if (res < 0) res = lowest; /* b at least is there */
+  return(res);
+}
+
+/* returns the entry to serve next by class and fair share, or -1 */
+static int choose(unsigned long long now) {
+  int i, b, late = 0;
+  i = pick(SCHED_INTERACTIVE, now, 0);
+  b = pick(SCHED_BULK, now, 0);
+  /* requests past their deadline go last, their retransmit is on its way */
+  if ((i < 0) && (b < 0)) {
+    late = 1;
+    i = pick(SCHED_INTERACTIVE, now, 1);
+    b = pick(SCHED_BULK, now, 1);
+  }
+  if (b >= 0) {
+    /* bulk goes first if nothing else waits, or if it starves */
+    if ((i < 0) || (burst >= SCHED_BURST) || (now - queue[b].queued >= SCHED_BULKWAIT)) {
+      i = elevator(b, now, late);
+      burst = 0;
+    } else {
+      burst++;
+    }
+  } else {
+    burst = 0;
+  }
+  return(i);
+}
+
+/* returns the shortest learned timeout (us) of clients with requests
+ * waiting */
+static unsigned long activetimeout(void) {
+  unsigned long res = 0;
+  int i;
+  for (i = 0; i < SCHED_CLIENTS; i++) {
+    if ((clients[i].used == 0) || (clients[i].queued == 0)) continue;
+    if ((res == 0) || (clients[i].timeout < res)) res = clients[i].timeout;
+  }
+  if (res == 0) res = SCHED_TIMEOUT;
+  return(res);
+}
+
+int sched_pop(unsigned char *frame, unsigned long busy) {
+  int i, len;
+  unsigned long long now;
+  if (pending == 0) return(0);
+  busydrives = busy;
+  now = stats_now();
+  /* overloaded? then drop requests the client already gave up on, it will
+   * send them again. Serving them would only delay fresher requests past
+   * their own timeout. */
+  if (qdelay > activetimeout()) {
+    for (i = 0; i < SCHED_MAX; i++) {
+      if ((queue[i].len == 0) || (queue[i].deadline >= now)) continue;
+      unqueue(&(queue[i]));
+      shed.expired++;
+    }
+  }
+  /* a request about to miss its deadline goes first, whatever its class */
+  i = urgent(now);
+  if (i < 0) i = choose(now);
+  if (i < 0) return(0); /* everything waiting is held back */
+  if (queue[i].deadline < now) shed.late++;
+  remember(&(queue[i]));
+  len = queue[i].len;
+  memcpy(frame, queue[i].frame, len);
+  stats_queuetime(queue[i].cls, now - queue[i].queued);
+  /* capped clients wait on purpose, this is not a sign of overload */
+  if (capped(queue[i].client) == 0) qdelay = (qdelay * 7 + (now - queue[i].queued)) / 8;
+  charge(queue[i].client, queue[i].iosize, now);
+  if (queue[i].where != 0) drivehead[queue[i].frame[58] & 31] = queue[i].where + queue[i].iosize;
+  unqueue(&(queue[i]));
+  return(len);
+}
+
+long sched_nextdue(unsigned long busy) {
+  int i, found = 0;
+  unsigned long long t, now, first = 0;
+  if (pending == 0) return(-1);
+  for (i = 0; i < SCHED_MAX; i++) {
+    if (queue[i].len == 0) continue;
+    /* frames of a busy drive wait for the drive, not for the clock */
+    if ((busy >> (queue[i].frame[58] & 31)) & 1) continue;
+    t = freeat(queue[i].client);
+    if ((found == 0) || (t < first)) first = t;
+    found = 1;
+  }
+  if (found == 0) return(-1);
+  now = stats_now();
+  if (first <= now) return(0);
+  return((long)((first - now + 999) / 1000));
+}
+
+void sched_printstats(FILE *fd) {
+  struct schedclient *c;
+  int i;
+  if ((shed.duplicates | shed.expired | shed.dropped | shed.overcap | shed.late) != 0) {
+    fprintf(fd, "shed: %lu duplicates, %lu expired, %lu dropped (queue full), %lu dropped (over cap), %lu served late, queue delay %lu us\n", shed.duplicates, shed.expired, shed.dropped, shed.overcap, shed.late, qdelay);
+  }
+  memset(&shed, 0, sizeof(shed));
+  if (rulescount == 0) return;
+  fprintf(fd, "clients:");
+  for (i = 0; i < SCHED_CLIENTS; i++) {
+    c = &(clients[i]);
+    if ((c->used == 0) || (c->requests == 0)) continue;
+    fprintf(fd, " %s %lu req %lu KiB (weight %lu, %lu capped, timeout %lu ms)", printmac(c->mac), c->requests, (unsigned long)(c->bytes / 1024), (c->rule != NULL) ? c->rule->weight : 1, c->throttled, c->timeout / 1000);
+    c->requests = 0;
+    c->bytes = 0;
+    c->throttled = 0;
+  }
+  fprintf(fd, "\n");
+}
@@ -0,0 +1,52 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#ifndef SCHED_H_SENTINEL
+#define SCHED_H_SENTINEL
+
+#include <stdio.h>
+
+/* request classes */
+#define SCHED_INTERACTIVE 0 /* metadata queries, directory listings, small I/O */
+#define SCHED_BULK        1 /* large reads and writes */
+#define SCHED_CLASSES     2
+
+/* parses a client rule (see README.TXT for the syntax) that sets the share
+ * weight and the bandwidth or request rate caps of a client or a group of
+ * clients. returns 0 on success, non-zero otherwise. */
+int sched_addrule(const char *spec);
+
+/* queues a copy of frame (len bytes) of class cls, that reads or writes
+ * iosize bytes of file data at disk position where (0 if unknown) and was
+ * received age us ago. A retransmit of a
+ * request that is queued already is merged into it. returns 0 on success,
+ * non-zero if the frame cannot be queued (it is then dropped, and the client
+ * will retransmit). */
+int sched_push(const unsigned char *frame, int len, int cls, int iosize, unsigned long long where, unsigned long age);
+
+/* returns the number of frames waiting for drive drv */
+int sched_drivedepth(int drv);
+
+/* fetches the next frame to serve into frame, skipping frames for the
+ * drives set in the busy bitmask (bit n = drive n). Interactive requests go
+ * first, unless a bulk request waits for too long, and clients get served
+ * in proportion of their weights. When overloaded, requests that waited
+ * past the client timeout are dropped. returns its length, or 0 if nothing
+ * can be served now. */
+int sched_pop(unsigned char *frame, unsigned long busy);
+
+/* returns the number of milliseconds until a frame held back by a client's
+ * cap may be served, or -1 if no frame is held back. Frames for the drives
+ * set in the busy bitmask are not considered. */
+long sched_nextdue(unsigned long busy);
+
+/* prints shedding counters of the last interval to fd if anything was
+ * shed, per-client counters if any client rule is set, and starts a new
+ * interval */
+void sched_printstats(FILE *fd);
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * runtime statistics: resource usage and request latencies, reported
+ * periodically so leaks and slow drifts show up on long-running servers.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>           /* fcntl() */
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>    /* getrusage() */
+#include <time.h>            /* clock_gettime() */
+#include <unistd.h>          /* sysconf() */
+
+#include "fs.h"              /* fsdb_stats() */
+#include "proto.h"           /* struct dfsctx, dfs_clientcount() */
+#include "sched.h"           /* SCHED_xxx classes */
+#include "watch.h"           /* watch_count() */
+#include "stats.h" /* include self for control */
+
+/* how many reports in a row must show a growing RSS before I complain */
+#define DRIFT_REPORTS 10
+
+/* log2 histogram: bucket n counts samples within [2^(n-1)..2^n) us */
+struct hist {
+  unsigned long bucket[32];
+  unsigned long count, max;
+};
+
+static struct hist lathist;                /* request latencies */
+static struct hist queuehist[SCHED_CLASSES]; /* time spent in the scheduler */
+
+/* queueing jitter, as RFC 3550 defines it for packet arrivals: a running
+ * average of the difference between the queue times of consecutive
+ * requests, in 1/16 us. It shows how steady the wakeups of the server are. */
+static unsigned long jitter16, lastqueue;
+
+/* per-drive service times, and queue depths seen when requests were handed
+ * to the drive */
+static struct {
+  struct hist lat;
+  unsigned long depthcount, depthsum, depthmax;
+} drivestats[26];
+
+static unsigned long firstp99;   /* p99 of the first report with traffic */
+static unsigned long lastrss;
+static int rssgrowth;            /* reports in a row with a growing RSS */
+
+unsigned long long stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void histadd(struct hist *h, unsigned long us) {
+  int b = 0;
+  while ((b < 31) && ((1ul << b) <= us)) b++;
+  h->bucket[b]++;
+  h->count++;
+  if (us > h->max) h->max = us;
+}
+
+void stats_latency(unsigned long us) {
+  histadd(&lathist, us);
+}
+
+void stats_queuetime(int cls, unsigned long us) {
+  unsigned long d = (us > lastqueue) ? us - lastqueue : lastqueue - us;
+  histadd(&queuehist[cls], us);
+  jitter16 += d - ((jitter16 + 8) >> 4);
+  lastqueue = us;
+}
+
+void stats_drivetime(int drv, unsigned long us) {
+  if ((drv < 0) || (drv > 25)) return;
+  histadd(&(drivestats[drv].lat), us);
+}
+
+void stats_drivedepth(int drv, int depth) {
+  if ((drv < 0) || (drv > 25)) return;
+  drivestats[drv].depthcount++;
+  drivestats[drv].depthsum += depth;
+  if ((unsigned long)depth > drivestats[drv].depthmax) drivestats[drv].depthmax = depth;
+}
+
+/* returns the upper bound (in us) of the bucket holding percentile p */
+static unsigned long percentile(const struct hist *h, int p) {
+  unsigned long target, seen = 0;
+  int b;
+  if (h->count == 0) return(0);
+  target = (h->count * p + 99) / 100;
+  for (b = 0; b < 32; b++) {
+    seen += h->bucket[b];
+    if (seen >= target) break;
+  }
+  if (b == 0) return(1);
+  return(1ul << b);
+}
+
+/* returns the resident set size of the process, in KiB */
+static unsigned long getrss(void) {
+  unsigned long pages, rsspages;
+  FILE *fd = fopen("/proc/self/statm", "rb");
+  if (fd != NULL) {
+    int r = fscanf(fd, "%lu %lu", &pages, &rsspages);
+    fclose(fd);
+    if (r == 2) return(rsspages * (sysconf(_SC_PAGESIZE) / 1024));
+  }
+  { /* no procfs: fall back to the peak RSS */
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return(0);
+  #if defined(__APPLE__)
+    return(ru.ru_maxrss / 1024); /* bytes on macOS */
+  #else
+    return(ru.ru_maxrss);
+  #endif
+  }
+}
+
+/* returns the number of open file descriptors */
+static int getfdcount(void) {
+  int res = 0, i;
+  DIR *dp = opendir("/dev/fd");
+  if (dp != NULL) {
+    struct dirent *d;
+    while ((d = readdir(dp)) != NULL) {
+      if (d->d_name[0] != '.') res++;
+    }
+    closedir(dp);
+    return(res - 1); /* do not count the descriptor of the listing itself */
+  }
+  for (i = 0; i < 1024; i++) {
+    if (fcntl(i, F_GETFD) != -1) res++;
+  }
+  return(res);
+}
+
+int stats_report(FILE *fd, struct dfsctx *ctx) {
+  unsigned long fsdbitems, fsdbdirents, rss, p50, p90, p99;
+  int i, drives = 0, drift = 0;
+  rss = getrss();
+  fsdb_stats(ctx->fsdb, &fsdbitems, &fsdbdirents);
+  p50 = percentile(&lathist, 50);
+  p90 = percentile(&lathist, 90);
+  p99 = percentile(&lathist, 99);
+  fprintf(fd, "stats: rss %lu KiB, %d fds, fsdb %lu items (%lu dir entries), answer cache %d clients, %d watches, %lu requests, latency p50 <%lu us p90 <%lu us p99 <%lu us max %lu us\n",
+          rss, getfdcount(), fsdbitems, fsdbdirents, dfs_clientcount(ctx), watch_count(ctx->watches), lathist.count, p50, p90, p99, lathist.max);
+  if (queuehist[SCHED_INTERACTIVE].count + queuehist[SCHED_BULK].count != 0) {
+    fprintf(fd, "stats: queue time interactive %lu requests p50 <%lu us p99 <%lu us max %lu us, bulk %lu requests p50 <%lu us p99 <%lu us max %lu us, jitter %lu us\n",
+            queuehist[SCHED_INTERACTIVE].count, percentile(&queuehist[SCHED_INTERACTIVE], 50), percentile(&queuehist[SCHED_INTERACTIVE], 99), queuehist[SCHED_INTERACTIVE].max,
+            queuehist[SCHED_BULK].count, percentile(&queuehist[SCHED_BULK], 50), percentile(&queuehist[SCHED_BULK], 99), queuehist[SCHED_BULK].max, jitter16 >> 4);
+  }
+  for (i = 0; i < 26; i++) {
+    struct hist *h = &(drivestats[i].lat);
+    unsigned long n = drivestats[i].depthcount;
+    if ((h->count == 0) || (n == 0)) continue;
+    fprintf(fd, "%s %c: %lu requests p50 <%lu us p99 <%lu us max %lu us depth avg %lu.%lu max %lu", (drives++ == 0) ? "drives:" : ",", 'A' + i, h->count, percentile(h, 50), percentile(h, 99), h->max,
+            drivestats[i].depthsum / n, (drivestats[i].depthsum * 10 / n) % 10, drivestats[i].depthmax);
+  }
+  if (drives != 0) fprintf(fd, "\n");
+  /* drift detection */
+  if ((lastrss != 0) && (rss > lastrss)) {
+    rssgrowth++;
+  } else {
+    rssgrowth = 0;
+  }
+  lastrss = rss;
+  if (rssgrowth >= DRIFT_REPORTS) {
+    fprintf(fd, "WARNING: memory usage grew in each of the last %d reports\n", rssgrowth);
+    drift = 1;
+  }
+  if (lathist.count != 0) {
+    if (firstp99 == 0) {
+      firstp99 = (p99 < 1000) ? 1000 : p99; /* ignore drifts below 1 ms */
+    } else if (p99 > firstp99 * 4) {
+      fprintf(fd, "WARNING: p99 latency drifted from <%lu us to <%lu us\n", firstp99, p99);
+      drift = 1;
+    }
+  }
+  fflush(fd);
+  /* start a new interval */
+  memset(&lathist, 0, sizeof(lathist));
+  memset(queuehist, 0, sizeof(queuehist));
+  memset(drivestats, 0, sizeof(drivestats));
+  return(drift);
+}
@@ -0,0 +1,39 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#ifndef STATS_H_SENTINEL
+#define STATS_H_SENTINEL
+
+#include <stdio.h>
+
+struct dfsctx; /* proto.h */
+
+/* returns a monotonic timestamp, in microseconds */
+unsigned long long stats_now(void);
+
+/* records the time (in microseconds) it took to serve one request */
+void stats_latency(unsigned long us);
+
+/* records the time (in microseconds) a request of scheduler class cls
+ * waited in the queue before being served */
+void stats_queuetime(int cls, unsigned long us);
+
+/* records the time (in microseconds) drive drv (2=C:, 3=D:...) took to
+ * serve one request */
+void stats_drivetime(int drv, unsigned long us);
+
+/* records how many requests for drive drv were waiting (the one handed to
+ * it included) when the drive got a request */
+void stats_drivedepth(int drv, int depth);
+
+/* prints a report line about resource usage of server context ctx and
+ * latencies observed since the previous report to fd, followed by a
+ * warning if memory or latency keep drifting. returns non-zero if a drift
+ * was reported. */
+int stats_report(FILE *fd, struct dfsctx *ctx);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * keeps track of directories recently looked at by clients that asked to be
+ * notified about changes, so they can cache directory listings and file
+ * attributes safely. Changes are picked up from ethersrv's own write paths
+ * and, on Linux, from inotify (for changes made by the host itself).
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>      /* calloc(), free() */
+#include <string.h>
+#include <time.h>        /* time() */
+#include <unistd.h>      /* read(), close() */
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+  #include <sys/inotify.h>
+#endif
+
+#include "debug.h"
+#include "fs.h"          /* DIR_MAX */
+#include "watch.h" /* include self for control */
+
+#define WATCHMAX 256
+
+struct swatch {
+  unsigned char mac[6];
+  unsigned char drv;
+  unsigned char changed; /* non-zero if a notification is due */
+  unsigned char cksum;   /* kind of checksum the client uses, as given to watch_add() */
+  time_t lastseen;       /* 0 means the slot is free */
+  int wd;                /* inotify watch descriptor, or -1 */
+  char dospath[WATCH_DOSMAX];
+  char hostdir[DIR_MAX];
+};
+
+/* the watch table of a server context */
+struct watchtab {
+  struct swatch watches[WATCHMAX];
+  int watchcount;        /* number of slots in use */
+  int inotifyfd;
+  /* the table is updated by the threads serving drives, and read by the
+   * main thread when it builds notifications */
+  pthread_mutex_t lock;
+};
+
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO)
+#endif
+
+/* copies directory d into dst, without any trailing slashes */
+static void normdir(char *dst, const char *d) {
+  int l = strlen(d);
+  if (l >= DIR_MAX) l = DIR_MAX - 1;
+  while ((l > 1) && (d[l - 1] == '/')) l--;
+  memcpy(dst, d, l);
+  dst[l] = 0;
+}
+
+/* releases watch slot i of wt, and its inotify watch if nobody else uses it */
+static void dropwatch(struct watchtab *wt, int i) {
+  struct swatch *watches = wt->watches;
+  int j;
+  if (watches[i].wd >= 0) {
+    for (j = 0; j < WATCHMAX; j++) {
+      if ((j != i) && (watches[j].lastseen != 0) && (watches[j].wd == watches[i].wd)) break;
+    }
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+    if (j == WATCHMAX) inotify_rm_watch(wt->inotifyfd, watches[i].wd);
+#endif
+  }
+  memset(&(watches[i]), 0, sizeof(struct swatch));
+  watches[i].wd = -1;
+  wt->watchcount--;
+}
+
+struct watchtab *watch_new(void) {
+  struct watchtab *wt;
+  int i;
+  wt = calloc(1, sizeof(struct watchtab));
+  if (wt == NULL) return(NULL);
+  for (i = 0; i < WATCHMAX; i++) wt->watches[i].wd = -1;
+  wt->inotifyfd = -1;
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+  wt->inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (wt->inotifyfd < 0) {
+    DBG("inotify not available, only own changes will be notified\n");
+  }
+#endif
+  pthread_mutex_init(&(wt->lock), NULL);
+  return(wt);
+}
+
+void watch_free(struct watchtab *wt) {
+  if (wt == NULL) return;
+  /* closing the inotify descriptor drops all of its watches */
+  if (wt->inotifyfd >= 0) close(wt->inotifyfd);
+  pthread_mutex_destroy(&(wt->lock));
+  free(wt);
+}
+
+int watch_fd(struct watchtab *wt) {
+  return(wt->inotifyfd);
+}
+
+void watch_add(struct watchtab *wt, unsigned char *mac, int drv, int cksum, char *dospath, int dospathlen, char *hostdir) {
+  int i, freeslot = -1, oldest = 0;
+  char dir[DIR_MAX];
+  struct swatch *watches = wt->watches;
+  time_t now = time(NULL);
+  normdir(dir, hostdir);
+  if (dospathlen >= WATCH_DOSMAX) return; /* DOS paths are never that long */
+  pthread_mutex_lock(&(wt->lock));
+  for (i = 0; i < WATCHMAX; i++) {
+    if (watches[i].lastseen == 0) {
+      if (freeslot < 0) freeslot = i;
+      continue;
+    }
+    /* expire stale watches on the way */
+    if (now - watches[i].lastseen > WATCH_TTL) {
+      dropwatch(wt, i);
+      if (freeslot < 0) freeslot = i;
+      continue;
+    }
+    if ((memcmp(watches[i].mac, mac, 6) == 0) && (watches[i].drv == drv) && (strcmp(watches[i].hostdir, dir) == 0)) {
+      watches[i].lastseen = now; /* already known, refresh it */
+      watches[i].cksum = cksum;
+      pthread_mutex_unlock(&(wt->lock));
+      return;
+    }
+    if (watches[i].lastseen < watches[oldest].lastseen) oldest = i;
+  }
+  /* table full: recycle the oldest watch */
+  if (freeslot < 0) {
+    dropwatch(wt, oldest);
+    freeslot = oldest;
+  }
+  i = freeslot;
+  memcpy(watches[i].mac, mac, 6);
+  watches[i].drv = drv;
+  watches[i].cksum = cksum;
+  watches[i].changed = 0;
+  watches[i].lastseen = now;
+  memcpy(watches[i].dospath, dospath, dospathlen);
+  watches[i].dospath[dospathlen] = 0;
+  strcpy(watches[i].hostdir, dir);
+  watches[i].wd = -1;
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+  if (wt->inotifyfd >= 0) watches[i].wd = inotify_add_watch(wt->inotifyfd, dir, WATCH_EVENTS);
+#endif
+  wt->watchcount++;
+  DBG("client watches '%s' (%s)\n", watches[i].dospath, dir);
+  pthread_mutex_unlock(&(wt->lock));
+}
+
+/* copies the directory part of hostitem into dst, returns 0 on success */
+static int parentdir(char *dst, char *hostitem) {
+  char *lastslash;
+  if (hostitem == NULL) return(-1);
+  normdir(dst, hostitem);
+  lastslash = strrchr(dst, '/');
+  if (lastslash == NULL) return(-1);
+  if (lastslash == dst) lastslash++; /* item in the file system root */
+  *lastslash = 0;
+  return(0);
+}
+
+void watch_additem(struct watchtab *wt, unsigned char *mac, int drv, int cksum, char *dospath, int dospathlen, char *hostitem) {
+  char dir[DIR_MAX];
+  if (parentdir(dir, hostitem) == 0) watch_add(wt, mac, drv, cksum, dospath, dospathlen, dir);
+}
+
+void watch_touchdir(struct watchtab *wt, char *hostdir) {
+  int i;
+  char dir[DIR_MAX];
+  struct swatch *watches = wt->watches;
+  normdir(dir, hostdir);
+  pthread_mutex_lock(&(wt->lock));
+  for (i = 0; (wt->watchcount != 0) && (i < WATCHMAX); i++) {
+    if ((watches[i].lastseen != 0) && (strcmp(watches[i].hostdir, dir) == 0)) watches[i].changed = 1;
+  }
+  pthread_mutex_unlock(&(wt->lock));
+}
+
+void watch_touchitem(struct watchtab *wt, char *hostitem) {
+  char dir[DIR_MAX];
+  if (parentdir(dir, hostitem) == 0) watch_touchdir(wt, dir);
+}
+
+int watch_count(struct watchtab *wt) {
+  return(wt->watchcount);
+}
+
+void watch_readevents(struct watchtab *wt) {
+#if !defined(__FreeBSD__) && !defined(__APPLE__)
+  /* aligned the way inotify(7) suggests */
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  struct swatch *watches = wt->watches;
+  long len, off;
+  int i;
+  if (wt->inotifyfd < 0) return;
+  while ((len = read(wt->inotifyfd, buf, sizeof(buf))) > 0) {
+    for (off = 0; off < len; off += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event *)(buf + off);
+      pthread_mutex_lock(&(wt->lock));
+      for (i = 0; i < WATCHMAX; i++) {
+        if ((watches[i].lastseen != 0) && (watches[i].wd == ev->wd)) watches[i].changed = 1;
+      }
+      pthread_mutex_unlock(&(wt->lock));
+    }
+  }
+#endif
+}
+
+int watch_nextchange(struct watchtab *wt, unsigned char *mac, int *drv, int *cksum, char *dospath) {
+  struct swatch *watches = wt->watches;
+  int i, res = -1;
+  time_t now = time(NULL);
+  pthread_mutex_lock(&(wt->lock));
+  for (i = 0; (wt->watchcount != 0) && (i < WATCHMAX); i++) {
+    if ((watches[i].lastseen == 0) || (watches[i].changed == 0)) continue;
+    watches[i].changed = 0;
+    if (now - watches[i].lastseen > WATCH_TTL) { /* client lost interest */
+      dropwatch(wt, i);
+      continue;
+    }
+    memcpy(mac, watches[i].mac, 6);
+    *drv = watches[i].drv;
+    *cksum = watches[i].cksum;
+    strcpy(dospath, watches[i].dospath);
+    res = 0;
+    break;
+  }
+  pthread_mutex_unlock(&(wt->lock));
+  return(res);
+}
@@ -0,0 +1,58 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#ifndef WATCH_H_SENTINEL
+#define WATCH_H_SENTINEL
+
+/* how long (in seconds) a client stays interested in a directory after it
+ * last looked at it */
+#define WATCH_TTL 120
+
+/* maximum length of a DOS directory path kept in a watch */
+#define WATCH_DOSMAX 80
+
+/* a watch table: the directories clients of a server context watch */
+struct watchtab;
+
+/* allocates an empty watch table (with its own inotify instance, where
+ * available). returns NULL if out of memory */
+struct watchtab *watch_new(void);
+
+/* frees watch table wt */
+void watch_free(struct watchtab *wt);
+
+/* returns a file descriptor that becomes readable when host file system
+ * events are pending for wt, or -1 if not supported */
+int watch_fd(struct watchtab *wt);
+
+/* registers client mac as interested in directory hostdir, known to the
+ * client as dospath (dospathlen bytes, not null-terminated) on drive drv.
+ * cksum is the kind of checksum the client uses, kept for its
+ * notifications. */
+void watch_add(struct watchtab *wt, unsigned char *mac, int drv, int cksum, char *dospath, int dospathlen, char *hostdir);
+
+/* same as watch_add(), but for the directory containing host item hostitem */
+void watch_additem(struct watchtab *wt, unsigned char *mac, int drv, int cksum, char *dospath, int dospathlen, char *hostitem);
+
+/* flags all watches of directory hostdir as changed */
+void watch_touchdir(struct watchtab *wt, char *hostdir);
+
+/* flags all watches of the directory that contains hostitem as changed */
+void watch_touchitem(struct watchtab *wt, char *hostitem);
+
+/* returns the number of watches currently registered */
+int watch_count(struct watchtab *wt);
+
+/* reads pending events from watch_fd() and flags affected watches */
+void watch_readevents(struct watchtab *wt);
+
+/* fetches the next watch flagged as changed and resets its flag. fills mac,
+ * drv, cksum and dospath (null-terminated). returns 0 if one found,
+ * non-zero when nothing left to notify. */
+int watch_nextchange(struct watchtab *wt, unsigned char *mac, int *drv, int *cksum, char *dospath);
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ *
+ * per-drive workers: each drive is served by its own thread, so requests
+ * for a drive on a fast disk never wait behind a slow one (USB, NFS...).
+ * The main thread keeps doing all the network work. It hands one request at
+ * a time to a worker, which wakes it up through a pipe once the answer is
+ * ready.
+ */
+
+#include <errno.h>
+#include <fcntl.h>           /* fcntl() */
+#include <pthread.h>
+#include <signal.h>          /* pthread_sigmask() */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>          /* pipe(), read(), write() */
+
+#include "debug.h"
+#include "log.h"             /* log_msg() */
+#include "prof.h"            /* prof_thread(), prof_stage() */
+#include "rt.h"              /* rt_apply() */
+#include "stats.h"           /* stats_now() */
+#include "worker.h" /* include self for control */
+
+/* worker states */
+#define WORKER_IDLE    0
+#define WORKER_REQUEST 1 /* a request waits to be handled */
+#define WORKER_DONE    2 /* the answer waits to be collected */
+
+/* stack size of a worker. Kept well below the system default, as all of it
+ * gets faulted in when memory is locked (-m). */
+#define WORKER_STACK 1048576
+
+static struct worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int state;               /* WORKER_xxx, protected by lock */
+  int inflight;            /* submitted and not collected yet (main thread only) */
+  unsigned long drives;    /* bitmask of the drives it serves */
+  int drv;                 /* drive of the current request */
+  unsigned char frame[FRAME_MAX]; /* the request, then its answer */
+  int len;
+  unsigned long us;        /* time spent on the request */
+} workers[26];
+static int workercount;
+
+static struct dfsctx *workerctx;
+static signed char driveworker[26]; /* worker of each drive, or -1 (once started) */
+static int wakepipe[2] = {-1, -1};
+
+static void *workerloop(void *arg) {
+  struct worker *w = arg;
+  unsigned char *answer;
+  unsigned long long start;
+  char name[16];
+  int len, drv = 0;
+  /* named after the first drive it serves (set before it was started) */
+  while (((w->drives >> drv) & 1) == 0) drv++;
+  sprintf(name, "drive %c", 'A' + drv);
+  prof_thread(name);
+  if (rt_apply(1 + (int)(w - workers)) != 0) {
+    log_msg(LOG_WARNING, "WARNING: failed to set the CPU or priority of a drive worker (%s)\n", strerror(errno));
+  }
+  for (;;) {
+    prof_stage(PROF_POLL, 0);
+    pthread_mutex_lock(&(w->lock));
+    while (w->state != WORKER_REQUEST) pthread_cond_wait(&(w->cond), &(w->lock));
+    pthread_mutex_unlock(&(w->lock));
+    prof_stage(PROF_HANDLE, w->frame[59]);
+    start = stats_now();
+    len = dfs_handleframe(workerctx, w->frame, w->len, &answer);
+    if (len > 0) memcpy(w->frame, answer, len);
+    w->len = len;
+    w->us = stats_now() - start;
+    pthread_mutex_lock(&(w->lock));
+    w->state = WORKER_DONE;
+    pthread_mutex_unlock(&(w->lock));
+    prof_stage(PROF_TRANSMIT, 0);
+    /* wake up the main thread (if the pipe is full, it is awake anyway) */
+    if (write(wakepipe[1], "", 1) < 0) {
+      DBG("ERROR: write(): %s\n", strerror(errno));
+    }
+  }
+  return(NULL);
+}
+
+/* returns non-zero if host directories a and b overlap (one contains the
+ * other) */
+static int overlaps(const char *a, const char *b) {
+  while ((*a != 0) && (*a == *b)) {
+    a++;
+    b++;
+  }
+  if ((*a == 0) && (*b == 0)) return(1);
+  if (*a == 0) return((*b == '/') || (a[-1] == '/'));
+  if (*b == 0) return((*a == '/') || (b[-1] == '/'));
+  return(0);
+}
+
+int worker_start(struct dfsctx *ctx) {
+  int drv, other, i;
+  sigset_t all, prev;
+  pthread_attr_t attr;
+  workerctx = ctx;
+  if (pipe(wakepipe) != 0) return(-1);
+  for (i = 0; i < 2; i++) fcntl(wakepipe[i], F_SETFL, fcntl(wakepipe[i], F_GETFL) | O_NONBLOCK);
+  /* signals are for the main thread, workers must not catch them */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &prev);
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WORKER_STACK);
+  for (drv = 0; drv < 26; drv++) {
+    driveworker[drv] = -1;
+    if (ctx->root[drv] == NULL) continue;
+    /* drives sharing host directories share fsdb items, hence a thread */
+    for (other = 0; other < drv; other++) {
+      if ((driveworker[other] >= 0) && (overlaps(ctx->root[other], ctx->root[drv]) != 0)) break;
+    }
+    if (other < drv) {
+      driveworker[drv] = driveworker[other];
+      workers[driveworker[drv]].drives |= 1ul << drv;
+      continue;
+    }
+    i = workercount;
+    pthread_mutex_init(&(workers[i].lock), NULL);
+    pthread_cond_init(&(workers[i].cond), NULL);
+    workers[i].drives = 1ul << drv;
+    if (pthread_create(&(workers[i].thread), &attr, workerloop, &(workers[i])) != 0) break;
+    pthread_detach(workers[i].thread);
+    driveworker[drv] = i;
+    workercount++;
+  }
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+  pthread_attr_destroy(&attr);
+  if (drv < 26) return(-1);
+  return(0);
+}
+
+int worker_fd(void) {
+  return(wakepipe[0]);
+}
+
+unsigned long worker_busy(void) {
+  unsigned long res = 0;
+  int i;
+  for (i = 0; i < workercount; i++) {
+    if (workers[i].inflight != 0) res |= workers[i].drives;
+  }
+  return(res);
+}
+
+int worker_submit(const unsigned char *frame, int len) {
+  struct worker *w;
+  int drv = frame[58] & 31;
+  if ((workercount == 0) || (drv > 25) || (driveworker[drv] < 0)) return(-1);
+  w = &(workers[(int)driveworker[drv]]);
+  if (len > FRAME_MAX) len = FRAME_MAX;
+  memcpy(w->frame, frame, len);
+  w->len = len;
+  w->drv = drv;
+  w->inflight = 1;
+  pthread_mutex_lock(&(w->lock));
+  w->state = WORKER_REQUEST;
+  pthread_cond_signal(&(w->cond));
+  pthread_mutex_unlock(&(w->lock));
+  return(0);
+}
+
+int worker_collect(unsigned char *frame, int *len, int *drv, unsigned long *us) {
+  char buf[64];
+  int i, state;
+  struct worker *w;
+  /* consume wake-ups, the states below tell what is done */
+  while (read(wakepipe[0], buf, sizeof(buf)) > 0);
+  for (i = 0; i < workercount; i++) {
+    w = &(workers[i]);
+    if (w->inflight == 0) continue;
+    pthread_mutex_lock(&(w->lock));
+    state = w->state;
+    if (state == WORKER_DONE) w->state = WORKER_IDLE;
+    pthread_mutex_unlock(&(w->lock));
+    if (state != WORKER_DONE) continue;
+    *len = w->len;
+    if (w->len > 0) memcpy(frame, w->frame, w->len);
+    *drv = w->drv;
+    *us = w->us;
+    w->inflight = 0;
+    return(1);
+  }
+  return(0);
+}
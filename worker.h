@@ -0,0 +1,36 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2023-2025 E. Voirin (oerg866)
+ */
+
+#ifndef WORKER_H_SENTINEL
+#define WORKER_H_SENTINEL
+
+#include "proto.h"
+
+/* starts one thread per drive mapped in ctx, drives whose host directories
+ * overlap sharing the same thread. returns 0 on success, non-zero
+ * otherwise. */
+int worker_start(struct dfsctx *ctx);
+
+/* returns a descriptor that becomes readable when a worker is done with its
+ * request, or -1 if no worker runs */
+int worker_fd(void);
+
+/* returns the bitmask of drives (bit n = drive n) whose worker is busy */
+unsigned long worker_busy(void);
+
+/* hands the request frame (len bytes) to the worker of its drive, that
+ * must not be busy. returns 0 on success, non-zero if no worker serves the
+ * drive. */
+int worker_submit(const unsigned char *frame, int len);
+
+/* fetches the result of a worker that is done into frame (FRAME_MAX bytes):
+ * *len is set to the answer's length (0 or negative if there is nothing to
+ * send back), *drv to the drive and *us to the time it took. returns
+ * non-zero if a result was fetched, 0 if no worker is done. */
+int worker_collect(unsigned char *frame, int *len, int *drv, unsigned long *us);
+
+#endif